@@ -0,0 +1,282 @@
+// image16Test - A program that checks the image16bit module.
+//
+// It builds a 12-bit image (maxval 4095), saves it and loads it back,
+// checks the big-endian bytes of the file, and compares the results of
+// some operations with those computed here pixel by pixel.
+// It prints nothing and exits with status 0 if all checks pass.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image16bit.h"
+
+#define MAXVAL 4095
+
+// Odd sizes, so the vector kernels also have leftover pixels.
+#define WIDTH 301
+#define HEIGHT 203
+
+// The level of pixel (x, y) in the test image.
+static uint16 level(int x, int y) {
+  return (uint16)((x * 37 + y * 101 + x * y) % (MAXVAL + 1));
+}
+
+// Fail with a message if condition is false.
+static void expect(int condition, const char* what) {
+  if (!condition) {
+    error(3, 0, "%s: check failed", what);
+  }
+}
+
+// Is img the test image?
+static int isTestImage(Image16 img) {
+  if (Image16Width(img) != WIDTH || Image16Height(img) != HEIGHT ||
+      Image16Maxval(img) != MAXVAL) {
+    return 0;
+  }
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      if (Image16GetPixel(img, x, y) != level(x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+// Check the file saved from the test image: a raw header, then 2 bytes
+// per pixel, most significant first.
+static void checkFile(const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    error(2, errno, "Opening %s", filename);
+  }
+  char header[32];
+  int len = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", WIDTH, HEIGHT, MAXVAL);
+  char read[32];
+  expect(fread(read, 1, (size_t)len, f) == (size_t)len && memcmp(read, header, (size_t)len) == 0,
+         "Image16Save header");
+  int ok = 1;
+  for (int y = 0; y < HEIGHT && ok; y++) {
+    for (int x = 0; x < WIDTH && ok; x++) {
+      int hi = getc(f);
+      int lo = getc(f);
+      ok = (hi != EOF && lo != EOF && (hi << 8 | lo) == level(x, y));
+    }
+  }
+  expect(ok && getc(f) == EOF, "Image16Save big-endian levels");
+  fclose(f);
+}
+
+// Write the test image as a plain (P2) file.
+static void savePlain(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    error(2, errno, "Opening %s", filename);
+  }
+  fprintf(f, "P2\n# plain\n%d %d\n%d\n", WIDTH, HEIGHT, MAXVAL);
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      fprintf(f, "%d%c", level(x, y), (x + 1 < WIDTH) ? ' ' : '\n');
+    }
+  }
+  if (fclose(f) != 0) {
+    error(2, errno, "Writing %s", filename);
+  }
+}
+
+// Load filename, which must hold the test image.
+static void checkLoad(const char* filename, const char* what) {
+  Image16 img = Image16Load(filename);
+  if (img == NULL) {
+    error(2, errno, "Loading %s: %s", filename, Image16ErrMsg());
+  }
+  expect(isTestImage(img), what);
+  Image16Destroy(&img);
+}
+
+// Check Image16Blur(img, dx, dy) against the mean of each window, rounded
+// with halves up, computed directly from the test image.
+static void checkBlur(Image16 img, int dx, int dy) {
+  Image16Blur(img, dx, dy);
+  int ok = 1;
+  for (int y = 0; y < HEIGHT && ok; y++) {
+    for (int x = 0; x < WIDTH && ok; x++) {
+      unsigned long sum = 0;
+      unsigned long count = 0;
+      for (int j = y - dy; j <= y + dy; j++) {
+        for (int i = x - dx; i <= x + dx; i++) {
+          if (0 <= i && i < WIDTH && 0 <= j && j < HEIGHT) {
+            sum += level(i, j);
+            count++;
+          }
+        }
+      }
+      ok = Image16GetPixel(img, x, y) == (uint16)((2 * sum + count) / (2 * count));
+    }
+  }
+  expect(ok, "Image16Blur");
+}
+
+// Load filename, saved from the test image, to be changed by a check.
+static Image16 loadTestImage(const char* filename) {
+  Image16 img = Image16Load(filename);
+  if (img == NULL) {
+    error(2, errno, "Loading %s: %s", filename, Image16ErrMsg());
+  }
+  return img;
+}
+
+// Check Image16Brighten(img, factor) against each level times factor,
+// rounded and saturated at MAXVAL.
+static void checkBrighten(Image16 img, double factor) {
+  Image16Brighten(img, factor);
+  int ok = 1;
+  for (int y = 0; y < HEIGHT && ok; y++) {
+    for (int x = 0; x < WIDTH && ok; x++) {
+      double v = level(x, y) * factor + 0.5;
+      uint16 expected = (v >= MAXVAL) ? MAXVAL : (v > 0.0) ? (uint16)v : 0;
+      ok = Image16GetPixel(img, x, y) == expected;
+    }
+  }
+  expect(ok, "Image16Brighten");
+}
+
+// Check Image16Blend(img, x0, y0, img2, alpha) pixel by pixel: the
+// rectangle of img2 gets the rounded weighted mean, saturated at 0 and
+// MAXVAL, and the rest of the test image is unchanged.
+// (alpha 1 is a paste, checked with Image16Paste as well.)
+static void checkBlend(Image16 img, int x0, int y0, Image16 img2, double alpha) {
+  int w = Image16Width(img2);
+  int h = Image16Height(img2);
+  if (alpha == 1.0) {
+    Image16Paste(img, x0, y0, img2);
+  } else {
+    Image16Blend(img, x0, y0, img2, alpha);
+  }
+  int ok = 1;
+  for (int y = 0; y < HEIGHT && ok; y++) {
+    for (int x = 0; x < WIDTH && ok; x++) {
+      uint16 expected = level(x, y);
+      if (x0 <= x && x < x0 + w && y0 <= y && y < y0 + h) {
+        double v = alpha * Image16GetPixel(img2, x - x0, y - y0) + (1 - alpha) * level(x, y) + 0.5;
+        expected = (v <= 0.0) ? 0 : (v >= MAXVAL) ? MAXVAL : (uint16)v;
+      }
+      ok = Image16GetPixel(img, x, y) == expected;
+    }
+  }
+  expect(ok, alpha == 1.0 ? "Image16Paste" : "Image16Blend");
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  if (argc != 2) {
+    error(1, 0, "Usage: image16Test scratch.pgm");
+  }
+  const char* filename = argv[1];
+
+  Image16 img = Image16Create(WIDTH, HEIGHT, MAXVAL);
+  if (img == NULL) {
+    error(2, errno, "Creating image: %s", Image16ErrMsg());
+  }
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      Image16SetPixel(img, x, y, level(x, y));
+    }
+  }
+  uint16 min, max;
+  Image16Stats(img, &min, &max);
+  expect(min == 0 && max == MAXVAL, "Image16Stats");
+
+  // Round trips, raw and plain.
+  if (Image16Save(img, filename) == 0) {
+    error(2, errno, "Saving %s: %s", filename, Image16ErrMsg());
+  }
+  expect(isTestImage(img), "Image16Save leaves the image unchanged");
+  checkFile(filename);
+  checkLoad(filename, "Image16Load of a raw file");
+  savePlain(filename);
+  checkLoad(filename, "Image16Load of a plain file");
+
+  // Geometric operations.
+  Image16 rot = Image16Rotate(img);
+  Image16 mir = Image16Mirror(img);
+  Image16 crop = Image16Crop(img, 50, 60, 20, 10);
+  if (rot == NULL || mir == NULL || crop == NULL) {
+    error(2, errno, "%s", Image16ErrMsg());
+  }
+  int ok = Image16Width(rot) == HEIGHT && Image16Height(rot) == WIDTH;
+  for (int j = 0; j < WIDTH && ok; j++) {
+    for (int i = 0; i < HEIGHT && ok; i++) {
+      ok = Image16GetPixel(rot, i, j) == level(WIDTH - 1 - j, i);
+    }
+  }
+  expect(ok, "Image16Rotate");
+  ok = 1;
+  for (int y = 0; y < HEIGHT && ok; y++) {
+    for (int x = 0; x < WIDTH && ok; x++) {
+      ok = Image16GetPixel(mir, x, y) == level(WIDTH - 1 - x, y);
+    }
+  }
+  expect(ok, "Image16Mirror");
+  int x = -1, y = -1;
+  expect(Image16LocateSubImage(img, &x, &y, crop) && x == 50 && y == 60,
+         "Image16LocateSubImage");
+
+  // Point operations.
+  Image16Negative(mir);
+  ok = 1;
+  for (int j = 0; j < HEIGHT && ok; j++) {
+    for (int i = 0; i < WIDTH && ok; i++) {
+      ok = Image16GetPixel(mir, i, j) == MAXVAL - level(WIDTH - 1 - i, j);
+    }
+  }
+  expect(ok, "Image16Negative");
+  Image16Threshold(img, 2048);
+  ok = 1;
+  for (int j = 0; j < HEIGHT && ok; j++) {
+    for (int i = 0; i < WIDTH && ok; i++) {
+      ok = Image16GetPixel(img, i, j) == (level(i, j) >= 2048 ? MAXVAL : 0);
+    }
+  }
+  expect(ok, "Image16Threshold");
+
+  // Brighten, darker and brighter (saturating).
+  Image16Destroy(&img);
+  img = loadTestImage(filename);
+  checkBrighten(img, 0.37);
+  Image16Destroy(&img);
+  img = loadTestImage(filename);
+  checkBrighten(img, 1.7);
+
+  // Paste and blend of the rotated crop of the test image, with weights
+  // that give values on both sides of the range too.
+  Image16 part = Image16Crop(rot, 30, 40, 120, 90);
+  if (part == NULL) {
+    error(2, errno, "%s", Image16ErrMsg());
+  }
+  const double alphas[] = {1.0, 0.3, 0.5, 1.8, -0.6};
+  for (size_t k = 0; k < sizeof(alphas) / sizeof(alphas[0]); k++) {
+    Image16Destroy(&img);
+    img = loadTestImage(filename);
+    checkBlend(img, 170 + (int)k, 100 + (int)k, part, alphas[k]);
+  }
+  Image16Destroy(&part);
+
+  // Blur, with windows smaller and larger than the image.
+  Image16Destroy(&img);
+  img = loadTestImage(filename);
+  checkBlur(img, 3, 2);
+  Image16Destroy(&img);
+  img = loadTestImage(filename);
+  checkBlur(img, 400, 1);
+
+  Image16Destroy(&img);
+  Image16Destroy(&rot);
+  Image16Destroy(&mir);
+  Image16Destroy(&crop);
+  return 0;
+}
@@ -0,0 +1,676 @@
+/// image16bit - 16-bit graymaps, for PGM files with maxval > 255.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// AED, 2023
+
+#include "image16bit.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "instrumentation.h"
+#include "pgm.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+const uint16 PixMax16 = 65535;
+
+// Internal structure for storing 16-bit graymap images
+struct image16
+{
+  int width;
+  int height;
+  int maxval;    // maximum gray value (pixels with maxval are pure WHITE)
+  uint16 *pixel; // pixel data (a raster scan, in host byte order)
+};
+
+// Counts pixel array accesses, as in image8bit (see ImageInit)
+#define PIXMEM InstrCount[0]
+
+// Variable to preserve errno temporarily
+static _Thread_local int errsave = 0;
+
+// Error cause (per thread, like errno)
+static _Thread_local char *errCause;
+char *Image16ErrMsg(void)
+{ ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// Propagates the condition.
+// Preserves global errno!
+static int check(int condition, const char *failmsg)
+{
+  errCause = (char *)(condition ? "" : failmsg);
+  return condition;
+}
+
+// Pointer to the first pixel of row y.
+static inline uint16 *rowPtr(Image16 img, int y)
+{
+  return img->pixel + (size_t)y * img->width;
+}
+
+// Number of pixels of img.
+static inline size_t pixels(Image16 img)
+{
+  return (size_t)img->width * img->height;
+}
+
+/// Byte order
+
+// PGM files are big-endian.  On little-endian hosts, the two bytes of each
+// level are swapped on load and save, 32 or 16 bytes at a time.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SWAP_BYTES 0
+#else
+#define SWAP_BYTES 1
+#endif
+
+// Copy n levels from src to dst, swapping the bytes of each.
+// dst may be the same array as src.
+static void swapBytes(uint16 *dst, const uint16 *src, size_t n)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 16 <= n; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= n; i += 8)
+  {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+    vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(v));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    dst[i] = (uint16)(src[i] << 8 | src[i] >> 8);
+  }
+}
+
+/// Image management functions
+
+Image16 Image16Create(int width, int height, uint16 maxval)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(maxval > 0);
+
+  Image16 img = NULL;
+  size_t count = (size_t)width * height;
+  int success =
+      check((img = (Image16)malloc(sizeof(*img))) != NULL,
+            "Memory allocation for image failed") &&
+      check(count <= SIZE_MAX / sizeof(uint16), "Image too large") &&
+      // calloc: a imagem nova é preta, e o sistema já dá páginas a zero.
+      check((img->pixel = (uint16 *)calloc(count > 0 ? count : 1, sizeof(uint16))) != NULL,
+            "Memory allocation for pixels failed");
+  if (!success)
+  {
+    free(img);
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  return img;
+}
+
+void Image16Destroy(Image16 *imgp)
+{ ///
+  assert(imgp != NULL);
+  if (*imgp == NULL)
+    return;
+  free((*imgp)->pixel);
+  free(*imgp);
+  *imgp = NULL;
+}
+
+/// PGM file operations
+
+// Parse the header of a PGM file (see PGMReadHeader).
+// Returns nonzero on success, or 0 with errCause set.
+static int readHeader(FILE *f, int *w, int *h, int *maxval, int *plain)
+{
+  const char *fail = PGMReadHeader(f, w, h, maxval, plain);
+  return check(fail == NULL, fail);
+}
+
+// Read count raw levels into pixel, 1 or 2 bytes each depending on maxval.
+static int readRaw(FILE *f, uint16 *pixel, size_t count, int maxval)
+{
+  if (maxval > 255)
+  {
+    if (fread(pixel, sizeof(uint16), count, f) != count)
+      return 0;
+    if (SWAP_BYTES)
+      swapBytes(pixel, pixel, count);
+    return 1;
+  }
+  // Um byte por pixel: leia para o início do array e alargue de trás
+  // para a frente, para não escrever sobre bytes ainda por alargar.
+  uint8_t *bytes = (uint8_t *)pixel;
+  if (fread(bytes, 1, count, f) != count)
+    return 0;
+  for (size_t i = count; i-- > 0;)
+  {
+    pixel[i] = bytes[i];
+  }
+  return 1;
+}
+
+// Read count ASCII levels into pixel.
+static int readPlain(FILE *f, uint16 *pixel, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    int v;
+    if (!PGMReadNumber(f, &v) || v > PGM_MAXVAL)
+      return 0;
+    pixel[i] = (uint16)v;
+  }
+  return 1;
+}
+
+// Check that no level exceeds maxval.
+static int levelsValid(const uint16 *pixel, size_t count, int maxval)
+{
+  uint16 max = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    max = (pixel[i] > max) ? pixel[i] : max;
+  }
+  return max <= maxval;
+}
+
+Image16 Image16Load(const char *filename)
+{ ///
+  int w, h;
+  int maxval;
+  int plain;
+  FILE *f = NULL;
+  Image16 img = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse PGM header
+      readHeader(f, &w, &h, &maxval, &plain) &&
+      // Allocate image
+      (img = Image16Create(w, h, (uint16)maxval)) != NULL;
+  size_t count = success ? pixels(img) : 0;
+  success = success &&
+      (plain ? check(readPlain(f, img->pixel, count), "Reading pixels")
+             : check(readRaw(f, img->pixel, count, maxval), "Reading pixels")) &&
+      check(levelsValid(img->pixel, count, maxval), "Invalid pixel level");
+  PIXMEM += (unsigned long)count; // count pixel memory accesses
+
+  // Cleanup
+  if (!success)
+  {
+    errsave = errno;
+    Image16Destroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL)
+    fclose(f);
+  return img;
+}
+
+// Levels converted per write.
+#define SAVE_BLOCK 4096
+
+// Write the raster of img to f, in the byte order of PGM files.
+static int writeRaw(Image16 img, FILE *f)
+{
+  size_t count = pixels(img);
+  if (img->maxval > 255 && !SWAP_BYTES)
+    return fwrite(img->pixel, sizeof(uint16), count, f) == count;
+
+  // Converta por blocos, sem alterar a imagem.
+  union
+  {
+    uint16 wide[SAVE_BLOCK];
+    uint8_t narrow[SAVE_BLOCK];
+  } buf;
+  for (size_t i = 0; i < count; i += SAVE_BLOCK)
+  {
+    size_t n = (count - i < SAVE_BLOCK) ? count - i : SAVE_BLOCK;
+    const uint16 *src = img->pixel + i;
+    size_t written;
+    if (img->maxval > 255)
+    {
+      swapBytes(buf.wide, src, n);
+      written = fwrite(buf.wide, sizeof(uint16), n, f);
+    }
+    else
+    {
+      for (size_t k = 0; k < n; k++)
+      {
+        buf.narrow[k] = (uint8_t)src[k];
+      }
+      written = fwrite(buf.narrow, 1, n, f);
+    }
+    if (written != n)
+      return 0;
+  }
+  return 1;
+}
+
+int Image16Save(Image16 img, const char *filename)
+{ ///
+  assert(img != NULL);
+  FILE *f = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P5\n%d %d\n%d\n", img->width, img->height, img->maxval) > 0,
+            "Writing header failed") &&
+      check(writeRaw(img, f), "Writing pixels failed");
+  PIXMEM += (unsigned long)pixels(img); // count pixel memory accesses
+
+  // Cleanup
+  if (f != NULL)
+    success = check(fclose(f) == 0, "Writing pixels failed") && success;
+  return success;
+}
+
+/// Information queries
+
+int Image16Width(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->width;
+}
+
+int Image16Height(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->height;
+}
+
+int Image16Maxval(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+void Image16Stats(Image16 img, uint16 *min, uint16 *max)
+{ ///
+  assert(img != NULL);
+  size_t count = pixels(img);
+  uint16 lo = (uint16)img->maxval;
+  uint16 hi = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    uint16 v = img->pixel[i];
+    lo = (v < lo) ? v : lo;
+    hi = (v > hi) ? v : hi;
+  }
+  if (count == 0)
+    lo = 0;
+  PIXMEM += (unsigned long)count;
+  *min = lo;
+  *max = hi;
+}
+
+int Image16ValidPos(Image16 img, int x, int y)
+{ ///
+  assert(img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+int Image16ValidRect(Image16 img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  return x >= 0 && y >= 0 && w >= 0 && h >= 0 &&
+         w <= img->width - x && h <= img->height - y;
+}
+
+/// Pixel get & set operations
+
+uint16 Image16GetPixel(Image16 img, int x, int y)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidPos(img, x, y));
+  PIXMEM += 1; // count one pixel access (read)
+  return rowPtr(img, y)[x];
+}
+
+void Image16SetPixel(Image16 img, int x, int y, uint16 level)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidPos(img, x, y));
+  assert(level <= img->maxval);
+  PIXMEM += 1; // count one pixel access (store)
+  rowPtr(img, y)[x] = level;
+}
+
+/// Pixel transformations
+
+void Image16Negative(Image16 img)
+{ ///
+  assert(img != NULL);
+  size_t count = pixels(img);
+  uint16 maxval = (uint16)img->maxval;
+  for (size_t i = 0; i < count; i++)
+  {
+    img->pixel[i] = (uint16)(maxval - img->pixel[i]);
+  }
+  PIXMEM += 2 * (unsigned long)count; // one read and one store per pixel
+}
+
+void Image16Threshold(Image16 img, uint16 thr)
+{ ///
+  assert(img != NULL);
+  size_t count = pixels(img);
+  uint16 maxval = (uint16)img->maxval;
+  for (size_t i = 0; i < count; i++)
+  {
+    img->pixel[i] = (img->pixel[i] < thr) ? 0 : maxval;
+  }
+  PIXMEM += 2 * (unsigned long)count;
+}
+
+// New level of a pixel brightened by factor (as in ImageBrighten).
+static inline uint16 brightenLevel(uint16 level, double factor, int maxval)
+{
+  double v = level * factor + 0.5;
+  if (v >= maxval)
+    return (uint16)maxval;
+  return (v > 0.0) ? (uint16)v : 0;
+}
+
+void Image16Brighten(Image16 img, double factor)
+{ ///
+  assert(img != NULL);
+  size_t count = pixels(img);
+  int maxval = img->maxval;
+
+  // Com mais pixels do que níveis, uma tabela evita um produto por pixel.
+  uint16 *lut = NULL;
+  if (count > (size_t)maxval + 1)
+    lut = (uint16 *)malloc(((size_t)maxval + 1) * sizeof(uint16));
+  if (lut != NULL)
+  {
+    for (int v = 0; v <= maxval; v++)
+    {
+      lut[v] = brightenLevel((uint16)v, factor, maxval);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      img->pixel[i] = lut[img->pixel[i]];
+    }
+    free(lut);
+  }
+  else
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      img->pixel[i] = brightenLevel(img->pixel[i], factor, maxval);
+    }
+  }
+  PIXMEM += 2 * (unsigned long)count;
+}
+
+/// Geometric transformations
+
+// Side of the square tiles in which images are rotated.
+#define ROTATE_TILE 64
+
+Image16 Image16Rotate(Image16 img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+  Image16 rot = Image16Create(height, width, (uint16)img->maxval);
+  if (rot == NULL)
+    return NULL;
+
+  // Pixel (i, j) do resultado vem de (width-1-j, i).
+  // Por blocos, para que as linhas lidas e escritas fiquem na cache.
+  for (int j0 = 0; j0 < width; j0 += ROTATE_TILE)
+  {
+    int j1 = (j0 + ROTATE_TILE < width) ? j0 + ROTATE_TILE : width;
+    for (int i0 = 0; i0 < height; i0 += ROTATE_TILE)
+    {
+      int i1 = (i0 + ROTATE_TILE < height) ? i0 + ROTATE_TILE : height;
+      for (int j = j0; j < j1; j++)
+      {
+        uint16 *dst = rowPtr(rot, j);
+        int x = width - 1 - j;
+        for (int i = i0; i < i1; i++)
+        {
+          dst[i] = rowPtr(img, i)[x];
+        }
+      }
+    }
+  }
+  PIXMEM += 2 * (unsigned long)pixels(img);
+  return rot;
+}
+
+Image16 Image16Mirror(Image16 img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+  Image16 mir = Image16Create(width, height, (uint16)img->maxval);
+  if (mir == NULL)
+    return NULL;
+
+  for (int y = 0; y < height; y++)
+  {
+    const uint16 *src = rowPtr(img, y);
+    uint16 *dst = rowPtr(mir, y);
+    for (int x = 0; x < width; x++)
+    {
+      dst[x] = src[width - 1 - x];
+    }
+  }
+  PIXMEM += 2 * (unsigned long)pixels(img);
+  return mir;
+}
+
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidRect(img, x, y, w, h));
+  Image16 crop = Image16Create(w, h, (uint16)img->maxval);
+  if (crop == NULL)
+    return NULL;
+
+  for (int j = 0; j < h; j++)
+  {
+    memcpy(rowPtr(crop, j), rowPtr(img, y + j) + x, (size_t)w * sizeof(uint16));
+  }
+  PIXMEM += 2 * (unsigned long)pixels(crop);
+  return crop;
+}
+
+/// Operations on two images
+
+void Image16Paste(Image16 img1, int x, int y, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+
+  for (int j = 0; j < img2->height; j++)
+  {
+    // memmove: img2 pode ser a própria img1.
+    memmove(rowPtr(img1, y + j) + x, rowPtr(img2, j), (size_t)img2->width * sizeof(uint16));
+  }
+  PIXMEM += 2 * (unsigned long)pixels(img2);
+}
+
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+  int w = img2->width;
+  double maxval = img1->maxval;
+
+  for (int j = 0; j < img2->height; j++)
+  {
+    uint16 *row1 = rowPtr(img1, y + j) + x;
+    const uint16 *row2 = rowPtr(img2, j);
+    for (int i = 0; i < w; i++)
+    {
+      double v = alpha * row2[i] + (1 - alpha) * row1[i] + 0.5;
+      // Satura nos dois extremos (alpha fora de [0, 1]).
+      row1[i] = (v <= 0.0) ? 0 : (v >= maxval) ? (uint16)maxval : (uint16)v;
+    }
+  }
+  PIXMEM += 3 * (unsigned long)pixels(img2); // two reads and one store per pixel
+}
+
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidPos(img1, x, y));
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+
+  size_t len = (size_t)img2->width * sizeof(uint16);
+  for (int j = 0; j < img2->height; j++)
+  {
+    PIXMEM += 2 * (unsigned long)img2->width;
+    if (memcmp(rowPtr(img1, y + j) + x, rowPtr(img2, j), len) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+int Image16LocateSubImage(Image16 img1, int *px, int *py, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  int w = img2->width;
+  int h = img2->height;
+  if (w > img1->width || h > img1->height)
+    return 0;
+  if (w == 0 || h == 0)
+  {
+    *px = 0;
+    *py = 0;
+    return 1;
+  }
+
+  // Só compare as posições onde o primeiro pixel de img2 coincide.
+  uint16 first = img2->pixel[0];
+  for (int y = 0; y + h <= img1->height; y++)
+  {
+    const uint16 *row = rowPtr(img1, y);
+    for (int x = 0; x + w <= img1->width; x++)
+    {
+      PIXMEM += 1;
+      if (row[x] == first && Image16MatchSubImage(img1, x, y, img2))
+      {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Filtering
+
+void Image16Blur(Image16 img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  int width = img->width;
+  int height = img->height;
+  if (width == 0 || height == 0)
+    return;
+
+  // A janela nunca precisa de ser maior do que a imagem.
+  if (dx > width)
+    dx = width;
+  if (dy > height)
+    dy = height;
+
+  // Somas por coluna das linhas [y-dy, y+dy] e cópia das últimas dy+1
+  // linhas originais, já substituídas na imagem pelas desfocadas.
+  int depth = dy + 1;
+  uint64_t *colSum = (uint64_t *)calloc((size_t)width, sizeof(uint64_t));
+  uint16 *ring = (uint16 *)malloc((size_t)depth * width * sizeof(uint16));
+  if (!check(colSum != NULL && ring != NULL, "Memory allocation for blur buffers failed"))
+  {
+    free(colSum);
+    free(ring);
+    return;
+  }
+
+  for (int y = 0; y < dy && y < height; y++)
+  {
+    const uint16 *row = rowPtr(img, y);
+    for (int x = 0; x < width; x++)
+      colSum[x] += row[x];
+  }
+  for (int y = 0; y < height; y++)
+  {
+    uint16 *row = rowPtr(img, y);
+    uint16 *saved = ring + (size_t)(y % depth) * width;
+    if (y + dy < height)
+    {
+      const uint16 *in = rowPtr(img, y + dy);
+      for (int x = 0; x < width; x++)
+        colSum[x] += in[x];
+    }
+    if (y - dy - 1 >= 0)
+    {
+      // A linha y-dy-1 ocupa o mesmo lugar que a linha y vai ocupar.
+      for (int x = 0; x < width; x++)
+        colSum[x] -= saved[x];
+    }
+    memcpy(saved, row, (size_t)width * sizeof(uint16));
+
+    // Soma deslizante de colSum na janela [x-dx, x+dx].
+    int y0 = (y - dy < 0) ? 0 : y - dy;
+    int y1 = (y + dy + 1 > height) ? height : y + dy + 1;
+    uint64_t rows = (uint64_t)(y1 - y0);
+    uint64_t sum = 0;
+    for (int i = 0; i < width && i <= dx; i++)
+      sum += colSum[i];
+    for (int x = 0; x < width; x++)
+    {
+      int x0 = (x - dx < 0) ? 0 : x - dx;
+      int x1 = (x + dx + 1 > width) ? width : x + dx + 1;
+      uint64_t count = (uint64_t)(x1 - x0) * rows;
+      row[x] = (uint16)((2 * sum + count) / (2 * count));
+      if (x + dx + 1 < width)
+        sum += colSum[x + dx + 1];
+      if (x - dx >= 0)
+        sum -= colSum[x - dx];
+    }
+  }
+  PIXMEM += 3 * (unsigned long)pixels(img); // read twice, store once
+
+  free(colSum);
+  free(ring);
+}
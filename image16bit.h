@@ -0,0 +1,147 @@
+/// image16bit - 16-bit graymaps, for PGM files with maxval > 255.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// The operations follow those of image8bit (see image8bit.h) and have
+/// the same contracts, with 16-bit levels in [0, maxval], maxval <= 65535.
+/// Pixels are kept in the byte order of the host; PGM files store them
+/// big-endian (most significant byte first), and are converted on I/O.
+///
+/// AED, 2023
+
+#ifndef IMAGE16BIT_H
+#define IMAGE16BIT_H
+
+#include <inttypes.h>
+
+// Type for 16-bit pixel levels
+typedef uint16_t uint16;
+
+// Maximum value you can store in a pixel (maximum maxval accepted)
+extern const uint16 PixMax16;
+
+// Type Image16 is a pointer to 16-bit image objects
+typedef struct image16 *Image16;
+
+/// Error cause (see ImageErrMsg).
+char* Image16ErrMsg(void) ;
+
+/// Image management functions
+
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Create(int width, int height, uint16 maxval) ;
+
+/// Destroy the image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void Image16Destroy(Image16* imgp) ;
+
+/// PGM file operations
+
+/// Load a raw (P5) or plain (P2, ASCII) PGM file, with any maxval.
+/// Raw files with maxval > 255 have 2 bytes per pixel, big-endian.
+/// Fails if a level exceeds maxval.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Load(const char* filename) ;
+
+/// Save image to a raw PGM file: 2 bytes per pixel, big-endian, if
+/// maxval > 255, or 1 byte per pixel otherwise.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int Image16Save(Image16 img, const char* filename) ;
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+int Image16Width(Image16 img) ;
+int Image16Height(Image16 img) ;
+int Image16Maxval(Image16 img) ;
+
+/// Find the minimum and maximum gray levels in image.
+void Image16Stats(Image16 img, uint16* min, uint16* max) ;
+
+/// Check if pixel position (x,y) is inside img.
+int Image16ValidPos(Image16 img, int x, int y) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) ;
+
+/// Pixel get & set operations
+
+uint16 Image16GetPixel(Image16 img, int x, int y) ;
+
+/// Requires: level <= maxval.
+void Image16SetPixel(Image16 img, int x, int y, uint16 level) ;
+
+/// Pixel transformations (in-place, never fail)
+
+/// Transform image to negative image: level -> maxval - level.
+void Image16Negative(Image16 img) ;
+
+/// Levels < thr become black (0), levels >= thr become white (maxval).
+void Image16Threshold(Image16 img, uint16 thr) ;
+
+/// Multiply each pixel level by a factor (rounded), saturating at maxval.
+void Image16Brighten(Image16 img, double factor) ;
+
+/// Geometric transformations
+
+/// Success and failure are treated as in Image16Create:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+/// The original img is not modified.
+
+/// Rotate 90 degrees anti-clockwise.
+Image16 Image16Rotate(Image16 img) ;
+
+/// Mirror = flip left-right.
+Image16 Image16Mirror(Image16 img) ;
+
+/// Crop the rectangle (x, y, w, h).
+/// Requires: Image16ValidRect(img, x, y, w, h).
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) ;
+
+/// Operations on two images
+
+/// Paste img2 into position (x, y) of img1 (in-place).
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Blend img2 into position (x, y) of img1 (in-place), with weight alpha
+/// for img2: results are rounded and saturate at 0 and at maxval of img1.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) ;
+
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y),
+/// 0 otherwise.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Search for img2 inside img1.
+/// If a match is found, returns 1 and the position of the first match in
+/// raster order is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) ;
+
+/// Filtering
+
+/// Blur by a (2dx+1)x(2dy+1) mean filter, as ImageBlur: the mean of the
+/// pixels of the window inside the image, rounded (halves round up).
+/// Requires: dx >= 0, dy >= 0.
+/// On allocation failure the image is left unchanged and errCause is set.
+void Image16Blur(Image16 img, int dx, int dy) ;
+
+#endif
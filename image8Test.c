@@ -0,0 +1,361 @@
+// image8Test - A program that checks the image8bit module.
+//
+// It builds images with known levels and compares the results of some
+// operations with those computed here pixel by pixel, or with those of
+// other operations that must give the same pixels.
+// It prints nothing and exits with status 0 if all checks pass.
+// The environment selects the threads and layout, as for imageTool
+// (e.g. IMAGE_TILED=1 ./image8Test).
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+
+// Odd sizes, so the vector kernels also have leftover pixels.
+#define WIDTH 301
+#define HEIGHT 203
+
+// The level of pixel (x, y) in the test images.
+static uint8 level(int x, int y) {
+  return (uint8)((x * 37 + y * 101 + x * y) % 256);
+}
+
+// Fail with a message if condition is false.
+static void expect(int condition, const char* what) {
+  if (!condition) {
+    error(3, 0, "%s: check failed", what);
+  }
+}
+
+// Fail if img is NULL (an operation failed).
+static Image made(Image img, const char* what) {
+  if (img == NULL) {
+    error(2, errno, "%s: %s", what, ImageErrMsg());
+  }
+  return img;
+}
+
+// A new w x h test image.
+static Image testImage(int w, int h) {
+  Image img = made(ImageCreate(w, h, PixMax), "ImageCreate");
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(img, x, y, level(x, y));
+    }
+  }
+  return img;
+}
+
+// Do img1 and img2 have the same size and pixels?
+static int sameImage(Image img1, Image img2) {
+  int w = ImageWidth(img1);
+  int h = ImageHeight(img1);
+  if (ImageWidth(img2) != w || ImageHeight(img2) != h) return 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      if (ImageGetPixel(img1, x, y) != ImageGetPixel(img2, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+// Rotations: ImageRotate by the definition, and ImageRotate180 and
+// ImageRotate270 the same as rotating two or three times.
+static void checkRotations(Image img) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image r1 = made(ImageRotate(img), "ImageRotate");
+  Image r2 = made(ImageRotate(r1), "ImageRotate");
+  Image r3 = made(ImageRotate(r2), "ImageRotate");
+  int ok = ImageWidth(r1) == h && ImageHeight(r1) == w;
+  for (int j = 0; j < w && ok; j++) {
+    for (int i = 0; i < h && ok; i++) {
+      ok = ImageGetPixel(r1, i, j) == ImageGetPixel(img, w - 1 - j, i);
+    }
+  }
+  expect(ok, "ImageRotate");
+  Image half = made(ImageRotate180(img), "ImageRotate180");
+  Image three = made(ImageRotate270(img), "ImageRotate270");
+  expect(sameImage(half, r2), "ImageRotate180");
+  expect(sameImage(three, r3), "ImageRotate270");
+  ImageDestroy(&r1);
+  ImageDestroy(&r2);
+  ImageDestroy(&r3);
+  ImageDestroy(&half);
+  ImageDestroy(&three);
+}
+
+// A copy of img.
+static Image copyOf(Image img) {
+  return made(ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img)), "ImageCrop");
+}
+
+// ImageMirror by its definition, and the in-place operations the same as
+// those that create a copy, on img and on a view of img inside a larger
+// image (with rows longer than its own).
+static void checkInPlace(Image img) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image mirror = made(ImageMirror(img), "ImageMirror");
+  int ok = 1;
+  for (int y = 0; y < h && ok; y++) {
+    for (int x = 0; x < w && ok; x++) {
+      ok = ImageGetPixel(mirror, x, y) == ImageGetPixel(img, w - 1 - x, y);
+    }
+  }
+  expect(ok, "ImageMirror");
+  Image half = made(ImageRotate180(img), "ImageRotate180");
+  Image rot = (w == h) ? made(ImageRotate(img), "ImageRotate") : NULL;
+
+  Image large = made(ImageCreate(w + 19, h + 7, PixMax), "ImageCreate");
+  ImagePaste(large, 11, 5, img);
+  Image around = copyOf(large);
+  Image view = made(ImageView(large, 11, 5, w, h), "ImageView");
+  Image targets[2] = {copyOf(img), view};
+  for (int k = 0; k < 2; k++) {
+    Image t = targets[k];
+    ImageMirrorInPlace(t);
+    expect(sameImage(t, mirror), "ImageMirrorInPlace");
+    ImageMirrorInPlace(t);
+    ImageRotate180InPlace(t);
+    expect(sameImage(t, half), "ImageRotate180InPlace");
+    ImageRotate180InPlace(t);
+    expect(sameImage(t, img), "ImageRotate180InPlace twice");
+    if (rot != NULL) {
+      ImageRotateInPlace(t);
+      expect(sameImage(t, rot), "ImageRotateInPlace");
+      for (int i = 0; i < 3; i++) {
+        ImageRotateInPlace(t);
+      }
+      expect(sameImage(t, img), "ImageRotateInPlace four times");
+    }
+  }
+  // Only the rectangle of the view was changed, and it is back as it was.
+  expect(sameImage(large, around), "in-place operations on a view");
+
+  ImageDestroy(&targets[0]);
+  ImageDestroy(&view);
+  ImageDestroy(&around);
+  ImageDestroy(&large);
+  ImageDestroy(&mirror);
+  ImageDestroy(&half);
+  if (rot != NULL) {
+    ImageDestroy(&rot);
+  }
+}
+
+// Sum of the levels of the rectangle (x,y,w,h) of img, pixel by pixel.
+static uint64_t sumRect(Image img, int x, int y, int w, int h) {
+  uint64_t sum = 0;
+  for (int j = y; j < y + h; j++) {
+    for (int i = x; i < x + w; i++) {
+      sum += ImageGetPixel(img, i, j);
+    }
+  }
+  return sum;
+}
+
+// Check ImageStatsEx, ImageHistogram and ImageStats of img against its
+// levels, counted pixel by pixel.
+static void checkStatsOf(Image img, const char* what) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  uint64_t count[256] = {0};
+  uint8 min = PixMax, max = 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      count[v]++;
+      if (v < min) min = v;
+      if (v > max) max = v;
+    }
+  }
+  ImageStatistics stats;
+  uint64_t hist[256];
+  uint8 min2, max2;
+  expect(ImageStatsEx(img, &stats) && ImageHistogram(img, hist), what);
+  ImageStats(img, &min2, &max2);
+  int ok = stats.min == min && stats.max == max && min2 == min && max2 == max;
+  ok = ok && stats.mean == (double)sumRect(img, 0, 0, w, h) / ((double)w * h);
+  ok = ok && memcmp(stats.count, count, sizeof(count)) == 0 &&
+       memcmp(hist, count, sizeof(count)) == 0;
+  expect(ok, what);
+}
+
+// The hash of img, from ImageStatsEx.
+static uint64_t hashOf(Image img) {
+  ImageStatistics stats;
+  expect(ImageStatsEx(img, &stats), "ImageStatsEx");
+  return stats.hash;
+}
+
+// The statistics kept in an image follow ImageSetPixel, and the hash
+// depends only on the size, maxval and pixels.
+static void checkStats(void) {
+  Image img = testImage(WIDTH, HEIGHT);
+  checkStatsOf(img, "ImageStatsEx");
+  uint64_t hash = hashOf(img);
+
+  // A new extreme, a new level for a single pixel, and back.
+  ImageSetPixel(img, 10, 20, 0);
+  ImageSetPixel(img, WIDTH - 1, HEIGHT - 1, PixMax);
+  checkStatsOf(img, "ImageStatsEx after ImageSetPixel");
+  uint64_t changed = hashOf(img);
+  expect(changed != hash, "ImageStatsEx hash after ImageSetPixel");
+  ImageSetPixel(img, 10, 20, level(10, 20));
+  ImageSetPixel(img, WIDTH - 1, HEIGHT - 1, level(WIDTH - 1, HEIGHT - 1));
+  checkStatsOf(img, "ImageStatsEx after ImageSetPixel");
+  expect(hashOf(img) == hash, "ImageStatsEx hash after ImageSetPixel");
+
+  // The same pixels elsewhere: a copy, and a view of a larger image.
+  Image copy = made(ImageCrop(img, 0, 0, WIDTH, HEIGHT), "ImageCrop");
+  Image large = made(ImageCreate(WIDTH + 20, HEIGHT + 10, PixMax), "ImageCreate");
+  ImagePaste(large, 13, 4, img);
+  Image view = made(ImageView(large, 13, 4, WIDTH, HEIGHT), "ImageView");
+  expect(hashOf(copy) == hash && hashOf(view) == hash, "ImageStatsEx hash of the same pixels");
+  ImageSetPixel(view, 10, 20, 0);
+  ImageSetPixel(view, WIDTH - 1, HEIGHT - 1, PixMax);
+  checkStatsOf(view, "ImageStatsEx of a view after ImageSetPixel");
+  expect(hashOf(view) == changed, "ImageStatsEx hash of a view after ImageSetPixel");
+
+  ImageDestroy(&view);
+  ImageDestroy(&large);
+  ImageDestroy(&copy);
+  ImageDestroy(&img);
+}
+
+// Views share the pixels of their parent: changes made through either
+// are seen by the other, and data derived from the pixels of the view
+// (statistics, integral image) follows the changes made to the parent.
+static void checkView(void) {
+  const int x0 = 40, y0 = 30, w = 100, h = 80;
+  Image img = testImage(WIDTH, HEIGHT);
+  Image view = made(ImageView(img, x0, y0, w, h), "ImageView");
+  expect(ImageIsView(view) && !ImageIsView(img), "ImageIsView");
+  expect(ImageWidth(view) == w && ImageHeight(view) == h, "ImageView size");
+  int ok = 1;
+  for (int y = 0; y < h && ok; y++) {
+    for (int x = 0; x < w && ok; x++) {
+      ok = ImageGetPixel(view, x, y) == level(x0 + x, y0 + y);
+    }
+  }
+  expect(ok, "ImageView pixels");
+
+  // Derived data, then a change to the parent.
+  ImageStatistics stats;
+  expect(ImageStatsEx(view, &stats) && ImageIntegral(view), "ImageStatsEx of a view");
+  ImageNegative(img);
+  ok = 1;
+  for (int y = 0; y < h && ok; y++) {
+    for (int x = 0; x < w && ok; x++) {
+      ok = ImageGetPixel(view, x, y) == PixMax - level(x0 + x, y0 + y);
+    }
+  }
+  expect(ok, "view after its parent changed");
+  expect(ImageStatsEx(view, &stats), "ImageStatsEx");
+  expect(stats.mean == (double)sumRect(view, 0, 0, w, h) / (w * h),
+         "ImageStatsEx of a view after its parent changed");
+  expect(ImageIntegral(view) &&
+         ImageRectSum(view, 3, 5, 50, 40) == sumRect(view, 3, 5, 50, 40),
+         "ImageRectSum of a view after its parent changed");
+
+  // A change through the view, on the rectangle of the view only.
+  Image copy = made(ImageCrop(img, 0, 0, WIDTH, HEIGHT), "ImageCrop");
+  Image crop = made(ImageCrop(img, x0, y0, w, h), "ImageCrop");
+  ImageBlur(view, 2, 3);
+  ImageBlur(crop, 2, 3);
+  expect(sameImage(view, crop), "ImageBlur of a view");
+  ImagePaste(copy, x0, y0, crop);
+  expect(sameImage(img, copy), "ImageBlur of a view, seen in its parent");
+  ImageSetPixel(view, 0, 0, 7);
+  expect(ImageGetPixel(img, x0, y0) == 7, "ImageSetPixel through a view");
+
+  ImageDestroy(&view);
+  ImageDestroy(&img);
+  ImageDestroy(&copy);
+  ImageDestroy(&crop);
+}
+
+// The level floor(alpha*p2 + (1-alpha)*p1 + 0.5), saturated.
+static uint8 blendLevel(uint8 p1, uint8 p2, double alpha) {
+  double v = floor(alpha * p2 + (1 - alpha) * p1 + 0.5);
+  return (v <= 0.0) ? 0 : (v >= PixMax) ? PixMax : (uint8)v;
+}
+
+// ImageBlend by its definition, and ImageBlendMany the same as blending
+// the images one after the other, with overlaps and weights inside and
+// outside [0, 1] (some exact in fixed point, some not).
+static void checkBlend(void) {
+  Image img = testImage(WIDTH, HEIGHT);
+  Image rot = made(ImageRotate(img), "ImageRotate");
+  enum { N = 5 };
+  Image parts[N];
+  const int xs[N] = {0, 20, 150, 61, 3};
+  const int ys[N] = {0, 17, 40, 100, 90};
+  const double alphas[N] = {0.5, 0.3, 1.7, -0.4, 0.25};
+  for (int k = 0; k < N; k++) {
+    parts[k] = made(ImageCrop(rot, 7 * k, 11 * k, 140 - 9 * k, 100 - 5 * k), "ImageCrop");
+  }
+
+  for (int k = 0; k < N; k++) {
+    Image one = testImage(WIDTH, HEIGHT);
+    int w = ImageWidth(parts[k]);
+    int h = ImageHeight(parts[k]);
+    ImageBlend(one, xs[k], ys[k], parts[k], alphas[k]);
+    int ok = 1;
+    for (int y = 0; y < HEIGHT && ok; y++) {
+      for (int x = 0; x < WIDTH && ok; x++) {
+        uint8 expected = level(x, y);
+        if (xs[k] <= x && x < xs[k] + w && ys[k] <= y && y < ys[k] + h) {
+          expected = blendLevel(level(x, y), ImageGetPixel(parts[k], x - xs[k], y - ys[k]), alphas[k]);
+        }
+        ok = ImageGetPixel(one, x, y) == expected;
+      }
+    }
+    expect(ok, "ImageBlend");
+    ImageDestroy(&one);
+  }
+
+  Image many = testImage(WIDTH, HEIGHT);
+  ImageBlendMany(many, N, parts, xs, ys, alphas);
+  for (int k = 0; k < N; k++) {
+    ImageBlend(img, xs[k], ys[k], parts[k], alphas[k]);
+  }
+  expect(sameImage(many, img), "ImageBlendMany");
+
+  for (int k = 0; k < N; k++) {
+    ImageDestroy(&parts[k]);
+  }
+  ImageDestroy(&many);
+  ImageDestroy(&rot);
+  ImageDestroy(&img);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  if (argc != 1) {
+    error(1, 0, "Usage: image8Test");
+  }
+  ImageInit();
+
+  Image img = testImage(WIDTH, HEIGHT);
+  Image square = testImage(HEIGHT, HEIGHT);
+  checkRotations(img);
+  checkRotations(square);
+  checkInPlace(img);
+  checkInPlace(square);
+  checkStats();
+  checkView();
+  checkBlend();
+
+  ImageDestroy(&img);
+  ImageDestroy(&square);
+  return 0;
+}
@@ -1,11 +1,29 @@
+#define _GNU_SOURCE // for mremap (see unshareMapping)
 #include "image8bit.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "pgm.h"
+#include "threadpool.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 const uint8 PixMax = 255;
 
@@ -15,14 +33,30 @@ struct image
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8 *pixel; // pixel data (a raster scan)
+  int stride;   // distance between the starts of consecutive rows in pixel
+                // (tiled: between the starts of consecutive rows of tiles)
+  uint8 *pixel; // pixel data (a raster scan, with stride pixels per row)
+  int tiled;    // nonzero if pixel holds TILE x TILE tiles instead (see G)
+  int x0, y0;   // for views of tiled images: where they start in the tiles
+  void *block;  // the allocation that holds pixel (pixel is aligned in it)
+  Image parent; // for views: the image that owns the pixel data, else NULL
+  unsigned long version; // incremented whenever the pixel data changes
+  uint64_t *integral; // summed-area table, (width+1)*(height+1), or NULL
+  unsigned long integralVersion; // version of the pixels it describes
+  ImageStatistics *stats;        // ImageStatsEx of the pixels, or NULL
+  unsigned long statsVersion;    // version of the pixels it describes
+  void *map;          // for ImageLoadMapped: the mapped file, else NULL
+  size_t mapLength;   // and its length
+  dev_t mapDevice;    // and identity
+  ino_t mapInode;
+  Image mapNext;      // next in the list of mapped images (see mapped)
 };
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
-// Error cause
-static char *errCause;
+// Error cause (per thread, like errno)
+static _Thread_local char *errCause;
 char *ImageErrMsg()
 { ///
   return errCause;
@@ -38,22 +72,383 @@ static int check(int condition, const char *failmsg)
   return condition;
 }
 
+// The image that owns the pixel data of img (img itself, if not a view).
+// Its version changes whenever the shared pixels change, through any view.
+static inline Image owner(Image img)
+{
+  return (img->parent != NULL) ? img->parent : img;
+}
+
+static void poolFree(void *buffer);
+
+// Invalidate data derived from the pixel values (e.g. the integral image),
+// here and in every view of the same pixels.
+// Must be called by every operation that changes img->pixel.
+static inline void modified(Image img)
+{
+  owner(img)->version++;
+  if (img->integral != NULL)
+  {
+    poolFree(img->integral);
+    img->integral = NULL;
+  }
+}
+
+// Does img have statistics (ImageStatsEx) describing its current pixels?
+static inline int hasStats(Image img)
+{
+  return img->stats != NULL && img->statsVersion == owner(img)->version;
+}
+
+// Does img have an integral image describing its current pixels?
+static inline int hasIntegral(Image img)
+{
+  return img->integral != NULL && img->integralVersion == owner(img)->version;
+}
+
+// Checks inside the kernels, on the rows and positions they compute.
+// The kernels access pixels through rowPtr (never ImageGetPixel or
+// ImageSetPixel) and count PIXMEM once per band, so these are their only
+// per-row checks; IMAGE_FAST builds (make fast) leave them out.
+// The contracts of the public functions are checked in every build.
+#ifdef IMAGE_FAST
+#define KERNEL_ASSERT(condition) ((void)0)
+#else
+#define KERNEL_ASSERT(condition) assert(condition)
+#endif
+
+// Pointer to the first pixel of row y (of a raster image).
+static inline uint8 *rowPtr(Image img, int y)
+{
+  KERNEL_ASSERT(!img->tiled);
+  KERNEL_ASSERT(0 <= y && y < img->height);
+  return img->pixel + (size_t)y * img->stride;
+}
+
+// Tiled images keep their pixels in square tiles of TILE x TILE pixels,
+// each a raster of its own, one row of tiles after the other; tiles on the
+// right and bottom edges are padded to the full size.  Pixels that are
+// close in 2D are thus close in memory too.
+#define TILE_SHIFT 6
+#define TILE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE - 1)
+
+// Layout of the images made by ImageCreate and ImageLoad (ImageSetTiled).
+static int defaultTiled = 0;
+
+// Offset of pixel (x, y) of a tiled image in img->pixel.
+static inline size_t tileIndex(Image img, int x, int y)
+{
+  x += img->x0;
+  y += img->y0;
+  return (size_t)(y >> TILE_SHIFT) * img->stride + ((size_t)(x >> TILE_SHIFT) << (2 * TILE_SHIFT)) +
+         ((size_t)(y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+}
+
+// Pointer to pixel (x, y) of img, in any layout, for a walk from there
+// along (dx, dy) (one of them 1 or -1, the other 0): *n is reduced to the
+// number of pixels that keep the same distance in memory, *step.
+// That is all of them in a raster image, or those in the same tile.
+static inline uint8 *walkPtr(Image img, int x, int y, int dx, int dy, int *n, ptrdiff_t *step)
+{
+  if (!img->tiled)
+  {
+    *step = dx + (ptrdiff_t)dy * img->stride;
+    return rowPtr(img, y) + x;
+  }
+  int tx = (x + img->x0) & TILE_MASK;
+  int ty = (y + img->y0) & TILE_MASK;
+  int left = (dx > 0) ? TILE - tx : (dx < 0) ? tx + 1 : (dy > 0) ? TILE - ty : ty + 1;
+  if (*n > left)
+    *n = left;
+  *step = dx + (ptrdiff_t)dy * TILE;
+  return img->pixel + tileIndex(img, x, y);
+}
+
+// Pointer to pixel (x, y) of img, and in *n the number of pixels from
+// there to the right that are contiguous in memory (the rest of the row,
+// or of the row of the tile).
+static inline uint8 *runPtr(Image img, int x, int y, int *n)
+{
+  ptrdiff_t step;
+  *n = img->width - x;
+  return walkPtr(img, x, y, 1, 0, n, &step);
+}
+
+// Pointers to (x1, y1) of img1 and (x2, y2) of img2, and the number of
+// pixels to their right, at most n, that are contiguous in both.
+static inline int runPair(Image img1, int x1, int y1, uint8 **p1,
+                          Image img2, int x2, int y2, uint8 **p2, int n)
+{
+  ptrdiff_t step;
+  *p1 = walkPtr(img1, x1, y1, 1, 0, &n, &step);
+  *p2 = walkPtr(img2, x2, y2, 1, 0, &n, &step);
+  return n;
+}
+
+// Copy pixels [x, x+n) of row y of img, in any layout, to (back = 0) or
+// from (back = 1) buffer.
+static void copySpan(Image img, int x, int y, int n, uint8 *buffer, int back)
+{
+  int run;
+  uint8 *p = runPtr(img, x, y, &run);
+  if (!img->tiled)
+  {
+    if (back)
+      memcpy(p, buffer, (size_t)n);
+    else
+      memcpy(buffer, p, (size_t)n);
+    return;
+  }
+  // O primeiro troço acaba na borda de um bloco; os seguintes são a
+  // mesma linha dos blocos à direita, cada um TILE * TILE pixels à frente.
+  uint8 *first = p - ((x + img->x0) & TILE_MASK);
+  for (int i = 0, k = 0; i < n; i += run, k++)
+  {
+    if (k > 0)
+      p = first + (size_t)k * TILE * TILE;
+    run = (k == 0) ? run : TILE;
+    run = (run < n - i) ? run : n - i;
+    if (run == TILE)
+    {
+      // O caso comum, com tamanho constante: o compilador expande-o.
+      if (back)
+        memcpy(p, buffer + i, TILE);
+      else
+        memcpy(buffer + i, p, TILE);
+    }
+    else if (back)
+      memcpy(p, buffer + i, (size_t)run);
+    else
+      memcpy(buffer + i, p, (size_t)run);
+  }
+}
+
+// Copy rows [y, y+rows) of img, in any layout, to (back = 0) or from
+// (back = 1) the raster buffer, with img->width pixels per row.
+static void copyRows(Image img, int y, int rows, uint8 *buffer, int back)
+{
+  for (int j = y; j < y + rows && img->width > 0; j++, buffer += img->width)
+  {
+    copySpan(img, 0, j, img->width, buffer, back);
+  }
+}
+
+// Number of spans of contiguous pixels covering a raster image, each with
+// *len pixels: the span k starts at rowPtr(img, k).  If rows are contiguous, the whole
+// raster is a single span, which helps the vector kernels.
+static inline int spans(Image img, size_t *len)
+{
+  if (img->stride == img->width && img->height > 0)
+  {
+    *len = (size_t)img->width * img->height;
+    return 1;
+  }
+  *len = (size_t)img->width;
+  return img->height;
+}
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters (the instrumentation calibrates itself when first
+/// printed, see InstrPrint) and the number of threads.
 void ImageInit(void)
 { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "poolhit"; // InstrCount[1] will count buffers reused
+  InstrName[2] = "poolmiss"; // InstrCount[2] will count buffers allocated
   // Name other counters here...
+
+  // The pool threads, started later, are counted only if the hardware
+  // counters are open before.
+  InstrPerfOpen();
+
+  const char *threads = getenv("IMAGE_THREADS");
+  if (threads != NULL && *threads != '\0')
+  {
+    ImageSetThreads(atoi(threads));
+  }
+  const char *tiled = getenv("IMAGE_TILED");
+  if (tiled != NULL && *tiled != '\0')
+  {
+    ImageSetTiled(atoi(tiled));
+  }
+}
+
+void ImageSetThreads(int n)
+{ ///
+  PoolSetThreads(n);
+}
+
+void ImageSetTiled(int tiled)
+{ ///
+  defaultTiled = (tiled != 0);
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
+#define POOLHIT InstrCount[1]
+#define POOLMISS InstrCount[2]
 // Add more macros here...
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
-Image ImageCreate(int width, int height, uint8 maxval)
+/// Buffer pool
+
+// Large buffers (pixel arrays, integral images, blur scratch) are taken
+// from a pool of recently freed buffers of the same size class, instead
+// of going to malloc each time: a pipeline that creates and destroys
+// images of the same size keeps reusing memory it has already touched,
+// instead of page-faulting in fresh pages.
+// The classes are 4 per power of 2 (sizes 4, 5, 6, 7 times 2^e), so a
+// buffer is at most 25% larger than requested.
+
+#define POOL_CLASSES 256         // 4 per power of 2, for 64-bit sizes
+#define POOL_DEPTH 4             // buffers kept per class
+#define POOL_LIMIT (256ul << 20) // total bytes kept
+#define POOL_HEADER 16           // bytes before each buffer
+
+// The header of each pooled buffer.
+struct pooled
+{
+  struct pooled *next; // next free buffer of the same class
+  unsigned cls;        // size class
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct pooled *poolFreeList[POOL_CLASSES];
+static int poolCount[POOL_CLASSES];
+static size_t poolBytes; // bytes in the free lists
+
+// Size of the buffers of class cls.
+static inline size_t classSize(unsigned cls)
+{
+  return (size_t)(4 + (cls & 3)) << (cls >> 2);
+}
+
+// Smallest class with buffers of at least size bytes.
+static unsigned sizeClass(size_t size)
+{
+  unsigned e = 0;
+  while (((size_t)8 << e) < size)
+  {
+    e++;
+  }
+  // Agora 4*2^e < size <= 8*2^e (ou size <= 8): procure o passo.
+  unsigned cls = 4 * e;
+  while (classSize(cls) < size)
+  {
+    cls++;
+  }
+  return cls;
+}
+
+// Get a buffer of at least size bytes, zeroed if zero is set.
+// Returns NULL if there is not enough memory.
+static void *poolAlloc(size_t size, int zero)
+{
+  unsigned cls = sizeClass(size);
+  struct pooled *b;
+
+  pthread_mutex_lock(&poolLock);
+  b = poolFreeList[cls];
+  if (b != NULL)
+  {
+    poolFreeList[cls] = b->next;
+    poolCount[cls]--;
+    poolBytes -= classSize(cls);
+    POOLHIT++;
+  }
+  else
+  {
+    POOLMISS++;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  if (b != NULL)
+  {
+    if (zero)
+      memset((char *)b + POOL_HEADER, 0, size);
+  }
+  else
+  {
+    // Um buffer novo: calloc recebe páginas já a zero do sistema.
+    size_t bytes = POOL_HEADER + classSize(cls);
+    b = (struct pooled *)(zero ? calloc(bytes, 1) : malloc(bytes));
+    if (b == NULL)
+      return NULL;
+    b->cls = cls;
+  }
+  return (char *)b + POOL_HEADER;
+}
+
+// Return a buffer from poolAlloc to the pool (or to the system, if the
+// pool is full).  NULL is ignored.
+static void poolFree(void *buffer)
+{
+  if (buffer == NULL)
+  {
+    return;
+  }
+  struct pooled *b = (struct pooled *)((char *)buffer - POOL_HEADER);
+  unsigned cls = b->cls;
+  size_t bytes = classSize(cls);
+
+  pthread_mutex_lock(&poolLock);
+  int keep = poolCount[cls] < POOL_DEPTH && poolBytes + bytes <= POOL_LIMIT;
+  if (keep)
+  {
+    b->next = poolFreeList[cls];
+    poolFreeList[cls] = b;
+    poolCount[cls]++;
+    poolBytes += bytes;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  if (!keep)
+  {
+    free(b);
+  }
+}
+
+// Alignment of the pixel arrays, in bytes (a cache line, and enough for
+// any vector load).
+#define PIXEL_ALIGN 64
+
+// Set the padding of the tiles on the right and bottom edges of a new tiled
+// image to zero.  The point operations go through it too (see pointBand),
+// so it must not be left uninitialized.
+static void clearPadding(Image img)
+{
+  int across = img->stride >> (2 * TILE_SHIFT);
+  int down = (img->height + TILE_MASK) >> TILE_SHIFT;
+  int right = img->width & TILE_MASK;   // colunas usadas no último bloco
+  int bottom = img->height & TILE_MASK; // e linhas
+  if (right != 0)
+  {
+    uint8 *last = img->pixel + ((size_t)(across - 1) << (2 * TILE_SHIFT));
+    for (int ty = 0; ty < down; ty++)
+    {
+      for (int r = 0; r < TILE; r++)
+      {
+        memset(last + (size_t)ty * img->stride + (size_t)r * TILE + right, 0, TILE - right);
+      }
+    }
+  }
+  if (bottom != 0)
+  {
+    uint8 *row = img->pixel + (size_t)(down - 1) * img->stride + (size_t)bottom * TILE;
+    for (int tx = 0; tx < across; tx++)
+    {
+      memset(row + ((size_t)tx << (2 * TILE_SHIFT)), 0, (size_t)(TILE - bottom) * TILE);
+    }
+  }
+}
+
+// Create a new image, like ImageCreate, with 64-byte aligned pixels,
+// in tiles if tiled.
+// If zero, the pixels are zero.  Otherwise the pixels are left
+// uninitialized, for callers that write all of them.
+static Image createImage(int width, int height, uint8 maxval, int zero, int tiled)
 {
   assert(width >= 0);
   assert(height >= 0);
@@ -72,29 +467,84 @@ Image ImageCreate(int width, int height, uint8 maxval)
   image->width = width;
   image->height = height;
   image->maxval = maxval;
+  image->stride = width;
+  image->tiled = tiled;
+  image->x0 = 0;
+  image->y0 = 0;
+  image->parent = NULL;
+  image->version = 0;
+  image->integral = NULL;
+  image->stats = NULL;
+  image->map = NULL;
 
   // Calcule o número total de pixels na imagem.
-  int numPixels = width * height;
+  size_t numPixels = (size_t)width * height;
+  if (tiled)
+  {
+    // Blocos completos: cada linha de blocos ocupa stride pixels.
+    size_t across = ((size_t)width + TILE - 1) >> TILE_SHIFT;
+    size_t down = ((size_t)height + TILE - 1) >> TILE_SHIFT;
+    image->stride = (int)(across << (2 * TILE_SHIFT));
+    numPixels = down * image->stride;
+  }
 
-  // Aloque memória para o array de pixels.
-  image->pixel = (uint8 *)malloc(numPixels * sizeof(uint8));
-  if (image->pixel == NULL)
+  // Aloque memória para o array de pixels, com folga para o alinhar.
+  image->block = poolAlloc(numPixels + PIXEL_ALIGN - 1, zero);
+  if (image->block == NULL)
   {
     errsave = errno;
     free(image); // Libere a memória alocada para a estrutura Image.
     errCause = "Memory allocation for pixel array failed";
     return NULL;
   }
-
-  // Inicialize todos os pixels com o valor zero (preto).
-  for (int i = 0; i < numPixels; i++)
+  uintptr_t start = ((uintptr_t)image->block + PIXEL_ALIGN - 1) & ~(uintptr_t)(PIXEL_ALIGN - 1);
+  image->pixel = (uint8 *)start;
+  if (tiled && !zero && numPixels > 0)
   {
-    image->pixel[i] = 0;
+    clearPadding(image);
   }
 
   return image;
 }
 
+Image ImageCreate(int width, int height, uint8 maxval)
+{
+  return createImage(width, height, maxval, 1, defaultTiled);
+}
+
+// Create a new raster image whose pixels are not initialized.
+// Only for callers that write every pixel before reading any.
+static inline Image ImageCreateUninit(int width, int height, uint8 maxval)
+{
+  return createImage(width, height, maxval, 0, 0);
+}
+
+// The images that map a file (ImageLoadMapped), so that ImageSave can
+// find all those that map the file it is about to rewrite.
+static Image mapped = NULL;
+static pthread_mutex_t mappedLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Add img, which maps a file, to the list of mapped images.
+static void mappedAdd(Image img)
+{
+  pthread_mutex_lock(&mappedLock);
+  img->mapNext = mapped;
+  mapped = img;
+  pthread_mutex_unlock(&mappedLock);
+}
+
+// Remove img from the list of mapped images.
+static void mappedRemove(Image img)
+{
+  pthread_mutex_lock(&mappedLock);
+  Image *p = &mapped;
+  while (*p != NULL && *p != img)
+    p = &(*p)->mapNext;
+  if (*p != NULL)
+    *p = img->mapNext;
+  pthread_mutex_unlock(&mappedLock);
+}
+
 void ImageDestroy(Image *imgp)
 {
   assert(imgp != NULL);
@@ -104,8 +554,18 @@ void ImageDestroy(Image *imgp)
     return; // Nenhuma operação é realizada se a imagem já for NULL.
   }
 
-  // Libere a memória alocada para o array de pixels.
-  free((*imgp)->pixel);
+  // Libere a memória alocada para o array de pixels (as vistas não o possuem).
+  if ((*imgp)->map != NULL)
+  {
+    mappedRemove(*imgp);
+    munmap((*imgp)->map, (*imgp)->mapLength);
+  }
+  else if ((*imgp)->parent == NULL)
+  {
+    poolFree((*imgp)->block);
+  }
+  poolFree((*imgp)->integral);
+  free((*imgp)->stats);
 
   // Libere a memória alocada para a estrutura Image.
   free(*imgp);
@@ -114,54 +574,230 @@ void ImageDestroy(Image *imgp)
   *imgp = NULL;
 }
 
+Image ImageView(Image img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+
+  Image view = (Image)malloc(sizeof(struct image));
+  if (view == NULL)
+  {
+    errsave = errno;
+    errCause = "Memory allocation for Image structure failed";
+    return NULL;
+  }
+
+  // A vista partilha os pixels do dono: uma vista de uma vista aponta
+  // diretamente para o dono, com o deslocamento acumulado.
+  view->width = w;
+  view->height = h;
+  view->maxval = img->maxval;
+  view->stride = img->stride;
+  view->tiled = img->tiled;
+  if (img->tiled)
+  {
+    // Nos blocos não há um endereço para (x, y): guarde a posição.
+    view->pixel = img->pixel;
+    view->x0 = img->x0 + x;
+    view->y0 = img->y0 + y;
+  }
+  else
+  {
+    view->pixel = rowPtr(img, y) + x;
+    view->x0 = 0;
+    view->y0 = 0;
+  }
+  view->block = NULL;
+  view->parent = owner(img);
+  view->version = 0;
+  view->integral = NULL;
+  view->stats = NULL;
+  view->map = NULL;
+
+  return view;
+}
+
+int ImageIsView(Image img)
+{ ///
+  assert(img != NULL);
+  return img->parent != NULL;
+}
+
+int ImageIsTiled(Image img)
+{ ///
+  assert(img != NULL);
+  return img->tiled;
+}
+
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE *f)
+// Parse the header of a PGM file (see PGMReadHeader), leaving f at the
+// first pixel.  Accepts raw (P5) and plain (P2, ASCII) files: *plain tells
+// which.
+// Returns nonzero on success, or 0 with errCause set.
+static int readHeader(FILE *f, int *w, int *h, int *maxval, int *plain)
+{
+  const char *fail = PGMReadHeader(f, w, h, maxval, plain);
+  return check(fail == NULL, fail) &&
+         check(*maxval <= (int)PixMax, "Invalid maxval");
+}
+
+// Size of the blocks in which plain PGM rasters are read.
+#define PLAIN_BLOCK 16384
+
+// Reader for the ASCII levels of a plain PGM raster.
+struct plainReader
+{
+  unsigned char buf[PLAIN_BLOCK];
+  size_t pos, len;   // unread characters in buf[pos, len)
+};
+
+// Read the next count levels of a plain raster into pixel.
+// Levels are parsed from whole blocks with a simple digit loop.
+// Returns nonzero on success, or 0 with errCause set.
+static int readPlain(FILE *f, struct plainReader *r, uint8 *pixel, size_t count, int maxval)
+{
+  size_t n = 0;      // levels read
+  unsigned v = 0;    // level being read
+  int digits = 0;    // inside a level?
+  int comment = 0;   // inside a comment?
+
+  while (n < count)
+  {
+    if (r->pos == r->len)
+    {
+      r->pos = 0;
+      r->len = fread(r->buf, 1, sizeof(r->buf), f);
+      if (r->len == 0)
+      {
+        break; // Fim do ficheiro.
+      }
+    }
+    const unsigned char *b = r->buf;
+    size_t i = r->pos;
+    size_t len = r->len;
+    for (; i < len && n < count; i++)
+    {
+      unsigned d = (unsigned)b[i] - '0';
+      if (comment)
+      {
+        comment = (b[i] != '\n');
+      }
+      else if (d < 10)
+      {
+        v = 10 * v + d;
+        digits = 1;
+        if (v > (unsigned)maxval)
+        {
+          return check(0, "Invalid pixel level");
+        }
+      }
+      else
+      {
+        if (digits)
+        {
+          pixel[n++] = (uint8)v;
+          v = 0;
+          digits = 0;
+          if (n == count && b[i] == '#')
+          {
+            break; // Deixe o comentário para a próxima leitura.
+          }
+        }
+        if (b[i] == '#')
+          comment = 1;
+        else if (!isspace(b[i]))
+          return check(0, "Invalid pixel level");
+      }
+    }
+    r->pos = i;
+  }
+  if (digits && n < count)
+  {
+    pixel[n++] = (uint8)v; // O último nível, no fim do ficheiro.
+  }
+  return check(n == count, "Reading pixels");
+}
+
+// Read the pixels of img from f, in raster order: plain levels with the
+// reader r, or raw levels if r is NULL.
+// Returns nonzero on success, or 0 with errCause set.
+static int readPixels(FILE *f, struct plainReader *r, Image img, int maxval)
 {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n')
+  if (!img->tiled)
+  {
+    size_t count = (size_t)img->width * img->height;
+    return (r != NULL) ? readPlain(f, r, img->pixel, count, maxval)
+                       : check(fread(img->pixel, sizeof(uint8), count, f) == count, "Reading pixels");
+  }
+  // Em blocos: leia uma linha de blocos de cada vez e distribua-a.
+  size_t width = (size_t)img->width;
+  uint8 *rows = (uint8 *)poolAlloc(TILE * width, 0);
+  for (int y = 0; rows != NULL && y < img->height; y += TILE)
+  {
+    int n = (y + TILE < img->height) ? TILE : img->height - y;
+    size_t count = (size_t)n * width;
+    int success = (r != NULL) ? readPlain(f, r, rows, count, maxval)
+                              : check(fread(rows, sizeof(uint8), count, f) == count, "Reading pixels");
+    if (success)
+      copyRows(img, y, n, rows, 1);
+    if (!success || y + n == img->height)
+    {
+      poolFree(rows);
+      return success;
+    }
+  }
+  poolFree(rows); // (só se não houver linhas)
+  // Sem memória para isso: cada linha pelos seus troços contíguos.
+  for (int y = 0; y < img->height; y++)
   {
-    i++;
+    for (int x = 0, n; x < img->width; x += n)
+    {
+      uint8 *p = runPtr(img, x, y, &n);
+      if ((r != NULL) ? !readPlain(f, r, p, (size_t)n, maxval)
+                      : !check(fread(p, sizeof(uint8), (size_t)n, f) == (size_t)n, "Reading pixels"))
+        return 0;
+    }
   }
-  return i;
+  return 1;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char *filename)
-{ ///
+// Load a PGM file, as ImageLoad, but without timing it (so that
+// ImageLoadMapped may fall back on it within its own "load" timer).
+static Image loadFile(const char *filename)
+{
   int w, h;
   int maxval;
-  char c;
+  int plain;
   FILE *f = NULL;
   Image img = NULL;
+  struct plainReader *reader = NULL;
 
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
       // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      readHeader(f, &w, &h, &maxval, &plain) &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-      // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h, "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      (img = createImage(w, h, (uint8)maxval, 0, defaultTiled)) != NULL;
+  size_t count = success ? (size_t)w * h : 0;
+  if (success && plain)
+  {
+    // Read ASCII levels
+    success =
+        check((reader = (struct plainReader *)malloc(sizeof(*reader))) != NULL,
+              "Memory allocation for reading failed") &&
+        (reader->pos = reader->len = 0, readPixels(f, reader, img, maxval));
+    free(reader);
+  }
+  else if (success)
+  {
+    // Read pixels
+    success = readPixels(f, NULL, img, maxval);
+  }
+  PIXMEM += (unsigned long)count; // count pixel memory accesses
 
   // Cleanup
   if (!success)
@@ -175,27 +811,226 @@ Image ImageLoad(const char *filename)
   return img;
 }
 
-/// Save image to PGM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(Image img, const char *filename)
+/// Load a raw (P5) or plain (P2) PGM file.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char *filename)
 { ///
-  assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
+  InstrTimer timer = InstrTimerBegin("load");
+  Image img = loadFile(filename);
+  InstrTimerEnd(timer);
+  return img;
+}
+
+Image ImageLoadMapped(const char *filename)
+{ ///
+  int w, h;
+  int maxval;
+  int plain;
+  long offset;
+  struct stat st;
+  void *map = MAP_FAILED;
   FILE *f = NULL;
+  Image img = NULL;
+  InstrTimer timer = InstrTimerBegin("load");
 
   int success =
-      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
-      check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
-      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h, "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse PGM header
+      readHeader(f, &w, &h, &maxval, &plain);
+  if (success && (plain || defaultTiled))
+  {
+    // Os níveis em ASCII não podem ser mapeados, nem o ficheiro serve de
+    // blocos: leia-os normalmente.
+    fclose(f);
+    img = loadFile(filename);
+    InstrTimerEnd(timer);
+    return img;
+  }
+  success = success &&
+      check((offset = ftell(f)) >= 0 && fstat(fileno(f), &st) == 0, "Reading pixels") &&
+      check(st.st_size - offset >= (off_t)w * h, "Reading pixels");
+
+  if (success && (size_t)w * h == 0)
+  {
+    // Nada para mapear: uma imagem vazia normal.
+    fclose(f);
+    img = ImageCreate(w, h, (uint8)maxval);
+    InstrTimerEnd(timer);
+    return img;
+  }
+
+  // Mapeamento privado: as páginas só são copiadas quando escritas, e as
+  // alterações nunca chegam ao ficheiro.
+  success = success &&
+      check((map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fileno(f), 0)) != MAP_FAILED, "Mapping file failed") &&
+      (img = ImageCreateUninit(0, 0, (uint8)maxval)) != NULL;
+
+  if (success)
+  {
+    poolFree(img->block);
+    img->block = NULL;
+    img->width = w;
+    img->height = h;
+    img->stride = w;
+    img->pixel = (uint8 *)map + offset;
+    img->map = map;
+    img->mapLength = (size_t)st.st_size;
+    img->mapDevice = st.st_dev;
+    img->mapInode = st.st_ino;
+    mappedAdd(img);
+  }
+
+  // Cleanup
+  if (!success)
+  {
+    errsave = errno;
+    if (map != MAP_FAILED)
+      munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (f != NULL)
+    fclose(f);
+  InstrTimerEnd(timer);
+  return img;
+}
+
+// Size of the pieces in which unshareMapping copies a mapping.
+#define UNSHARE_CHUNK (1 << 20)
+
+// Replace the mapping of img (which maps a file) by anonymous memory with
+// the same contents, at the same address (so views remain valid), so that
+// rewriting the file cannot change them.
+// (Truncating a file discards even the copied pages of private mappings.)
+// Returns nonzero on success, or 0 with errCause set.
+static int unshareMapping(Image img)
+{
+  // Substitua o mapeamento aos bocados, para não duplicar toda a imagem.
+  // UNSHARE_CHUNK é múltiplo do tamanho da página.
+  uint8 *base = (uint8 *)img->map;
+  int success = 1;
+  for (size_t i = 0; i < img->mapLength && success; i += UNSHARE_CHUNK)
+  {
+    size_t n = (img->mapLength - i < UNSHARE_CHUNK) ? img->mapLength - i : UNSHARE_CHUNK;
+    void *copy = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!check(copy != MAP_FAILED, "Memory allocation for unmapping failed"))
+      return 0;
+    memcpy(copy, base + i, n);
+#ifdef MREMAP_FIXED
+    // A cópia toma o lugar do pedaço de uma só vez: outra thread que esteja
+    // a ler a imagem vê sempre os mesmos níveis.
+    success = check(mremap(copy, n, n, MREMAP_MAYMOVE | MREMAP_FIXED, base + i) != MAP_FAILED,
+                    "Unmapping file failed");
+    if (!success)
+      munmap(copy, n);
+#else
+    success = check(mmap(base + i, n, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED,
+                    "Unmapping file failed");
+    if (success)
+      memcpy(base + i, copy, n);
+    munmap(copy, n);
+#endif
+  }
+  if (success)
+  {
+    img->mapInode = 0; // já não depende do ficheiro
+    img->mapDevice = 0;
+  }
+  return success;
+}
+
+// Give every image that maps the file filename (not only the one being
+// saved) its own copy of the pixels, before the file is rewritten.
+// Returns nonzero on success, or 0 with errCause set.
+static int unshareMappings(const char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0)
+  {
+    return 1; // Um ficheiro novo: nenhuma imagem o mapeia.
+  }
+  int success = 1;
+  pthread_mutex_lock(&mappedLock);
+  for (Image img = mapped; img != NULL && success; img = img->mapNext)
+  {
+    if (img->mapDevice == st.st_dev && img->mapInode == st.st_ino)
+      success = unshareMapping(img);
+  }
+  pthread_mutex_unlock(&mappedLock);
+  return success;
+}
+
+// Write the pixels of img to f, row by row unless rows are contiguous.
+// Returns nonzero on success.
+static int writeRows(Image img, FILE *f)
+{
+  if (img->tiled)
+  {
+    // Uma linha de blocos de cada vez, copiada para um buffer.
+    size_t width = (size_t)img->width;
+    uint8 *rows = (uint8 *)poolAlloc(TILE * width, 0);
+    for (int y = 0; rows != NULL && y < img->height; y += TILE)
+    {
+      int n = (y + TILE < img->height) ? TILE : img->height - y;
+      copyRows(img, y, n, rows, 0);
+      int success = fwrite(rows, sizeof(uint8), n * width, f) == n * width;
+      if (!success || y + n == img->height)
+      {
+        poolFree(rows);
+        return success;
+      }
+    }
+    poolFree(rows); // (só se não houver linhas)
+    // Sem memória para isso: cada linha pelos seus troços contíguos.
+    for (int y = 0; y < img->height; y++)
+    {
+      for (int x = 0, n; x < img->width; x += n)
+      {
+        const uint8 *p = runPtr(img, x, y, &n);
+        if (fwrite(p, sizeof(uint8), (size_t)n, f) != (size_t)n)
+          return 0;
+      }
+    }
+    return 1;
+  }
+  size_t len;
+  int n = spans(img, &len);
+  for (int k = 0; k < n; k++)
+  {
+    if (fwrite(rowPtr(img, k), sizeof(uint8), len, f) != len)
+      return 0;
+  }
+  return 1;
+}
+
+/// Save image to PGM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSave(Image img, const char *filename)
+{ ///
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  FILE *f = NULL;
+  InstrTimer timer = InstrTimerBegin("save");
+
+  int success =
+      unshareMappings(filename) && // fopen vai truncar o ficheiro
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
+      check(writeRows(img, f), "Writing pixels failed");
+  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
 
   // Cleanup
   if (f != NULL)
     fclose(f);
+  InstrTimerEnd(timer);
   return success;
 }
 
@@ -224,6 +1059,76 @@ int ImageMaxval(Image img)
   return img->maxval;
 }
 
+// Minimum and maximum of the n levels at p, combined with (*min, *max).
+static void rangeSpan(const uint8 *p, size_t n, uint8 *min, uint8 *max)
+{
+  uint8 lo = *min, hi = *max;
+  size_t i = 0;
+#if defined(__AVX2__)
+  if (n >= 32)
+  {
+    __m256i lo32 = _mm256_set1_epi8((char)lo);
+    __m256i hi32 = _mm256_set1_epi8((char)hi);
+    for (; i + 32 <= n; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      lo32 = _mm256_min_epu8(lo32, v);
+      hi32 = _mm256_max_epu8(hi32, v);
+    }
+    uint8 l[32], h[32];
+    _mm256_storeu_si256((__m256i *)l, lo32);
+    _mm256_storeu_si256((__m256i *)h, hi32);
+    for (int k = 0; k < 32; k++)
+    {
+      lo = (l[k] < lo) ? l[k] : lo;
+      hi = (h[k] > hi) ? h[k] : hi;
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  if (n - i >= 16)
+  {
+    __m128i lo16 = _mm_set1_epi8((char)lo);
+    __m128i hi16 = _mm_set1_epi8((char)hi);
+    for (; i + 16 <= n; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      lo16 = _mm_min_epu8(lo16, v);
+      hi16 = _mm_max_epu8(hi16, v);
+    }
+    uint8 l[16], h[16];
+    _mm_storeu_si128((__m128i *)l, lo16);
+    _mm_storeu_si128((__m128i *)h, hi16);
+    for (int k = 0; k < 16; k++)
+    {
+      lo = (l[k] < lo) ? l[k] : lo;
+      hi = (h[k] > hi) ? h[k] : hi;
+    }
+  }
+#elif defined(__ARM_NEON)
+  if (n >= 16)
+  {
+    uint8x16_t lo16 = vdupq_n_u8(lo);
+    uint8x16_t hi16 = vdupq_n_u8(hi);
+    for (; i + 16 <= n; i += 16)
+    {
+      uint8x16_t v = vld1q_u8(p + i);
+      lo16 = vminq_u8(lo16, v);
+      hi16 = vmaxq_u8(hi16, v);
+    }
+    lo = vminvq_u8(lo16);
+    hi = vmaxvq_u8(hi16);
+  }
+#endif
+  for (; i < n; i++)
+  {
+    lo = (p[i] < lo) ? p[i] : lo;
+    hi = (p[i] > hi) ? p[i] : hi;
+  }
+  *min = lo;
+  *max = hi;
+}
+
 void ImageStats(Image img, uint8 *min, uint8 *max)
 {
   assert(img != NULL);
@@ -240,21 +1145,36 @@ void ImageStats(Image img, uint8 *min, uint8 *max)
     *max = 0;
     return;
   }
+  if (hasStats(img))
+  {
+    // Já calculados por ImageStatsEx, e a imagem não mudou desde então.
+    *min = img->stats->min;
+    *max = img->stats->max;
+    return;
+  }
 
-  *min = img->pixel[0];
-  *max = img->pixel[0];
+  int first;
+  *min = *runPtr(img, 0, 0, &first);
+  *max = *min;
 
-  for (int i = 1; i < width * height; i++)
+  if (img->tiled)
   {
-    uint8 pixel_value = img->pixel[i];
-    if (pixel_value < *min)
+    // Pelos troços contíguos de cada linha, dentro dos blocos.
+    for (int y = 0; y < height; y++)
     {
-      *min = pixel_value;
-    }
-    if (pixel_value > *max)
-    {
-      *max = pixel_value;
+      for (int x = 0, n; x < width; x += n)
+      {
+        const uint8 *p = runPtr(img, x, y, &n);
+        rangeSpan(p, (size_t)n, min, max);
+      }
     }
+    return;
+  }
+  size_t len;
+  int n = spans(img, &len);
+  for (int k = 0; k < n; k++)
+  {
+    rangeSpan(rowPtr(img, k), len, min, max);
   }
 }
 
@@ -273,11 +1193,15 @@ int ImageValidRect(Image img, int x, int y, int w, int h)
 
 static inline int G(Image img, int x, int y)
 {
-  assert(0 <= x && x < img->width);
-  assert(0 <= y && y < img->height);
+  KERNEL_ASSERT(0 <= x && x < img->width);
+  KERNEL_ASSERT(0 <= y && y < img->height);
 
-  int index = y * img->width + x;
-  assert(0 <= index && index < img->width * img->height);
+  if (img->tiled)
+  {
+    return (int)tileIndex(img, x, y);
+  }
+  int index = y * img->stride + x;
+  KERNEL_ASSERT(0 <= index && index < img->stride * img->height);
   return index;
 }
 
@@ -297,325 +1221,3947 @@ void ImageSetPixel(Image img, int x, int y, uint8 level)
   assert(ImageValidPos(img, x, y));
   PIXMEM += 1; // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  modified(img);
 }
 
-void ImageNegative(Image img)
-{ ///
-  assert(img != NULL);
+/// Parallel row bands
 
-  int width = img->width;
-  int height = img->height;
+// Operations split their rows in bands, processed in parallel by the
+// thread pool.  Each band must only write its own rows.  Kernels return
+// the pixel accesses they made, which are added up by the calling thread,
+// so PIXMEM gets the same total as with a single thread.
 
-  for (int y = 0; y < height; y++)
-  {
-    for (int x = 0; x < width; x++)
-    {
-      uint8 currentPixel = ImageGetPixel(img, x, y);
-      uint8 negativePixel = PixMax - currentPixel; // Calcula o valor negativo do pixel
-      ImageSetPixel(img, x, y, negativePixel);
-    }
-  }
-}
+// Pixels below which an operation is not split across threads.
+#define PARALLEL_PIXELS (1 << 16)
 
-void ImageThreshold(Image img, uint8 thr)
-{ ///
-  assert(img != NULL);
+// Maximum number of bands per operation.
+#define MAX_BANDS 256
 
-  int width = img->width;
-  int height = img->height;
-  uint8 maxval = img->maxval;
+// Process rows [y0, y1), which form band k.
+typedef unsigned long (*BandKernel)(void *arg, int k, int y0, int y1);
 
-  for (int y = 0; y < height; y++)
-  {
-    for (int x = 0; x < width; x++)
-    {
-      uint8 currentPixel = ImageGetPixel(img, x, y);
-      uint8 newPixel;
+struct bands
+{
+  BandKernel kernel;
+  void *arg;
+  int rows, band;
+  unsigned long count[MAX_BANDS];
+};
 
-      if (currentPixel < thr)
-      {
-        newPixel = 0; // Transforma em preto
-      }
-      else
-      {
-        newPixel = maxval; // Transforma em branco (máximo valor)
-      }
+static void runBand(void *arg, int k)
+{
+  struct bands *job = (struct bands *)arg;
+  int y0 = k * job->band;
+  int y1 = (y0 + job->band < job->rows) ? y0 + job->band : job->rows;
+  job->count[k] = job->kernel(job->arg, k, y0, y1);
+}
 
-      ImageSetPixel(img, x, y, newPixel);
-    }
+// Rows per band, to split rows rows of width pixels across the threads.
+// Returns rows if the work is too small to be worth splitting.
+static int bandRows(int rows, int width)
+{
+  int threads = PoolThreads();
+  if (threads == 1 || (long)rows * width < PARALLEL_PIXELS)
+  {
+    return rows > 0 ? rows : 1;
   }
+  // Algumas faixas por thread equilibram a carga, mas cada uma deve ter
+  // pixels suficientes para compensar o custo de a distribuir.
+  int tasks = 4 * threads;
+  int band = (rows + tasks - 1) / tasks;
+  int least = (PARALLEL_PIXELS / 4 + width - 1) / width;
+  if (band < least)
+    band = least;
+  if ((rows + band - 1) / band > MAX_BANDS)
+    band = (rows + MAX_BANDS - 1) / MAX_BANDS;
+  return band;
 }
 
-void ImageBrighten(Image img, double factor)
-{ ///
-  assert(img != NULL);
-  int width = img->width;
-  int height = img->height;
-  uint8 maxval = img->maxval;
-
-  for (int y = 0; y < height; y++)
+// Run kernel over rows [0, rows), in bands of band rows (see bandRows).
+// Returns the total pixel accesses.
+static unsigned long forBands(int rows, int band, BandKernel kernel, void *arg)
+{
+  if (band >= rows)
   {
-    for (int x = 0; x < width; x++)
-    {
-      uint8 currentPixel = ImageGetPixel(img, x, y);
-      // Calcula o novo valor do pixel multiplicando pelo fator.
-      uint8 newPixel = (uint8)((currentPixel * factor)+0.5);
-
-      // Satura o valor se ele exceder o valor máximo.
-      if (newPixel > maxval)
-      {
-        newPixel = maxval;
-      }
+    return kernel(arg, 0, 0, rows);
+  }
+  struct bands job;
+  job.kernel = kernel;
+  job.arg = arg;
+  job.rows = rows;
+  job.band = band;
+  int n = (rows + band - 1) / band;
+  PoolRun(n, runBand, &job);
 
-      ImageSetPixel(img, x, y, newPixel);
-    }
+  unsigned long count = 0;
+  for (int k = 0; k < n; k++)
+  {
+    count += job.count[k];
   }
+  return count;
 }
 
+// Copy the rows of a tiled image to or from a raster copy (a BandKernel).
+struct copyOp
+{
+  Image img, raster;
+  int back;           // 0: de img para raster; 1: de raster para img
+};
 
-
-Image ImageRotate(Image img)
-{ ///
-  assert(img != NULL);
-
-  // Obtenha as dimensões da imagem original.
-  int width = img->width;
-  int height = img->height;
-
-  // Crie uma nova imagem com dimensões invertidas (90 graus anti-horário).
-  Image rotatedImage = ImageCreate(height, width, img->maxval);
-
-  if (rotatedImage == NULL)
+static unsigned long copyBand(void *arg, int k, int y0, int y1)
+{
+  const struct copyOp *op = (const struct copyOp *)arg;
+  (void)k;
+  if (y0 < y1)
   {
-    // Falha na alocação de memória para a nova imagem.
-    return NULL;
+    copyRows(op->img, y0, y1 - y0, rowPtr(op->raster, y0), op->back);
   }
+  return 2 * (unsigned long)op->img->width * (y1 - y0); // one read and one store per pixel
+}
 
-  for (int y = 0; y < height; y++)
+// Some kernels (the filters that keep rows in ring buffers and
+// ImageLocateSubImage) only work on raster images.  For those, rasterBegin
+// returns a raster copy of a tiled img (or img itself, if already raster),
+// and rasterEnd copies it back to img if changed, and destroys it.
+// rasterBegin returns NULL if there is no memory for the copy.
+static Image rasterBegin(Image img)
+{
+  if (!img->tiled)
   {
-    for (int x = 0; x < width; x++)
-    {
-      // Copie os pixels da imagem original na nova imagem, girando 90 graus.
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(rotatedImage, y ,width - x - 1, pixel);
-    }
+    return img;
+  }
+  Image raster = ImageCreateUninit(img->width, img->height, img->maxval);
+  if (raster != NULL)
+  {
+    struct copyOp op = { img, raster, 0 };
+    PIXMEM += forBands(img->height, bandRows(img->height, img->width), copyBand, &op);
   }
+  return raster;
+}
 
-  return rotatedImage;
+static void rasterEnd(Image img, Image raster, int changed)
+{
+  if (raster != img && changed)
+  {
+    struct copyOp op = { img, raster, 1 };
+    PIXMEM += forBands(img->height, bandRows(img->height, img->width), copyBand, &op);
+  }
+  if (raster != img)
+  {
+    ImageDestroy(&raster);
+  }
+  if (changed)
+  {
+    modified(img);
+  }
 }
 
-Image ImageMirror(Image img)
-{ ///
-  assert(img != NULL);
+/// Statistics
 
-  // Obtenha as dimensões da imagem original.
-  int width = img->width;
-  int height = img->height;
+// The constants of the 64-bit hash of ImageStatsEx (those of xxHash64).
+#define HASH_P1 0x9E3779B185EBCA87ull
+#define HASH_P2 0xC2B2AE3D27D4EB4Full
+#define HASH_P3 0x165667B19E3779F9ull
 
-  // Crie uma nova imagem espelhada com as mesmas dimensões.
-  Image mirroredImage = ImageCreate(width, height, img->maxval);
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
 
-  if (mirroredImage == NULL)
-  {
-    // Falha na alocação de memória para a nova imagem.
-    return NULL;
-  }
+// Mix all the bits of h (the finalizer of MurmurHash3).
+static inline uint64_t fmix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
 
-  for (int y = 0; y < height; y++)
+// The 8 levels at p as a little-endian word, whatever the host.
+static inline uint64_t load64(const uint8 *p)
+{
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
+}
+
+// Hash of a row of n levels: four independent lanes of xxHash64 rounds
+// over 32-level blocks, then the remaining words and levels.
+static uint64_t rowHash(const uint8 *p, size_t n)
+{
+  uint64_t lane[4] = { HASH_P1 + HASH_P2, HASH_P2, 0, 0 - HASH_P1 };
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
   {
-    for (int x = 0; x < width; x++)
+    for (int k = 0; k < 4; k++)
     {
-      // Copie os pixels da imagem original na nova imagem espelhada.
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(mirroredImage, width - x - 1, y, pixel);
+      lane[k] = rotl64(lane[k] + load64(p + i + 8 * k) * HASH_P2, 31) * HASH_P1;
     }
   }
+  for (; i + 8 <= n; i += 8)
+  {
+    lane[0] = rotl64(lane[0] + load64(p + i) * HASH_P2, 31) * HASH_P1;
+  }
+  uint64_t tail = 0;
+  for (size_t k = 0; i + k < n; k++)
+  {
+    tail |= (uint64_t)p[i + k] << (8 * k);
+  }
+  uint64_t h = (uint64_t)n * HASH_P3;
+  for (int k = 0; k < 4; k++)
+  {
+    h = (h ^ fmix64(lane[k])) * HASH_P1;
+  }
+  return fmix64(h ^ tail);
+}
 
-  return mirroredImage;
+// K^e, modulo 2^64.
+static uint64_t power64(uint64_t k, unsigned long e)
+{
+  uint64_t r = 1;
+  for (; e > 0; e >>= 1)
+  {
+    if (e & 1)
+      r *= k;
+    k *= k;
+  }
+  return r;
 }
 
-Image ImageCrop(Image img, int x, int y, int w, int h)
-{ ///
-  assert(img != NULL);
-  assert(ImageValidRect(img, x, y, w, h));
+// The parameters of ImageStatsEx, shared by the bands of the image.
+struct statsOp
+{
+  Image img;
+  int band;               // linhas por faixa
+  uint64_t (*count)[256]; // o histograma de cada faixa
+  uint64_t *hash;         // e o hash das suas linhas
+  uint8 *rows;            // imagens em blocos: uma linha por faixa
+};
 
-  // Crie uma nova imagem com as dimensões especificadas (w x h).
-  Image croppedImage = ImageCreate(w, h, img->maxval);
+// Histogram and hash of rows [y0, y1) (a BandKernel).
+// The hash of the rows is h = sum of rowHash(row y) * P1^(y1-1-y), by
+// Horner's rule, so that the hashes of the bands combine into the hash
+// of the image whatever the number of bands.
+static unsigned long statsBand(void *arg, int k, int y0, int y1)
+{
+  const struct statsOp *op = (const struct statsOp *)arg;
+  Image img = op->img;
+  size_t width = (size_t)img->width;
+  uint64_t *count = op->count[k];
+  uint64_t h = 0;
 
-  if (croppedImage == NULL)
+  // Quatro histogramas parciais, para que níveis iguais seguidos não
+  // esperem uns pelos outros; contadores de 32 bits, despejados em count
+  // antes de poderem transbordar.
+  uint32_t part[4][256];
+  memset(part, 0, sizeof(part));
+  size_t pending = 0;
+  for (int v = 0; v < 256; v++)
   {
-    // Falha na alocação de memória para a nova imagem.
-    return NULL;
+    count[v] = 0;
   }
 
-  for (int j = 0; j < h; j++)
+  for (int y = y0; y < y1; y++)
   {
-    for (int i = 0; i < w; i++)
+    const uint8 *p;
+    if (img->tiled)
     {
-      // Copie os pixels da imagem original na nova imagem (região recortada).
-      uint8 pixel = ImageGetPixel(img, x + i, y + j);
-      ImageSetPixel(croppedImage, i, j, pixel);
+      // O hash é o da linha seguida: copie-a dos blocos.
+      uint8 *row = op->rows + (size_t)k * width;
+      copyRows(img, y, 1, row, 0);
+      p = row;
     }
-  }
-
-  return croppedImage;
-}
-
-void ImagePaste(Image img1, int x, int y, Image img2)
-{ ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+    else
+    {
+      p = rowPtr(img, y);
+    }
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+      part[0][p[i]]++;
+      part[1][p[i + 1]]++;
+      part[2][p[i + 2]]++;
+      part[3][p[i + 3]]++;
+    }
+    for (; i < width; i++)
+    {
+      part[0][p[i]]++;
+    }
+    // A linha ainda está na cache: calcule já o seu hash.
+    h = h * HASH_P1 + rowHash(p, width);
 
-  // Copie os pixels de img2 para img1 na posição (x, y).
-  for (int j = 0; j < img2->height; j++) {
-    for (int i = 0; i < img2->width; i++)
+    pending += width;
+    if (pending >= (1u << 30) || y == y1 - 1)
     {
-      uint8 pixel = ImageGetPixel(img2, i, j);
-      ImageSetPixel(img1, x + i, y + j, pixel);
+      for (int v = 0; v < 256; v++)
+      {
+        count[v] += (uint64_t)part[0][v] + part[1][v] + part[2][v] + part[3][v];
+      }
+      memset(part, 0, sizeof(part));
+      pending = 0;
     }
   }
+  op->hash[k] = h;
+  return (unsigned long)width * (y1 - y0); // count pixel memory accesses
 }
 
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
-{ ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+// Compute the statistics of img into *st, in one pass over the pixels.
+// Returns 0 if there is no memory for the bands.
+static int computeStats(Image img, ImageStatistics *st)
+{
+  int width = img->width;
+  int height = img->height;
+  memset(st, 0, sizeof(*st));
+  uint64_t h = 0;
 
-  // Misture os pixels de img2 com img1 na posição (x, y) usando o valor alfa.
-  for (int j = 0; j < img2->height; j++)
+  if (width > 0 && height > 0)
   {
-    for (int i = 0; i < img2->width; i++)
+    struct statsOp op;
+    op.img = img;
+    op.band = bandRows(height, width);
+    int bands = (height + op.band - 1) / op.band;
+    op.count = (uint64_t(*)[256])poolAlloc((size_t)bands * sizeof(*op.count), 0);
+    op.hash = (uint64_t *)poolAlloc((size_t)bands * sizeof(uint64_t), 0);
+    op.rows = img->tiled ? (uint8 *)poolAlloc((size_t)bands * width, 0) : NULL;
+    if (!check(op.count != NULL && op.hash != NULL && (op.rows != NULL || !img->tiled),
+               "Memory allocation for statistics failed"))
+    {
+      poolFree(op.count);
+      poolFree(op.hash);
+      poolFree(op.rows);
+      return 0;
+    }
+    PIXMEM += forBands(height, op.band, statsBand, &op);
+    poolFree(op.rows);
+
+    for (int k = 0; k < bands; k++)
+    {
+      int rows = (k == bands - 1) ? height - k * op.band : op.band;
+      h = h * power64(HASH_P1, (unsigned long)rows) + op.hash[k];
+      for (int v = 0; v < 256; v++)
+      {
+        st->count[v] += op.count[k][v];
+      }
+    }
+    poolFree(op.count);
+    poolFree(op.hash);
+
+    // Mínimo, máximo e média saem do histograma.
+    uint64_t sum = 0;
+    int min = -1, max = 0;
+    for (int v = 0; v < 256; v++)
     {
-      uint8 pixel1 = ImageGetPixel(img1, x + i, y + j);
-      uint8 pixel2 = ImageGetPixel(img2, i, j);
-      // Calcule o novo pixel misturado usando alpha.
-      double blendedPixel = (alpha * pixel2 + (1 - alpha) * pixel1) + 0.5;
-      if (blendedPixel > img1->maxval) {
-        blendedPixel = img1->maxval;
+      if (st->count[v] > 0)
+      {
+        if (min < 0)
+          min = v;
+        max = v;
+        sum += st->count[v] * (uint64_t)v;
       }
-      ImageSetPixel(img1, x + i, y + j, (uint8)blendedPixel);
     }
+    st->min = (uint8)min;
+    st->max = (uint8)max;
+    st->mean = (double)sum / ((double)width * height);
   }
+  st->hash = fmix64(h ^ fmix64(((uint64_t)width << 32 | (uint32_t)height) ^
+                               (uint64_t)img->maxval * HASH_P2));
+  return 1;
 }
 
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
+int ImageStatsEx(Image img, ImageStatistics *stats)
+{ ///
+  assert(img != NULL);
+  assert(stats != NULL);
+
+  if (!hasStats(img))
+  {
+    InstrTimer timer = InstrTimerBegin("stats");
+    if (img->stats == NULL)
+    {
+      img->stats = (ImageStatistics *)malloc(sizeof(ImageStatistics));
+    }
+    int success = computeStats(img, (img->stats != NULL) ? img->stats : stats);
+    InstrTimerEnd(timer);
+    if (!success)
+    {
+      free(img->stats); // pode ter ficado a meio
+      img->stats = NULL;
+      return 0;
+    }
+    if (img->stats == NULL)
+    {
+      return 1; // Sem memória para as guardar: ficam só em *stats.
+    }
+    img->statsVersion = owner(img)->version;
+  }
+  *stats = *img->stats;
+  return 1;
+}
+
+int ImageHistogram(Image img, uint64_t count[256])
+{ ///
+  assert(img != NULL);
+  assert(count != NULL);
+
+  ImageStatistics stats;
+  if (!ImageStatsEx(img, &stats))
+  {
+    return 0;
+  }
+  memcpy(count, stats.count, sizeof(stats.count));
+  return 1;
+}
+
+/// Point operation kernels
+
+// These process a contiguous span of n pixels in place.
+// Each has a scalar loop plus AVX2/SSE2 or NEON vector loops, selected at
+// compile time (e.g. make CFLAGS="-O2 -march=native" enables AVX2).
+
+static void negativeSpan(uint8 *p, size_t n)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i white32 = _mm256_set1_epi8((char)PixMax);
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    _mm256_storeu_si256((__m256i *)(p + i), _mm256_subs_epu8(white32, v));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i white = _mm_set1_epi8((char)PixMax);
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    _mm_storeu_si128((__m128i *)(p + i), _mm_subs_epu8(white, v));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t white = vdupq_n_u8(PixMax);
+  for (; i + 16 <= n; i += 16)
+  {
+    vst1q_u8(p + i, vqsubq_u8(white, vld1q_u8(p + i)));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    p[i] = PixMax - p[i];
+  }
+}
+
+static void thresholdSpan(uint8 *p, size_t n, uint8 thr, uint8 maxval)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i thr32 = _mm256_set1_epi8((char)thr);
+  const __m256i max32 = _mm256_set1_epi8((char)maxval);
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    // v >= thr  <=>  max(v, thr) == v
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, thr32), v);
+    _mm256_storeu_si256((__m256i *)(p + i), _mm256_and_si256(ge, max32));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i thr16 = _mm_set1_epi8((char)thr);
+  const __m128i max16 = _mm_set1_epi8((char)maxval);
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, thr16), v);
+    _mm_storeu_si128((__m128i *)(p + i), _mm_and_si128(ge, max16));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t thr16 = vdupq_n_u8(thr);
+  const uint8x16_t max16 = vdupq_n_u8(maxval);
+  for (; i + 16 <= n; i += 16)
+  {
+    uint8x16_t ge = vcgeq_u8(vld1q_u8(p + i), thr16);
+    vst1q_u8(p + i, vandq_u8(ge, max16));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    p[i] = (p[i] < thr) ? 0 : maxval;
+  }
+}
+
+// Reference brighten of one level: floor(level*factor + 0.5),
+// saturated to [0, maxval].
+static inline uint8 brightenLevel(uint8 level, double factor, uint8 maxval)
+{
+  double v = level * factor + 0.5;
+  if (v >= maxval)
+    return maxval;
+  return (v > 0.0) ? (uint8)v : 0;
+}
+
+// Fixed-point form of brighten: level -> (level*mul + add) >> shift,
+// with mul and add fitting in 16-bit signed lanes.
+struct brightenFixed
+{
+  int mul;
+  int add;
+  int shift;
+};
+
+// Find fixed-point parameters that reproduce brightenLevel exactly for
+// every possible level.  A few roundings of factor*2^shift are tried,
+// since the double result is often exactly halfway for decimal factors.
+// Returns 1 on success, 0 if no exact parameters were found.
+static int findBrightenFixed(double factor, uint8 maxval, struct brightenFixed *bf)
+{
+  int shift = 15;
+  while (shift > 1 && !(factor * (1 << shift) < 32767.0 && factor * (1 << shift) > -32767.0))
+  {
+    shift--;
+  }
+  if (!(factor * (1 << shift) < 32767.0 && factor * (1 << shift) > -32767.0))
+  {
+    return 0; // Fator demasiado grande (ou NaN) para 16 bits.
+  }
+
+  double scaled = factor * (1 << shift);
+  int candidates[3] = {(int)(scaled + (scaled < 0 ? -0.5 : 0.5)), (int)scaled + 1, (int)scaled - 1};
+  for (int c = 0; c < 3; c++)
+  {
+    int mul = candidates[c];
+    int add = 1 << (shift - 1);
+    int exact = 1;
+    for (int level = 0; level <= 255 && exact; level++)
+    {
+      int v = (level * mul + add) >> shift;
+      uint8 fixed = (v <= 0) ? 0 : (v >= maxval) ? maxval : (uint8)v;
+      exact = (fixed == brightenLevel((uint8)level, factor, maxval));
+    }
+    if (exact)
+    {
+      bf->mul = mul;
+      bf->add = add;
+      bf->shift = shift;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void brightenSpan(uint8 *p, size_t n, const struct brightenFixed *bf, uint8 maxval)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i zero32 = _mm256_setzero_si256();
+  const __m256i one32 = _mm256_set1_epi16(1);
+  const __m256i coef32 = _mm256_set1_epi32((int)(((uint32_t)bf->add << 16) | (uint16_t)bf->mul));
+  const __m256i max32 = _mm256_set1_epi8((char)maxval);
+  const __m128i shift32 = _mm_cvtsi32_si128(bf->shift);
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i lo = _mm256_unpacklo_epi8(v, zero32);
+    __m256i hi = _mm256_unpackhi_epi8(v, zero32);
+    // Pares (level, 1) x (mul, add) -> level*mul + add, em 32 bits.
+    __m256i a = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(lo, one32), coef32), shift32);
+    __m256i b = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(lo, one32), coef32), shift32);
+    __m256i c = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(hi, one32), coef32), shift32);
+    __m256i d = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(hi, one32), coef32), shift32);
+    // Os unpack/pack atuam por metades de 128 bits, logo a ordem é reposta.
+    __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+    _mm256_storeu_si256((__m256i *)(p + i), _mm256_min_epu8(r, max32));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i coef = _mm_set1_epi32((int)(((uint32_t)bf->add << 16) | (uint16_t)bf->mul));
+  const __m128i max16 = _mm_set1_epi8((char)maxval);
+  const __m128i shift = _mm_cvtsi32_si128(bf->shift);
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i a = _mm_sra_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, one), coef), shift);
+    __m128i b = _mm_sra_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo, one), coef), shift);
+    __m128i c = _mm_sra_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(hi, one), coef), shift);
+    __m128i d = _mm_sra_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(hi, one), coef), shift);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128((__m128i *)(p + i), _mm_min_epu8(r, max16));
+  }
+#elif defined(__ARM_NEON)
+  const int16x4_t mul = vdup_n_s16((int16_t)bf->mul);
+  const int32x4_t add = vdupq_n_s32(bf->add);
+  const int32x4_t shift = vdupq_n_s32(-bf->shift); // shift left by -s = shift right
+  const uint8x16_t max16 = vdupq_n_u8(maxval);
+  for (; i + 16 <= n; i += 16)
+  {
+    uint8x16_t v = vld1q_u8(p + i);
+    int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+    int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+    int32x4_t a = vshlq_s32(vmlal_s16(add, vget_low_s16(lo), mul), shift);
+    int32x4_t b = vshlq_s32(vmlal_s16(add, vget_high_s16(lo), mul), shift);
+    int32x4_t c = vshlq_s32(vmlal_s16(add, vget_low_s16(hi), mul), shift);
+    int32x4_t d = vshlq_s32(vmlal_s16(add, vget_high_s16(hi), mul), shift);
+    int16x8_t ab = vcombine_s16(vqmovn_s32(a), vqmovn_s32(b));
+    int16x8_t cd = vcombine_s16(vqmovn_s32(c), vqmovn_s32(d));
+    uint8x16_t r = vcombine_u8(vqmovun_s16(ab), vqmovun_s16(cd));
+    vst1q_u8(p + i, vminq_u8(r, max16));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    int v = (p[i] * bf->mul + bf->add) >> bf->shift;
+    p[i] = (v <= 0) ? 0 : (v >= maxval) ? maxval : (uint8)v;
+  }
+}
+
+// Generic table lookup: p[i] = lut[p[i]].
+static void lookupSpan(uint8 *p, size_t n, const uint8 lut[256])
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  // A tabela é dividida em 16 sub-tabelas de 16 entradas: o nibble baixo
+  // indexa cada uma (pshufb) e o nibble alto escolhe qual usar.
+  __m256i tables[16];
+  for (int k = 0; k < 16; k++)
+  {
+    tables[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + 16 * k)));
+  }
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i r = _mm256_setzero_si256();
+    for (int k = 0; k < 16; k++)
+    {
+      __m256i sel = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k));
+      r = _mm256_or_si256(r, _mm256_and_si256(sel, _mm256_shuffle_epi8(tables[k], lo)));
+    }
+    _mm256_storeu_si256((__m256i *)(p + i), r);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  // Quatro consultas de 64 entradas cobrem a tabela inteira; índices fora
+  // do intervalo de cada consulta mantêm o valor anterior (vqtbx4q).
+  uint8x16x4_t t0 = vld1q_u8_x4(lut);
+  uint8x16x4_t t1 = vld1q_u8_x4(lut + 64);
+  uint8x16x4_t t2 = vld1q_u8_x4(lut + 128);
+  uint8x16x4_t t3 = vld1q_u8_x4(lut + 192);
+  const uint8x16_t off = vdupq_n_u8(64);
+  for (; i + 16 <= n; i += 16)
+  {
+    uint8x16_t v = vld1q_u8(p + i);
+    uint8x16_t r = vqtbl4q_u8(t0, v);
+    v = vsubq_u8(v, off);
+    r = vqtbx4q_u8(r, t1, v);
+    v = vsubq_u8(v, off);
+    r = vqtbx4q_u8(r, t2, v);
+    v = vsubq_u8(v, off);
+    r = vqtbx4q_u8(r, t3, v);
+    vst1q_u8(p + i, r);
+  }
+#endif
+  for (; i + 4 <= n; i += 4)
+  {
+    uint8 a = lut[p[i]], b = lut[p[i + 1]], c = lut[p[i + 2]], d = lut[p[i + 3]];
+    p[i] = a;
+    p[i + 1] = b;
+    p[i + 2] = c;
+    p[i + 3] = d;
+  }
+  for (; i < n; i++)
+  {
+    p[i] = lut[p[i]];
+  }
+}
+
+void ImageLUTNegative(uint8 lut[256])
+{ ///
+  for (int v = 0; v < 256; v++)
+  {
+    lut[v] = PixMax - (uint8)v;
+  }
+}
+
+void ImageLUTThreshold(uint8 lut[256], uint8 thr, uint8 maxval)
+{ ///
+  for (int v = 0; v < 256; v++)
+  {
+    lut[v] = (v < thr) ? 0 : maxval;
+  }
+}
+
+void ImageLUTBrighten(uint8 lut[256], double factor, uint8 maxval)
+{ ///
+  for (int v = 0; v < 256; v++)
+  {
+    lut[v] = brightenLevel((uint8)v, factor, maxval);
+  }
+}
+
+void ImageLUTGamma(uint8 lut[256], double gamma, uint8 maxval)
+{ ///
+  assert(gamma > 0.0);
+  for (int v = 0; v < 256; v++)
+  {
+    double level = maxval * pow((double)v / maxval, gamma) + 0.5;
+    lut[v] = (level >= maxval) ? maxval : (uint8)level;
+  }
+}
+
+void ImageLUTCompose(uint8 result[256], const uint8 first[256], const uint8 second[256])
+{ ///
+  uint8 tmp[256];
+  for (int v = 0; v < 256; v++)
+  {
+    tmp[v] = second[first[v]];
+  }
+  memcpy(result, tmp, sizeof(tmp));
+}
+
+// A point operation, and the kernel that applies it.
+enum pointKind { POINT_FILL, POINT_THRESHOLD, POINT_NEGATIVE, POINT_LOOKUP, POINT_BRIGHTEN };
+
+struct pointOp
+{
+  Image img;
+  enum pointKind kind;
+  const uint8 *lut;        // POINT_LOOKUP
+  uint8 thr;               // POINT_THRESHOLD
+  uint8 level;             // POINT_FILL, POINT_THRESHOLD, POINT_BRIGHTEN (maxval)
+  struct brightenFixed bf; // POINT_BRIGHTEN
+};
+
+static void pointSpan(const struct pointOp *op, uint8 *p, size_t n)
+{
+  switch (op->kind)
+  {
+  case POINT_FILL:
+    memset(p, op->level, n);
+    break;
+  case POINT_THRESHOLD:
+    thresholdSpan(p, n, op->thr, op->level);
+    break;
+  case POINT_NEGATIVE:
+    negativeSpan(p, n);
+    break;
+  case POINT_LOOKUP:
+    lookupSpan(p, n, op->lut);
+    break;
+  case POINT_BRIGHTEN:
+    brightenSpan(p, n, &op->bf, op->level);
+    break;
+  }
+}
+
+// Apply a point operation to rows [y0, y1) (a BandKernel).
+static unsigned long pointBand(void *arg, int k, int y0, int y1)
+{
+  const struct pointOp *op = (const struct pointOp *)arg;
+  Image img = op->img;
+  size_t w = (size_t)img->width;
+  (void)k;
+
+  if (img->tiled && img->parent == NULL)
+  {
+    // Linhas de blocos inteiras (ver pointRows): um só segmento, incluindo
+    // o enchimento dos blocos das bordas, que nunca é lido.
+    uint8 *p = img->pixel + (size_t)(y0 >> TILE_SHIFT) * img->stride;
+    uint8 *end = img->pixel + (size_t)((y1 + TILE_MASK) >> TILE_SHIFT) * img->stride;
+    pointSpan(op, p, (size_t)(end - p));
+  }
+  else if (img->tiled)
+  {
+    // Numa vista, pelos troços contíguos de cada linha, dentro dos blocos.
+    for (int y = y0; y < y1; y++)
+    {
+      for (int x = 0, n; x < (int)w; x += n)
+      {
+        uint8 *p = runPtr(img, x, y, &n);
+        pointSpan(op, p, (size_t)n);
+      }
+    }
+  }
+  else if (img->stride == img->width && y1 > y0)
+  {
+    // Linhas contíguas: um só segmento, melhor para os kernels vetoriais.
+    pointSpan(op, rowPtr(img, y0), (size_t)(y1 - y0) * w);
+  }
+  else
+  {
+    for (int y = y0; y < y1; y++)
+    {
+      pointSpan(op, rowPtr(img, y), w);
+    }
+  }
+  return 2 * (unsigned long)(y1 - y0) * w; // one read and one store per pixel
+}
+
+// Rows per band of a point operation on img: whole rows of tiles, if tiled.
+static int pointRows(Image img)
+{
+  int band = bandRows(img->height, img->width);
+  if (img->tiled && band < img->height)
+  {
+    band = (band + TILE_MASK) & ~TILE_MASK;
+  }
+  return band;
+}
+
+static void applyLUT(Image img, const uint8 lut[256])
+{
+  assert(img != NULL);
+  assert(lut != NULL);
+
+  // Reconheça as tabelas com um kernel próprio, mais rápido do que a
+  // consulta genérica: constante, negativo e limiar (0 abaixo de t, m acima).
+  int t = 0;
+  while (t < 256 && lut[t] == 0)
+  {
+    t++;
+  }
+  uint8 m = (t < 256) ? lut[t] : 0;
+  int isThreshold = 1, isNegative = 1;
+  for (int v = 0; v < 256; v++)
+  {
+    isThreshold = isThreshold && lut[v] == ((v < t) ? 0 : m);
+    isNegative = isNegative && lut[v] == (uint8)(PixMax - v);
+  }
+
+  struct pointOp op;
+  op.img = img;
+  op.lut = lut;
+  op.level = m;
+  op.thr = (uint8)t;
+  op.kind = (isThreshold && (t == 0 || t == 256)) ? POINT_FILL
+          : isThreshold ? POINT_THRESHOLD
+          : isNegative ? POINT_NEGATIVE
+          : POINT_LOOKUP;
+  PIXMEM += forBands(img->height, pointRows(img), pointBand, &op);
+
+  modified(img);
+}
+
+void ImageApplyLUT(Image img, const uint8 lut[256])
+{ ///
+  InstrTimer timer = InstrTimerBegin("lut");
+  applyLUT(img, lut);
+  InstrTimerEnd(timer);
+}
+
+void ImageNegative(Image img)
+{ ///
+  assert(img != NULL);
+
+  InstrTimer timer = InstrTimerBegin("negative");
+  uint8 lut[256];
+  ImageLUTNegative(lut);
+  applyLUT(img, lut);
+  InstrTimerEnd(timer);
+}
+
+void ImageThreshold(Image img, uint8 thr)
+{ ///
+  assert(img != NULL);
+
+  InstrTimer timer = InstrTimerBegin("threshold");
+  uint8 lut[256];
+  ImageLUTThreshold(lut, thr, img->maxval);
+  applyLUT(img, lut);
+  InstrTimerEnd(timer);
+}
+
+void ImageBrighten(Image img, double factor)
+{ ///
+  assert(img != NULL);
+
+  InstrTimer timer = InstrTimerBegin("brighten");
+  uint8 maxval = img->maxval;
+  struct pointOp op;
+
+  if (!findBrightenFixed(factor, maxval, &op.bf))
+  {
+    // Não há versão inteira exata: consulte a tabela da fórmula original.
+    uint8 lut[256];
+    ImageLUTBrighten(lut, factor, maxval);
+    applyLUT(img, lut);
+    InstrTimerEnd(timer);
+    return;
+  }
+
+  op.img = img;
+  op.kind = POINT_BRIGHTEN;
+  op.level = maxval;
+  PIXMEM += forBands(img->height, pointRows(img), pointBand, &op);
+
+  modified(img);
+  InstrTimerEnd(timer);
+}
+
+// Copy n pixels from src to dst in reverse order: dst[i] = src[n-1-i].
+// The spans must not overlap.
+static void reverseSpan(uint8 *dst, const uint8 *src, size_t n)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                       15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + n - 32 - i));
+    v = _mm256_shuffle_epi8(v, rev);             // inverte cada metade
+    v = _mm256_permute2x128_si256(v, v, 0x01);   // e troca as metades
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + n - 16 - i));
+    // Troca os bytes de cada palavra de 16 bits, depois as palavras.
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16)
+  {
+    uint8x16_t v = vrev64q_u8(vld1q_u8(src + n - 16 - i));
+    vst1q_u8(dst + i, vextq_u8(v, v, 8));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    dst[i] = src[n - 1 - i];
+  }
+}
+
+// ImageRemap without its timer, for the operations that use it.
+static Image remap(Image img, int w, int h, int x0, int y0,
+                   int xi, int yi, int xj, int yj, const uint8 lut[256]);
+
+// Remaps (see ImageRemap) that may produce an empty image.
+// Empty images are handled here, since ImageRemap requires w, h > 0.
+static Image remapImage(Image img, int w, int h, int x0, int y0,
+                        int xi, int yi, int xj, int yj)
+{
+  if (w == 0 || h == 0)
+  {
+    return createImage(w, h, img->maxval, 1, img->tiled);
+  }
+  return remap(img, w, h, x0, y0, xi, yi, xj, yj, NULL);
+}
+
+Image ImageRotate(Image img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  // Pixel (i, j) do resultado vem de (width-1-j, i).
+  InstrTimer timer = InstrTimerBegin("rotate");
+  Image result = remapImage(img, height, width, width - 1, 0, 0, 1, -1, 0);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+Image ImageRotate180(Image img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  // Pixel (i, j) do resultado vem de (width-1-i, height-1-j).
+  InstrTimer timer = InstrTimerBegin("rotate");
+  Image result = remapImage(img, width, height, width - 1, height - 1, -1, 0, 0, -1);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+Image ImageRotate270(Image img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  // Pixel (i, j) do resultado vem de (j, height-1-i).
+  InstrTimer timer = InstrTimerBegin("rotate");
+  Image result = remapImage(img, height, width, 0, height - 1, 0, -1, 1, 0);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+Image ImageMirror(Image img)
+{ ///
+  assert(img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  // Pixel (i, j) do resultado vem de (width-1-i, j).
+  InstrTimer timer = InstrTimerBegin("mirror");
+  Image result = remapImage(img, width, height, width - 1, 0, -1, 0, 0, 1);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+Image ImageCrop(Image img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+
+  // Pixel (i, j) do resultado vem de (x+i, y+j).
+  InstrTimer timer = InstrTimerBegin("crop");
+  Image result = remapImage(img, w, h, x, y, 1, 0, 0, 1);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+// Side of the square blocks in which ImageRemap writes transposed rows.
+#define REMAP_TILE 64
+
+// The parameters of ImageRemap, shared by the bands of the result.
+struct remapOp
+{
+  Image img, result;
+  int x0, y0, xi, yi, xj, yj;
+  ptrdiff_t step;     // passo em img ao longo de uma linha do resultado,
+                      // se ambas as imagens forem raster (senão, 0)
+  int aligned;        // em blocos: cada bloco do resultado vem de um de img?
+  const uint8 *lut;
+};
+
+// Write pixels [i0, i1) of row j of the result of ImageRemap.
+static void remapRun(const struct remapOp *op, int j, int i0, int i1)
+{
+  int x = op->x0 + i0 * op->xi + j * op->xj;
+  int y = op->y0 + i0 * op->yi + j * op->yj;
+  // Um troço de cada vez, com passo constante na origem e no destino:
+  // a linha toda em imagens raster, ou até à borda de um bloco.
+  for (int i = i0, n; i < i1; i += n, x += n * op->xi, y += n * op->yi)
+  {
+    ptrdiff_t step, one;
+    n = i1 - i;
+    uint8 *dst = walkPtr(op->result, i, j, 1, 0, &n, &one);
+    const uint8 *src = walkPtr(op->img, x, y, op->xi, op->yi, &n, &step);
+
+    if (step == 1)
+    {
+      memcpy(dst, src, (size_t)n);
+    }
+    else if (step == -1)
+    {
+      reverseSpan(dst, src - (n - 1), (size_t)n);
+    }
+    else
+    {
+      for (int t = 0; t < n; t++)
+      {
+        dst[t] = src[t * step];
+      }
+    }
+    if (op->lut != NULL)
+    {
+      lookupSpan(dst, (size_t)n, op->lut);
+    }
+  }
+}
+
+// Write the block of the result of ImageRemap with rows [t0, t1) and
+// columns [i0, i1), when it is a tile that comes from a single tile of img.
+static void remapTile(const struct remapOp *op, int t0, int t1, int i0, int i1)
+{
+  const uint8 *src = op->img->pixel +
+      tileIndex(op->img, op->x0 + i0 * op->xi + t0 * op->xj, op->y0 + i0 * op->yi + t0 * op->yj);
+  uint8 *dst = op->result->pixel + tileIndex(op->result, i0, t0);
+  ptrdiff_t si = op->xi + (ptrdiff_t)op->yi * TILE; // passos em src, ao longo
+  ptrdiff_t sj = op->xj + (ptrdiff_t)op->yj * TILE; // de uma linha e de uma coluna
+
+  if (t1 - t0 == TILE && i1 - i0 == TILE)
+  {
+    // Um bloco completo: limites constantes, que o compilador desenrola.
+    for (int r = 0; r < TILE; r++)
+    {
+      for (int c = 0; c < TILE; c++)
+      {
+        dst[r * TILE + c] = src[r * sj + c * si];
+      }
+    }
+  }
+  else
+  {
+    for (int r = 0; r < t1 - t0; r++)
+    {
+      for (int c = 0; c < i1 - i0; c++)
+      {
+        dst[r * TILE + c] = src[r * sj + c * si];
+      }
+    }
+  }
+  if (op->lut != NULL)
+  {
+    for (int r = 0; r < t1 - t0; r++)
+    {
+      lookupSpan(dst + r * TILE, (size_t)(i1 - i0), op->lut);
+    }
+  }
+}
+
+// Size of the pieces in which ImageRemap copies rows of tiled images.
+#define REMAP_CHUNK 1024
+
+// Write row j of the result of ImageRemap, when it is a row of img and the
+// images are tiled: piece by piece, through a buffer that is read from img
+// and written to the result by whole runs of each.
+static void remapRow(const struct remapOp *op, int j)
+{
+  uint8 in[REMAP_CHUNK], out[REMAP_CHUNK];
+  int w = op->result->width;
+  for (int i = 0, n; i < w; i += n)
+  {
+    n = (w - i < REMAP_CHUNK) ? w - i : REMAP_CHUNK;
+    int x = op->x0 + i * op->xi + j * op->xj;
+    int y = op->y0 + i * op->yi + j * op->yj;
+    if (op->xi > 0)
+    {
+      copySpan(op->img, x, y, n, out, 0);
+    }
+    else
+    {
+      copySpan(op->img, x - (n - 1), y, n, in, 0);
+      reverseSpan(out, in, (size_t)n);
+    }
+    if (op->lut != NULL)
+    {
+      lookupSpan(out, (size_t)n, op->lut);
+    }
+    copySpan(op->result, i, j, n, out, 1);
+  }
+}
+
+// Write rows [j0, j1) of the result of ImageRemap (a BandKernel).
+static unsigned long remapBand(void *arg, int k, int j0, int j1)
+{
+  const struct remapOp *op = (const struct remapOp *)arg;
+  Image img = op->img;
+  int w = op->result->width;
+  ptrdiff_t step = op->step;
+  (void)k;
+
+  if (op->yi == 0)
+  {
+    // As linhas do resultado são linhas de img, possivelmente invertidas.
+    for (int j = j0; j < j1; j++)
+    {
+      if (step == 0)
+        remapRow(op, j);
+      else
+        remapRun(op, j, 0, w);
+    }
+  }
+  else
+  {
+    // As linhas do resultado são colunas de img (rotações de 90/270 graus).
+    // Percorra o resultado em blocos de REMAP_TILE x REMAP_TILE pixels:
+    // cada bloco lê REMAP_TILE linhas de img, que ficam na cache enquanto
+    // o bloco é escrito, em vez de uma linha nova por cada pixel.
+    // (Em blocos, cada linha de um bloco lê no máximo dois blocos de img.)
+    for (int t0 = j0; t0 < j1; t0 += REMAP_TILE)
+    {
+      int t1 = (t0 + REMAP_TILE < j1) ? t0 + REMAP_TILE : j1;
+      for (int i0 = 0; i0 < w; i0 += REMAP_TILE)
+      {
+        int i1 = (i0 + REMAP_TILE < w) ? i0 + REMAP_TILE : w;
+        if (op->aligned)
+        {
+          remapTile(op, t0, t1, i0, i1);
+          continue;
+        }
+        for (int j = t0; j < t1; j++)
+        {
+          if (step == 0)
+          {
+            remapRun(op, j, i0, i1);
+            continue;
+          }
+          const uint8 *src = rowPtr(img, op->y0 + j * op->yj) + (op->x0 + j * op->xj);
+          uint8 *dst = op->result->pixel + (size_t)j * w;
+          for (int i = i0; i < i1; i++)
+          {
+            dst[i] = src[i * step];
+          }
+        }
+      }
+      if (step != 0 && op->lut != NULL)
+      {
+        lookupSpan(op->result->pixel + (size_t)t0 * w, (size_t)(t1 - t0) * w, op->lut);
+      }
+    }
+  }
+  return 2 * (unsigned long)w * (j1 - j0); // one read and one store per pixel
+}
+
+static Image remap(Image img, int w, int h, int x0, int y0,
+                   int xi, int yi, int xj, int yj, const uint8 lut[256])
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  assert(abs(xi) + abs(yi) == 1 && abs(xj) + abs(yj) == 1 && xi * xj + yi * yj == 0);
+  // A transformação é afim: basta verificar os quatro cantos.
+  assert(ImageValidPos(img, x0, y0));
+  assert(ImageValidPos(img, x0 + (w - 1) * xi, y0 + (w - 1) * yi));
+  assert(ImageValidPos(img, x0 + (h - 1) * xj, y0 + (h - 1) * yj));
+  assert(ImageValidPos(img, x0 + (w - 1) * xi + (h - 1) * xj, y0 + (w - 1) * yi + (h - 1) * yj));
+
+  // O resultado fica na disposição de img.
+  Image result = createImage(w, h, img->maxval, 0, img->tiled);
+  if (result == NULL)
+  {
+    return NULL;
+  }
+
+  struct remapOp op;
+  op.img = img;
+  op.result = result;
+  op.x0 = x0;
+  op.y0 = y0;
+  op.xi = xi;
+  op.yi = yi;
+  op.xj = xj;
+  op.yj = yj;
+  op.step = img->tiled ? 0 : (ptrdiff_t)xi + (ptrdiff_t)yi * img->stride;
+  op.lut = lut;
+  // Os blocos do resultado vêm cada um de um só bloco de img se o canto
+  // (x0, y0) estiver no canto de um bloco, do lado de onde se parte.
+  int cx = (x0 + img->x0) & TILE_MASK;
+  int cy = (y0 + img->y0) & TILE_MASK;
+  op.aligned = img->tiled && REMAP_TILE == TILE &&
+               cx == ((xi + xj > 0) ? 0 : TILE_MASK) && cy == ((yi + yj > 0) ? 0 : TILE_MASK);
+
+  int band = bandRows(h, w);
+  if (yi != 0 && band < h)
+  {
+    // Faixas com um número inteiro de blocos.
+    band = (band + REMAP_TILE - 1) / REMAP_TILE * REMAP_TILE;
+  }
+  PIXMEM += forBands(h, band, remapBand, &op);
+
+  return result;
+}
+
+Image ImageRemap(Image img, int w, int h, int x0, int y0,
+                 int xi, int yi, int xj, int yj, const uint8 lut[256])
+{ ///
+  InstrTimer timer = InstrTimerBegin("remap");
+  Image result = remap(img, w, h, x0, y0, xi, yi, xj, yj, lut);
+  InstrTimerEnd(timer);
+  return result;
+}
+
+/// In-place rotations and mirror
+
+// Swap pixel (x, ya) with (width-1-x, yb), for x in [0, n), walking the
+// pixels in runs (see walkPtr).  With ya == yb and n = width/2, this
+// mirrors row ya.
+// Each pair of pieces is reversed with reverseSpan into two buffers, and
+// copied back.
+static void swapReversed(Image img, int ya, int yb, int n)
+{
+  int w = img->width;
+  uint8 bufA[REMAP_CHUNK], bufB[REMAP_CHUNK];
+  for (int x = 0; x < n;)
+  {
+    int na = n - x;
+    int nb = n - x;
+    ptrdiff_t step;
+    uint8 *a = walkPtr(img, x, ya, 1, 0, &na, &step);
+    uint8 *b = walkPtr(img, w - 1 - x, yb, -1, 0, &nb, &step);
+    int m = (na < nb) ? na : nb;
+    if (m > REMAP_CHUNK)
+      m = REMAP_CHUNK;
+    // As m posições a partir de a e as m até b (inclusive) não se sobrepõem.
+    reverseSpan(bufA, b - (m - 1), (size_t)m);
+    reverseSpan(bufB, a, (size_t)m);
+    memcpy(a, bufA, (size_t)m);
+    memcpy(b - (m - 1), bufB, (size_t)m);
+    x += m;
+  }
+}
+
+// Mirror rows [y0, y1) of img (a BandKernel).
+static unsigned long mirrorBand(void *arg, int k, int y0, int y1)
+{
+  Image img = (Image)arg;
+  (void)k;
+  for (int y = y0; y < y1; y++)
+  {
+    swapReversed(img, y, y, img->width / 2);
+  }
+  return 4ul * (img->width / 2) * (y1 - y0); // two reads and two stores per pair
+}
+
+void ImageMirrorInPlace(Image img)
+{ ///
+  assert(img != NULL);
+  InstrTimer timer = InstrTimerBegin("mirror");
+  PIXMEM += forBands(img->height, bandRows(img->height, img->width), mirrorBand, img);
+  modified(img);
+  InstrTimerEnd(timer);
+}
+
+// Swap rows y and height-1-y of img, reversed, for y in [y0, y1)
+// (a BandKernel, over the top half of the rows).
+static unsigned long rotate180Band(void *arg, int k, int y0, int y1)
+{
+  Image img = (Image)arg;
+  int w = img->width;
+  int h = img->height;
+  unsigned long count = 0;
+  (void)k;
+  for (int y = y0; y < y1; y++)
+  {
+    // Com um número ímpar de linhas, a do meio troca só consigo mesma.
+    int n = (2 * y + 1 == h) ? w / 2 : w;
+    swapReversed(img, y, h - 1 - y, n);
+    count += 4ul * n;
+  }
+  return count;
+}
+
+void ImageRotate180InPlace(Image img)
+{ ///
+  assert(img != NULL);
+  int rows = (img->height + 1) / 2;
+  InstrTimer timer = InstrTimerBegin("rotate");
+  PIXMEM += forBands(rows, bandRows(rows, 2 * img->width), rotate180Band, img);
+  modified(img);
+  InstrTimerEnd(timer);
+}
+
+// out = in (w x h pixels) rotated 90 degrees anti-clockwise (h x w).
+static void rotateBlock(const uint8 *in, int w, int h, uint8 *out)
+{
+  for (int j = 0; j < w; j++)
+  {
+    for (int i = 0; i < h; i++)
+    {
+      out[j * h + i] = in[i * w + (w - 1 - j)];
+    }
+  }
+}
+
+// Rotate a square img in place, for the 4-cycles of pixels with the first
+// position (x, y) in the top left quadrant,
+//   x in [0, side/2), y in [y0, y1)
+// (a BandKernel, over the (side+1)/2 rows of the quadrant).
+// The quadrant is taken in blocks of up to REMAP_TILE x REMAP_TILE pixels.
+// Each block r[0] and the blocks r[1], r[2] and r[3] its pixels come from,
+// around the cycle, are copied out, and each r[k] is then written with
+// r[k+1] rotated: each pixel is read and written once, row by row,
+// instead of along columns (whose rows, in raster images with a stride
+// that is a power of 2, would all compete for the same cache sets).
+static unsigned long rotateBand(void *arg, int k, int y0, int y1)
+{
+  Image img = (Image)arg;
+  int m = img->width - 1;
+  int half = img->width / 2;
+  uint8 block[4][REMAP_TILE * REMAP_TILE];
+  uint8 out[REMAP_TILE * REMAP_TILE];
+  (void)k;
+  for (int t0 = y0; t0 < y1; t0 += REMAP_TILE)
+  {
+    int h = (t0 + REMAP_TILE < y1) ? REMAP_TILE : y1 - t0;
+    for (int i0 = 0; i0 < half; i0 += REMAP_TILE)
+    {
+      int w = (i0 + REMAP_TILE < half) ? REMAP_TILE : half - i0;
+      // Os cantos e os lados de r[k]; r[1] e r[3] têm h x w pixels.
+      int x[4] = { i0, m - t0 - h + 1, m - i0 - w + 1, t0 };
+      int y[4] = { t0, i0, m - t0 - h + 1, m - i0 - w + 1 };
+      int rw[4] = { w, h, w, h };
+      int rh[4] = { h, w, h, w };
+      for (int r = 0; r < 4; r++)
+      {
+        for (int j = 0; j < rh[r]; j++)
+          copySpan(img, x[r], y[r] + j, rw[r], block[r] + j * rw[r], 0);
+      }
+      for (int r = 0; r < 4; r++)
+      {
+        int from = (r + 1) & 3;
+        rotateBlock(block[from], rw[from], rh[from], out);
+        for (int j = 0; j < rh[r]; j++)
+          copySpan(img, x[r], y[r] + j, rw[r], out + j * rw[r], 1);
+      }
+    }
+  }
+  return 8ul * half * (y1 - y0); // four reads and four stores per cycle
+}
+
+void ImageRotateInPlace(Image img)
+{ ///
+  assert(img != NULL);
+  assert(img->width == img->height);
+  int rows = (img->height + 1) / 2;
+  InstrTimer timer = InstrTimerBegin("rotate");
+  int band = bandRows(rows, 2 * img->width);
+  if (band < rows)
+  {
+    // Faixas com um número inteiro de blocos.
+    band = (band + REMAP_TILE - 1) / REMAP_TILE * REMAP_TILE;
+  }
+  PIXMEM += forBands(rows, band, rotateBand, img);
+  modified(img);
+  InstrTimerEnd(timer);
+}
+
+void ImagePaste(Image img1, int x, int y, Image img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+
+  // Copie as linhas de img2 para img1 na posição (x, y).
+  InstrTimer timer = InstrTimerBegin("paste");
+  int w = img2->width;
+  int h = img2->height;
+  for (int j = 0; j < h; j++)
+  {
+    for (int i = 0, n; i < w; i += n)
+    {
+      uint8 *dst, *src;
+      n = runPair(img1, x + i, y + j, &dst, img2, i, j, &src, w - i);
+      memmove(dst, src, (size_t)n);
+    }
+  }
+  PIXMEM += 2 * (unsigned long)w * h; // one read and one store per pixel
+
+  modified(img1);
+  InstrTimerEnd(timer);
+}
+
+// Reference blend of one pixel: floor(alpha*level2 + (1-alpha)*level1 + 0.5),
+// saturated to [0, maxval].
+static inline uint8 blendLevel(uint8 level1, uint8 level2, double alpha, uint8 maxval)
+{
+  double v = (alpha * level2 + (1 - alpha) * level1) + 0.5;
+  if (v >= maxval)
+    return maxval;
+  return (v > 0.0) ? (uint8)v : 0;
+}
+
+// Fixed-point form of blend:
+//   (level1*mul1 + level2*mul2 + 2^(shift-1)) >> shift,
+// with mul1 + mul2 == 2^shift, both fitting in 16-bit signed lanes.
+// mul2 is alpha*2^shift rounded, off by some e <= 1/2, so the sum differs
+// from 2^shift times the exact value by at most |e|*255 units.
+// Unlike brighten, the weights cannot simply be checked for every input:
+// for decimal alphas like .33 the double sum is often exactly halfway,
+// and no weights round those cases as the double does.  So the pixels
+// whose sum lies within guard units of a rounding boundary are redone
+// with blendLevel, and the others are exact by the bound above.
+// For alphas like .5 or .25, e == 0 and no pixel needs to be redone.
+struct blendFixed
+{
+  int mul1;
+  int mul2;
+  int shift; // 0 if alpha has no fixed-point form
+  int guard;
+};
+
+static void findBlendFixed(double alpha, struct blendFixed *bf)
+{
+  bf->shift = 0;
+  // Com shift < 10, a faixa de dúvida cobriria boa parte dos valores.
+  for (int shift = 15; shift >= 10; shift--)
+  {
+    double scaled = alpha * (1 << shift);
+    if (!(scaled < 32767.0 && scaled > -32767.0))
+      continue; // Peso demasiado grande (ou NaN) para 16 bits.
+    int mul2 = (int)(scaled + (scaled < 0 ? -0.5 : 0.5));
+    int mul1 = (1 << shift) - mul2;
+    if (mul1 > 32767 || mul1 < -32767)
+      continue;
+    bf->mul1 = mul1;
+    bf->mul2 = mul2;
+    bf->shift = shift;
+    // Mais uma unidade cobre os erros de arredondamento do double.
+    double e = fabs(mul2 - scaled);
+    bf->guard = (e == 0.0) ? 0 : (int)(e * 255) + 2;
+    return;
+  }
+}
+
+// Blend n pixels of src into dst: dst[i] = blendLevel(dst[i], src[i], ...).
+// The spans must not overlap.
+static void blendSpan(uint8 *dst, const uint8 *src, size_t n, double alpha,
+                      const struct blendFixed *bf, uint8 maxval)
+{
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+  if (bf->shift > 0)
+  {
+    int half = 1 << (bf->shift - 1);
+    int mask = (1 << bf->shift) - 1;
+    uint8 orig[32]; // os níveis de dst, para refazer os pixels em dúvida
+#endif
+#if defined(__AVX2__)
+    const __m256i zero32 = _mm256_setzero_si256();
+    const __m256i coef32 = _mm256_set1_epi32((int)(((uint32_t)bf->mul2 << 16) | (uint16_t)bf->mul1));
+    const __m256i half32 = _mm256_set1_epi32(half);
+    const __m256i mask32 = _mm256_set1_epi32(mask);
+    const __m256i low32 = _mm256_set1_epi32(bf->guard);
+    const __m256i high32 = _mm256_set1_epi32(mask + 1 - bf->guard);
+    const __m256i max32 = _mm256_set1_epi8((char)maxval);
+    const __m128i shift32 = _mm_cvtsi32_si128(bf->shift);
+    for (; i + 32 <= n; i += 32)
+    {
+      __m256i v1 = _mm256_loadu_si256((const __m256i *)(dst + i));
+      __m256i v2 = _mm256_loadu_si256((const __m256i *)(src + i));
+      __m256i lo1 = _mm256_unpacklo_epi8(v1, zero32);
+      __m256i lo2 = _mm256_unpacklo_epi8(v2, zero32);
+      __m256i hi1 = _mm256_unpackhi_epi8(v1, zero32);
+      __m256i hi2 = _mm256_unpackhi_epi8(v2, zero32);
+      // Pares (level1, level2) x (mul1, mul2) -> soma em 32 bits.
+      __m256i s[4] = {_mm256_unpacklo_epi16(lo1, lo2), _mm256_unpackhi_epi16(lo1, lo2),
+                      _mm256_unpacklo_epi16(hi1, hi2), _mm256_unpackhi_epi16(hi1, hi2)};
+      __m256i doubt[4];
+      for (int k = 0; k < 4; k++)
+      {
+        s[k] = _mm256_add_epi32(_mm256_madd_epi16(s[k], coef32), half32);
+        __m256i frac = _mm256_and_si256(s[k], mask32);
+        doubt[k] = _mm256_or_si256(_mm256_cmpgt_epi32(low32, frac), _mm256_cmpgt_epi32(frac, high32));
+        s[k] = _mm256_sra_epi32(s[k], shift32);
+      }
+      // Os unpack/pack atuam por metades de 128 bits, logo a ordem é reposta.
+      __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(s[0], s[1]), _mm256_packs_epi32(s[2], s[3]));
+      unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_packs_epi16(
+          _mm256_packs_epi32(doubt[0], doubt[1]), _mm256_packs_epi32(doubt[2], doubt[3])));
+      if (bits != 0)
+        _mm256_storeu_si256((__m256i *)orig, v1);
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_min_epu8(r, max32));
+      for (; bits != 0; bits &= bits - 1)
+      {
+        int k = __builtin_ctz(bits);
+        dst[i + k] = blendLevel(orig[k], src[i + k], alpha, maxval);
+      }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coef = _mm_set1_epi32((int)(((uint32_t)bf->mul2 << 16) | (uint16_t)bf->mul1));
+    const __m128i half16 = _mm_set1_epi32(half);
+    const __m128i mask16 = _mm_set1_epi32(mask);
+    const __m128i low16 = _mm_set1_epi32(bf->guard);
+    const __m128i high16 = _mm_set1_epi32(mask + 1 - bf->guard);
+    const __m128i max16 = _mm_set1_epi8((char)maxval);
+    const __m128i shift = _mm_cvtsi32_si128(bf->shift);
+    for (; i + 16 <= n; i += 16)
+    {
+      __m128i v1 = _mm_loadu_si128((const __m128i *)(dst + i));
+      __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i));
+      __m128i lo1 = _mm_unpacklo_epi8(v1, zero);
+      __m128i lo2 = _mm_unpacklo_epi8(v2, zero);
+      __m128i hi1 = _mm_unpackhi_epi8(v1, zero);
+      __m128i hi2 = _mm_unpackhi_epi8(v2, zero);
+      __m128i s[4] = {_mm_unpacklo_epi16(lo1, lo2), _mm_unpackhi_epi16(lo1, lo2),
+                      _mm_unpacklo_epi16(hi1, hi2), _mm_unpackhi_epi16(hi1, hi2)};
+      __m128i doubt[4];
+      for (int k = 0; k < 4; k++)
+      {
+        s[k] = _mm_add_epi32(_mm_madd_epi16(s[k], coef), half16);
+        __m128i frac = _mm_and_si128(s[k], mask16);
+        doubt[k] = _mm_or_si128(_mm_cmplt_epi32(frac, low16), _mm_cmpgt_epi32(frac, high16));
+        s[k] = _mm_sra_epi32(s[k], shift);
+      }
+      __m128i r = _mm_packus_epi16(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3]));
+      unsigned bits = (unsigned)_mm_movemask_epi8(_mm_packs_epi16(
+          _mm_packs_epi32(doubt[0], doubt[1]), _mm_packs_epi32(doubt[2], doubt[3])));
+      if (bits != 0)
+        _mm_storeu_si128((__m128i *)orig, v1);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_min_epu8(r, max16));
+      for (; bits != 0; bits &= bits - 1)
+      {
+        int k = __builtin_ctz(bits);
+        dst[i + k] = blendLevel(orig[k], src[i + k], alpha, maxval);
+      }
+    }
+#elif defined(__ARM_NEON)
+    const int16x4_t mul1 = vdup_n_s16((int16_t)bf->mul1);
+    const int16x4_t mul2 = vdup_n_s16((int16_t)bf->mul2);
+    const int32x4_t half16 = vdupq_n_s32(half);
+    const int32x4_t mask16 = vdupq_n_s32(mask);
+    const int32x4_t low16 = vdupq_n_s32(bf->guard);
+    const int32x4_t high16 = vdupq_n_s32(mask + 1 - bf->guard);
+    const int32x4_t shift = vdupq_n_s32(-bf->shift); // shift left by -s = shift right
+    const uint8x16_t max16 = vdupq_n_u8(maxval);
+    for (; i + 16 <= n; i += 16)
+    {
+      uint8x16_t v1 = vld1q_u8(dst + i);
+      uint8x16_t v2 = vld1q_u8(src + i);
+      int16x8_t lo1 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v1)));
+      int16x8_t hi1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v1)));
+      int16x8_t lo2 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v2)));
+      int16x8_t hi2 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v2)));
+      int32x4_t s[4] = {
+          vmlal_s16(vmlal_s16(half16, vget_low_s16(lo1), mul1), vget_low_s16(lo2), mul2),
+          vmlal_s16(vmlal_s16(half16, vget_high_s16(lo1), mul1), vget_high_s16(lo2), mul2),
+          vmlal_s16(vmlal_s16(half16, vget_low_s16(hi1), mul1), vget_low_s16(hi2), mul2),
+          vmlal_s16(vmlal_s16(half16, vget_high_s16(hi1), mul1), vget_high_s16(hi2), mul2)};
+      uint16x4_t doubt[4];
+      for (int k = 0; k < 4; k++)
+      {
+        int32x4_t frac = vandq_s32(s[k], mask16);
+        doubt[k] = vmovn_u32(vorrq_u32(vcltq_s32(frac, low16), vcgtq_s32(frac, high16)));
+        s[k] = vshlq_s32(s[k], shift);
+      }
+      int16x8_t ab = vcombine_s16(vqmovn_s32(s[0]), vqmovn_s32(s[1]));
+      int16x8_t cd = vcombine_s16(vqmovn_s32(s[2]), vqmovn_s32(s[3]));
+      uint8x16_t r = vcombine_u8(vqmovun_s16(ab), vqmovun_s16(cd));
+      uint8x16_t flags = vcombine_u8(vmovn_u16(vcombine_u16(doubt[0], doubt[1])),
+                                     vmovn_u16(vcombine_u16(doubt[2], doubt[3])));
+      vst1q_u8(orig, v1);
+      vst1q_u8(dst + i, vminq_u8(r, max16));
+      uint64x2_t any = vreinterpretq_u64_u8(flags);
+      if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0)
+      {
+        uint8 doubtful[16];
+        vst1q_u8(doubtful, flags);
+        for (int k = 0; k < 16; k++)
+        {
+          if (doubtful[k])
+            dst[i + k] = blendLevel(orig[k], src[i + k], alpha, maxval);
+        }
+      }
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+  }
+#else
+  (void)bf;
+#endif
+  for (; i < n; i++)
+  {
+    dst[i] = blendLevel(dst[i], src[i], alpha, maxval);
+  }
+}
+
+// One image blended by ImageBlend or ImageBlendMany.
+struct blendLayer
+{
+  Image img2;
+  int x, y;
+  double alpha;
+  struct blendFixed fixed;
+};
+
+// The parameters of a blend, shared by the bands of the rows of img1 that
+// it covers, from row y0 on.
+struct blendOp
+{
+  Image img1;
+  int y0;
+  int n;                         // layers, blended in this order
+  const struct blendLayer *layer;
+  int serial;                    // img2 may share pixels with img1
+};
+
+// Blend the layers into rows [y0+j0, y0+j1) of img1 (a BandKernel).
+// Each row of img1 gets all the layers that cover it before the next row.
+static unsigned long blendBand(void *arg, int k, int j0, int j1)
+{
+  const struct blendOp *op = (const struct blendOp *)arg;
+  uint8 maxval = op->img1->maxval;
+  unsigned long count = 0;
+  (void)k;
+
+  for (int j = j0; j < j1; j++)
+  {
+    int y = op->y0 + j;
+    for (int l = 0; l < op->n; l++)
+    {
+      const struct blendLayer *layer = &op->layer[l];
+      if (y < layer->y || y >= layer->y + layer->img2->height)
+        continue;
+      int w = layer->img2->width;
+      for (int i = 0, n; i < w; i += n)
+      {
+        uint8 *row1, *row2;
+        n = runPair(op->img1, layer->x + i, y, &row1, layer->img2, i, y - layer->y, &row2, w - i);
+        if (op->serial)
+        {
+          // Os pixels podem sobrepor-se: um a um, pela ordem original.
+          for (int t = 0; t < n; t++)
+            row1[t] = blendLevel(row1[t], row2[t], layer->alpha, maxval);
+        }
+        else
+        {
+          blendSpan(row1, row2, (size_t)n, layer->alpha, &layer->fixed, maxval);
+        }
+      }
+      count += 3 * (unsigned long)w; // two reads and one store per pixel
+    }
+  }
+  return count;
+}
+
+// Blend the n layers into img1, row by row.
+static void blendLayers(Image img1, struct blendLayer *layer, int n)
+{
+  int y0 = INT_MAX, y1 = 0;
+  int serial = 0;
+  for (int l = 0; l < n; l++)
+  {
+    findBlendFixed(layer[l].alpha, &layer[l].fixed);
+    if (layer[l].img2->width == 0 || layer[l].img2->height == 0)
+      continue;
+    y0 = (layer[l].y < y0) ? layer[l].y : y0;
+    y1 = (layer[l].y + layer[l].img2->height > y1) ? layer[l].y + layer[l].img2->height : y1;
+    serial |= (owner(layer[l].img2) == owner(img1));
+  }
+  if (y0 >= y1)
+    return;
+  if (serial && n > 1)
+  {
+    // Cada camada tem de ver o resultado completo das anteriores.
+    for (int l = 0; l < n; l++)
+      blendLayers(img1, &layer[l], 1);
+    return;
+  }
+
+  struct blendOp op = { img1, y0, n, layer, serial };
+  int rows = y1 - y0;
+  // Se alguma imagem partilha os pixels de img1, processe as linhas por ordem.
+  int band = serial ? rows : bandRows(rows, img1->width);
+  PIXMEM += forBands(rows, band, blendBand, &op);
+
+  modified(img1);
+}
+
+void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+
+  // Misture os pixels de img2 com img1 na posição (x, y) usando o valor alfa.
+  InstrTimer timer = InstrTimerBegin("blend");
+  struct blendLayer layer = { img2, x, y, alpha, { 0, 0, 0, 0 } };
+  blendLayers(img1, &layer, 1);
+  InstrTimerEnd(timer);
+}
+
+void ImageBlendMany(Image img1, int n, Image imgs[], const int xs[], const int ys[],
+                    const double alphas[])
+{ ///
+  assert(img1 != NULL);
+  assert(n >= 0);
+
+  InstrTimer timer = InstrTimerBegin("blend");
+  struct blendLayer *layer = (struct blendLayer *)malloc((size_t)(n > 0 ? n : 1) * sizeof(*layer));
+  for (int l = 0; l < n; l++)
+  {
+    assert(imgs[l] != NULL);
+    assert(ImageValidRect(img1, xs[l], ys[l], imgs[l]->width, imgs[l]->height));
+    if (layer == NULL)
+    {
+      // Sem memória: uma passagem por camada dá o mesmo resultado.
+      struct blendLayer one = { imgs[l], xs[l], ys[l], alphas[l], { 0, 0, 0, 0 } };
+      blendLayers(img1, &one, 1);
+      continue;
+    }
+    layer[l].img2 = imgs[l];
+    layer[l].x = xs[l];
+    layer[l].y = ys[l];
+    layer[l].alpha = alphas[l];
+  }
+  if (layer != NULL)
+    blendLayers(img1, layer, n);
+  free(layer);
+  InstrTimerEnd(timer);
+}
+
+static int matchRows(Image img1, int x, int y, Image img2, unsigned long *count)
+{
+  int w = img2->width;
+  for (int j = 0; j < img2->height; j++)
+  {
+    *count += 2 * (size_t)w;
+    for (int i = 0, n; i < w; i += n)
+    {
+      uint8 *p1, *p2;
+      n = runPair(img1, x + i, y + j, &p1, img2, i, j, &p2, w - i);
+      if (memcmp(p1, p2, (size_t)n) != 0)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+
+  unsigned long count = 0;
+  int match = matchRows(img1, x, y, img2, &count);
+  PIXMEM += count; // count pixel memory accesses
+  return match;
+}
+
+// Bases of the rolling hashes used by ImageLocateSubImage (mod 2^64).
+#define HASH_ROW 0x100000001B3ull        // along rows
+#define HASH_COL 0x9E3779B97F4A7C15ull   // along columns
+
+// h[x] = hash of the w pixels of row starting at row[x], for x in [0, n).
+// Uses a Rabin-Karp rolling hash: one multiply-add per pixel.
+static void rowHashes(const uint8 *row, int w, int n, uint64_t top, uint64_t *h)
+{
+  uint64_t v = 0;
+  for (int k = 0; k < w; k++)
+  {
+    v = v * HASH_ROW + row[k];
+  }
+  h[0] = v;
+  for (int x = 1; x < n; x++)
+  {
+    v = v * HASH_ROW - row[x - 1] * top + row[x + w - 1];
+    h[x] = v;
+  }
+}
+
+// Search img2 in img1, at the candidate rows [y0, y1), in raster order,
+// using a 2D rolling hash: each row is hashed along x, and the row hashes
+// of h consecutive rows are combined along y.  Candidates whose hash
+// matches are verified exactly.  O(1) per position, whatever the contents.
+// Gives up at rows past *best, when best != NULL (see locateRows).
+// Returns 1 (and the position) on a match, 0 if there is none,
+// or -1 if there is not enough memory.
+static int locateHash(Image img1, Image img2, int y0, int y1, int *px, int *py,
+                      unsigned long *count, atomic_long *best)
+{
+  int w = img2->width;
+  int h = img2->height;
+  int n = img1->width - w + 1; // candidate positions per row
+
+  uint64_t *in = (uint64_t *)poolAlloc((size_t)n * sizeof(uint64_t), 0);
+  uint64_t *out = (uint64_t *)poolAlloc((size_t)n * sizeof(uint64_t), 0);
+  uint64_t *col = (uint64_t *)poolAlloc((size_t)n * sizeof(uint64_t), 0);
+  if (in == NULL || out == NULL || col == NULL)
+  {
+    poolFree(in);
+    poolFree(out);
+    poolFree(col);
+    return -1;
+  }
+
+  uint64_t topRow = power64(HASH_ROW, (unsigned long)w);
+  uint64_t topCol = power64(HASH_COL, (unsigned long)h);
+
+  // Hash do modelo, calculado da mesma forma.
+  uint64_t target = 0;
+  for (int j = 0; j < h; j++)
+  {
+    rowHashes(rowPtr(img2, j), w, 1, topRow, in);
+    target = target * HASH_COL + in[0];
+  }
+
+  // col[x] = hash do retângulo w x h em (x, y0).
+  for (int x = 0; x < n; x++)
+  {
+    col[x] = 0;
+  }
+  for (int j = 0; j < h; j++)
+  {
+    rowHashes(rowPtr(img1, y0 + j), w, n, topRow, in);
+    for (int x = 0; x < n; x++)
+    {
+      col[x] = col[x] * HASH_COL + in[x];
+    }
+  }
+  *count += (unsigned long)img1->width * h + (unsigned long)w * h;
+
+  int found = 0;
+  for (int y = y0; y < y1 && !found; y++)
+  {
+    if (best != NULL && atomic_load(best) < (long)y * img1->width)
+    {
+      break; // Outra tarefa já encontrou uma posição anterior.
+    }
+    for (int x = 0; x < n; x++)
+    {
+      if (col[x] == target && matchRows(img1, x, y, img2, count))
+      {
+        *px = x;
+        *py = y;
+        found = 1;
+        break;
+      }
+    }
+    if (!found && y + 1 < y1)
+    {
+      // Desliza a janela: retire a linha y e junte a linha y+h.
+      rowHashes(rowPtr(img1, y), w, n, topRow, out);
+      rowHashes(rowPtr(img1, y + h), w, n, topRow, in);
+      for (int x = 0; x < n; x++)
+      {
+        col[x] = col[x] * HASH_COL - out[x] * topCol + in[x];
+      }
+      *count += 2ul * img1->width;
+    }
+  }
+
+  poolFree(in);
+  poolFree(out);
+  poolFree(col);
+  return found;
+}
+
+// Search img2 in img1, at the candidate rows [y0, y1), in raster order,
+// from column x0 in row y0.
+// Each row is scanned with memchr for the first pixel of img2 and only
+// those positions are compared row by row.  That is very fast on most
+// images, but degrades on large uniform areas, where almost every position
+// matches the first pixels.  So the comparison work is tracked and, if it
+// grows beyond a few accesses per position, the remaining rows are
+// searched with the rolling hash instead.
+// If best != NULL, it holds the lowest position y*width+x matched so far
+// by other searches, and rows past it are not searched.
+// Returns 1 (and the position) on a match, or 0.
+static int locateRows(Image img1, Image img2, int y0, int y1, int x0, int *px, int *py,
+                      unsigned long *count, atomic_long *best)
+{
+  int w = img2->width;
+  int n = img1->width - w + 1; // candidate positions per row
+  uint8 first = rowPtr(img2, 0)[0];
+  unsigned long work = 0;      // pixel accesses spent comparing
+  unsigned long budget = 2ul * w * img2->height;
+  int canHash = 1;
+
+  for (int y = y0; y < y1; y++)
+  {
+    if (best != NULL && atomic_load(best) < (long)y * img1->width)
+    {
+      break; // Outra tarefa já encontrou uma posição anterior.
+    }
+    const uint8 *row = rowPtr(img1, y);
+    int x = (y == y0) ? x0 : 0;
+    while (x < n)
+    {
+      const uint8 *p = (const uint8 *)memchr(row + x, first, (size_t)(n - x));
+      if (p == NULL)
+      {
+        *count += (unsigned long)(n - x);
+        break;
+      }
+      *count += (unsigned long)(p - (row + x)) + 1;
+      x = (int)(p - row);
+      if (matchRows(img1, x, y, img2, &work))
+      {
+        *count += work;
+        *px = x;
+        *py = y;
+        return 1; // Encontrou uma correspondência.
+      }
+      x++;
+    }
+
+    budget += 4ul * n;
+    if (canHash && work > budget && y + 1 < y1)
+    {
+      int found = locateHash(img1, img2, y + 1, y1, px, py, count, best);
+      if (found >= 0)
+      {
+        *count += work;
+        return found;
+      }
+      canHash = 0; // Sem memória para o hash: continue com o filtro.
+    }
+  }
+  *count += work;
+  return 0; // Nenhuma correspondência encontrada.
+}
+
+// Candidate positions below which the search is not split across threads.
+#define LOCATE_PARALLEL (1 << 16)
+
+// A search split in bands of candidate rows, one per task.
+struct locate
+{
+  Image img1, img2;
+  int rows;              // candidate rows
+  int band;              // rows per task
+  atomic_long best;      // lowest y*width+x matched, or LONG_MAX
+  unsigned long *count;  // pixel accesses, per task
+};
+
+// Search the candidate rows of band k, and publish any match in best.
+static void locateBand(void *arg, int k)
+{
+  struct locate *job = (struct locate *)arg;
+  int y0 = k * job->band;
+  int y1 = y0 + job->band < job->rows ? y0 + job->band : job->rows;
+  int x, y;
+  if (locateRows(job->img1, job->img2, y0, y1, 0, &x, &y, &job->count[k], &job->best))
+  {
+    long pos = (long)y * job->img1->width + x;
+    long old = atomic_load(&job->best);
+    while (pos < old && !atomic_compare_exchange_weak(&job->best, &old, pos))
+    {
+    }
+  }
+}
+
+// Search all candidate rows with the thread pool.
+// Bands are handed out in order, and each stops early at rows past the
+// best match found so far, so this finds the same first match in raster
+// order as a sequential search, usually without scanning much beyond it.
+// Returns 1 (and the position) on a match, 0 if there is none,
+// or -1 if there is not enough memory.
+static int locateParallel(Image img1, Image img2, int rows, int *px, int *py, unsigned long *count)
+{
+  struct locate job;
+  int tasks = 8 * PoolThreads();
+  job.img1 = img1;
+  job.img2 = img2;
+  job.rows = rows;
+  job.band = (rows + tasks - 1) / tasks;
+  if (job.band < 16)
+  {
+    job.band = 16; // Faixas mais estreitas não compensam.
+  }
+  tasks = (rows + job.band - 1) / job.band;
+  atomic_init(&job.best, LONG_MAX);
+  job.count = (unsigned long *)calloc((size_t)tasks, sizeof(unsigned long));
+  if (job.count == NULL)
+  {
+    return -1;
+  }
+
+  PoolRun(tasks, locateBand, &job);
+
+  for (int k = 0; k < tasks; k++)
+  {
+    *count += job.count[k];
+  }
+  free(job.count);
+
+  long best = atomic_load(&job.best);
+  if (best == LONG_MAX)
+  {
+    return 0;
+  }
+  *px = (int)(best % img1->width);
+  *py = (int)(best / img1->width);
+  return 1;
+}
+
+int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  int width1 = img1->width;
+  int height1 = img1->height;
+  int width2 = img2->width;
+  int height2 = img2->height;
+  InstrTimer timer = InstrTimerBegin("locate");
+
+  if (width2 > width1 || height2 > height1)
+  {
+    InstrTimerEnd(timer);
+    return 0; // O modelo não cabe na imagem.
+  }
+  if (width2 == 0 || height2 == 0)
+  {
+    // Um modelo vazio coincide logo na primeira posição.
+    *px = 0;
+    *py = 0;
+    InstrTimerEnd(timer);
+    return 1;
+  }
+
+  int rows = height1 - height2 + 1; // linhas candidatas
+  unsigned long count = 0;
+  int found = -1;
+  // A procura percorre linhas inteiras: use cópias raster das imagens em blocos.
+  Image raster1 = rasterBegin(img1);
+  Image raster2 = (raster1 != NULL) ? rasterBegin(img2) : NULL;
+  if (raster2 == NULL)
+  {
+    // Sem memória para as cópias: compare posição a posição.
+    found = 0;
+    for (int y = 0; y < rows && !found; y++)
+    {
+      for (int x = 0; x + width2 <= width1 && !found; x++)
+      {
+        if (matchRows(img1, x, y, img2, &count))
+        {
+          *px = x;
+          *py = y;
+          found = 1;
+        }
+      }
+    }
+  }
+  else
+  {
+    if ((long)rows * (width1 - width2 + 1) >= LOCATE_PARALLEL && PoolThreads() > 1)
+    {
+      found = locateParallel(raster1, raster2, rows, px, py, &count);
+    }
+    if (found < 0)
+    {
+      found = locateRows(raster1, raster2, 0, rows, 0, px, py, &count, NULL);
+    }
+  }
+  rasterEnd(img1, raster1, 0);
+  rasterEnd(img2, raster2, 0);
+  PIXMEM += count; // count pixel memory accesses
+  InstrTimerEnd(timer);
+  return found;
+}
+
+long ImageLocateAllSubImages(Image img1, Image img2, int max, int xs[], int ys[])
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(max >= 0);
+
+  int width1 = img1->width;
+  int height1 = img1->height;
+  int width2 = img2->width;
+  int height2 = img2->height;
+
+  if (width2 > width1 || height2 > height1)
+  {
+    return 0; // O modelo não cabe na imagem.
+  }
+  int rows = height1 - height2 + 1; // linhas candidatas
+  int cols = width1 - width2 + 1;   // e posições candidatas por linha
+  InstrTimer timer = InstrTimerBegin("locate");
+
+  long found = 0;
+  unsigned long count = 0;
+  Image raster1 = NULL;
+  Image raster2 = NULL;
+  if (width2 == 0 || height2 == 0)
+  {
+    // Um modelo vazio coincide em todas as posições.
+    for (int y = 0; y < rows && found < max; y++)
+    {
+      for (int x = 0; x < cols && found < max; x++)
+      {
+        xs[found] = x;
+        ys[found] = y;
+        found++;
+      }
+    }
+    found = (long)rows * cols;
+  }
+  else if ((raster1 = rasterBegin(img1)) == NULL || (raster2 = rasterBegin(img2)) == NULL)
+  {
+    // Sem memória para as cópias: compare posição a posição.
+    for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < cols; x++)
+      {
+        if (matchRows(img1, x, y, img2, &count))
+        {
+          if (found < max)
+          {
+            xs[found] = x;
+            ys[found] = y;
+          }
+          found++;
+        }
+      }
+    }
+  }
+  else
+  {
+    // Cada procura continua logo a seguir à correspondência anterior.
+    int x = 0, y = 0;
+    while (locateRows(raster1, raster2, y, rows, x, &x, &y, &count, NULL))
+    {
+      if (found < max)
+      {
+        xs[found] = x;
+        ys[found] = y;
+      }
+      found++;
+      if (++x == cols)
+      {
+        x = 0;
+        if (++y == rows)
+          break;
+      }
+    }
+  }
+  if (raster1 != NULL)
+    rasterEnd(img1, raster1, 0);
+  if (raster2 != NULL)
+    rasterEnd(img2, raster2, 0);
+  PIXMEM += count; // count pixel memory accesses
+  InstrTimerEnd(timer);
+  return found;
+}
+
+void ImageFree(Image img) {
+    // Liberar a memória alocada para os pixels da imagem
+    if (img != NULL && img->map != NULL) {
+        mappedRemove(img); // Já não pode ser encontrada por ImageSave
+        munmap(img->map, img->mapLength); // Desfazer o mapeamento do ficheiro
+    } else if (img != NULL && img->pixel != NULL && img->parent == NULL) {
+        poolFree(img->block); // Liberar os dados dos pixels da imagem
+    }
+
+    if (img != NULL) {
+        poolFree(img->integral); // Liberar a tabela de somas, se existir
+        free(img->stats); // e as estatísticas guardadas
+    }
+
+    // Liberar a estrutura da imagem
+    if (img != NULL) {
+        free(img); // Liberar a estrutura da imagem
+    }
+}
+
+
+int ImageIntegral(Image img)
+{
+  assert(img != NULL);
+
+  if (hasIntegral(img))
+  {
+    return 1; // A tabela ainda é válida: a imagem não mudou.
+  }
+  poolFree(img->integral); // pode descrever pixels antigos, mudados noutra vista
+  img->integral = NULL;
+  InstrTimer timer = InstrTimerBegin("integral");
+
+  int width = img->width;
+  int height = img->height;
+  size_t cols = (size_t)width + 1;
+
+  // S[(y+1)*cols + (x+1)] = soma dos pixels no retângulo [0,x]x[0,y].
+  // A linha 0 e a coluna 0 ficam a zero para evitar casos especiais.
+  uint64_t *S = (uint64_t *)poolAlloc(cols * ((size_t)height + 1) * sizeof(uint64_t), 0);
+  if (!check(S != NULL, "Memory allocation for integral image failed"))
+  {
+    InstrTimerEnd(timer);
+    return 0;
+  }
+
+  for (size_t i = 0; i < cols; i++)
+  {
+    S[i] = 0;
+  }
+
+  for (int y = 0; y < height; y++)
+  {
+    const uint64_t *above = S + (size_t)y * cols;
+    uint64_t *curr = S + ((size_t)y + 1) * cols;
+    uint64_t rowSum = 0;
+
+    curr[0] = 0;
+    for (int x = 0, n; x < width; x += n)
+    {
+      const uint8 *run = runPtr(img, x, y, &n); // toda a linha, se raster
+      for (int i = x; i < x + n; i++)
+      {
+        rowSum += run[i - x];
+        curr[i + 1] = above[i + 1] + rowSum;
+      }
+    }
+  }
+  PIXMEM += (unsigned long)width * height; // count pixel memory accesses
+
+  img->integral = S;
+  img->integralVersion = owner(img)->version;
+  InstrTimerEnd(timer);
+  return 1;
+}
+
+uint64_t ImageRectSum(Image img, int x, int y, int w, int h)
+{
+  assert(img != NULL);
+  assert(hasIntegral(img));
+  assert(ImageValidRect(img, x, y, w, h));
+
+  const uint64_t *S = img->integral;
+  size_t cols = (size_t)img->width + 1;
+  size_t top = (size_t)y * cols;
+  size_t bottom = (size_t)(y + h) * cols;
+
+  return S[bottom + x + w] - S[top + x + w] - S[bottom + x] + S[top + x];
+}
+
+// Mean level of count pixels with the given sum: floor(sum/count + 0.5),
+// saturated at maxval.  Exact integer version of the rounding used by blur.
+static inline uint8 meanLevel(uint64_t sum, uint64_t count, uint8 maxval)
+{
+  uint64_t avg = (2 * sum + count) / (2 * count);
+  return (avg > maxval) ? maxval : (uint8)avg;
+}
+
+// The parameters of a blur, shared by the bands of the image.
+struct blurOp
+{
+  Image img;
+  int dx, dy;
+  int band;              // linhas por faixa
+  const uint64_t *S;     // ImageBlurIntegral: a tabela de somas
+  uint32_t *colSum;      // ImageBlurSeparable: width somas por faixa
+  int sums;              // (sums por coluna; ImageMedian: histogramas),
+  uint8 *ring;           // as últimas linhas originais de cada faixa,
+  int ringRows;          // com ringRows linhas por faixa,
+  const uint8 *saved;    // e as linhas originais junto às fronteiras:
+  const int *savedRow;   // a linha y está em saved + savedRow[y] * width
+};
+
+// Blur rows [y0, y1) with the integral image (a BandKernel).
+static unsigned long blurIntegralBand(void *arg, int k, int y0, int y1)
+{
+  const struct blurOp *op = (const struct blurOp *)arg;
+  Image img = op->img;
+  int width = img->width;
+  int height = img->height;
+  int dx = op->dx;
+  int dy = op->dy;
+  uint8 maxval = img->maxval;
+  const uint64_t *S = op->S;
+  size_t cols = (size_t)width + 1;
+  (void)k;
+
+  for (int y = y0; y < y1; y++)
+  {
+    // Janela vertical [wy0, wy1), recortada pelos limites da imagem.
+    int wy0 = (y - dy < 0) ? 0 : y - dy;
+    int wy1 = (y + dy + 1 > height) ? height : y + dy + 1;
+    const uint64_t *top = S + (size_t)wy0 * cols;
+    const uint64_t *bottom = S + (size_t)wy1 * cols;
+
+    for (int i = 0, n; i < width; i += n)
+    {
+      uint8 *run = runPtr(img, i, y, &n); // toda a linha, se raster
+      for (int x = i; x < i + n; x++)
+      {
+        int x0 = (x - dx < 0) ? 0 : x - dx;
+        int x1 = (x + dx + 1 > width) ? width : x + dx + 1;
+
+        uint64_t sum = bottom[x1] - top[x1] - bottom[x0] + top[x0];
+        uint64_t count = (uint64_t)(x1 - x0) * (uint64_t)(wy1 - wy0);
+        run[x - i] = meanLevel(sum, count, maxval);
+      }
+    }
+  }
+  return (unsigned long)width * (y1 - y0); // count pixel memory accesses
+}
+
+void ImageBlurIntegral(Image img, int dx, int dy)
+{
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  int width = img->width;
+  int height = img->height;
+
+  // A janela nunca precisa de ser maior do que a imagem (evita overflow).
+  if (dx > width)
+    dx = width;
+  if (dy > height)
+    dy = height;
+
+  if (!ImageIntegral(img))
+  {
+    // Falha na alocação de memória para a tabela de somas.
+    return;
+  }
+
+  // A tabela descreve a imagem original, por isso podemos escrever o
+  // resultado diretamente em img: cada pixel custa O(1), seja qual for dx, dy.
+  // As faixas só leem a tabela, por isso são independentes.
+  struct blurOp op;
+  op.img = img;
+  op.dx = dx;
+  op.dy = dy;
+  op.S = img->integral;
+  PIXMEM += forBands(height, bandRows(height, width), blurIntegralBand, &op);
+
+  modified(img);
+}
+
+// Horizontal pass of the separable blur: row[x] = mean of the column sums
+// colSum[x-dx..x+dx], each of them a sum of rows pixels.
+static void blurRow(uint8 *row, const uint32_t *colSum, int width, int dx,
+                    uint64_t rows, uint8 maxval)
+{
+  // Soma deslizante de colSum na janela [x-dx, x+dx].
+  uint64_t sum = 0;
+  for (int i = 0; i < width && i <= dx; i++)
+  {
+    sum += colSum[i];
+  }
+  for (int x = 0; x < width; x++)
+  {
+    int x0 = (x - dx < 0) ? 0 : x - dx;
+    int x1 = (x + dx + 1 > width) ? width : x + dx + 1;
+    row[x] = meanLevel(sum, (uint64_t)(x1 - x0) * rows, maxval);
+
+    if (x + dx + 1 < width)
+      sum += colSum[x + dx + 1];
+    if (x - dx >= 0)
+      sum -= colSum[x - dx];
+  }
+}
+
+// Original row j, for the separable blur of the band [y0, y1).
+// Rows of the band are still original until they are written; rows of
+// other bands may already be blurred, so their originals were saved.
+static inline const uint8 *originalRow(const struct blurOp *op, int y0, int y1, int j)
+{
+  if (j < y0 || j >= y1)
+  {
+    return op->saved + (size_t)op->savedRow[j] * op->img->width;
+  }
+  return rowPtr(op->img, j);
+}
+
+// Blur rows [y0, y1) with running sums (a BandKernel).
+static unsigned long blurSeparableBand(void *arg, int k, int y0, int y1)
+{
+  const struct blurOp *op = (const struct blurOp *)arg;
+  Image img = op->img;
+  int width = img->width;
+  int height = img->height;
+  int dx = op->dx;
+  int dy = op->dy;
+  uint8 maxval = img->maxval;
+  int ringRows = op->ringRows;
+
+  // colSum[x] = soma da coluna x nas linhas da janela vertical atual.
+  // ring guarda as últimas linhas originais da faixa, já reescritas em img,
+  // que ainda falta retirar de colSum.
+  uint32_t *colSum = op->colSum + (size_t)k * width;
+  uint8 *ring = op->ring + (size_t)k * ringRows * width;
+
+  // Janela vertical inicial (y = y0): linhas [y0-dy, y0+dy].
+  for (int x = 0; x < width; x++)
+  {
+    colSum[x] = 0;
+  }
+  for (int j = (y0 - dy < 0) ? 0 : y0 - dy; j < height && j <= y0 + dy; j++)
+  {
+    const uint8 *src = originalRow(op, y0, y1, j);
+    for (int x = 0; x < width; x++)
+    {
+      colSum[x] += src[x];
+    }
+  }
+
+  for (int y = y0; y < y1; y++)
+  {
+    uint8 *row = rowPtr(img, y);
+    uint8 *saved = ring + (size_t)((y - y0) % ringRows) * width;
+    uint64_t rows = (uint64_t)(((y + dy + 1 > height) ? height : y + dy + 1) -
+                               ((y - dy < 0) ? 0 : y - dy));
+
+    memcpy(saved, row, (size_t)width);
+
+    blurRow(row, colSum, width, dx, rows, maxval);
+
+    // Passo vertical: desliza a janela para y+1.
+    if (y - dy >= 0)
+    {
+      const uint8 *out = (y - dy < y0) ? originalRow(op, y0, y1, y - dy)
+                                       : ring + (size_t)((y - dy - y0) % ringRows) * width;
+      for (int x = 0; x < width; x++)
+      {
+        colSum[x] -= out[x];
+      }
+    }
+    if (y + dy + 1 < height)
+    {
+      const uint8 *in = originalRow(op, y0, y1, y + dy + 1);
+      for (int x = 0; x < width; x++)
+      {
+        colSum[x] += in[x];
+      }
+    }
+  }
+  return 3ul * width * (y1 - y0); // count pixel memory accesses
+}
+
+// Allocate the buffers of a separable blur in bands of band rows.
+// The original rows within dy of the band boundaries are saved, because
+// each band reads them but the neighbouring bands overwrite them.
+// Returns 1, or 0 if there is not enough memory.
+static int blurBuffers(struct blurOp *op, int band)
+{
+  Image img = op->img;
+  int width = img->width;
+  int height = img->height;
+  int dy = op->dy;
+  int bands = (height + band - 1) / band;
+
+  op->band = band;
+  op->ringRows = (dy + 1 < band) ? dy + 1 : band;
+  op->colSum = (uint32_t *)poolAlloc((size_t)bands * width * op->sums * sizeof(uint32_t), 0);
+  op->ring = (uint8 *)poolAlloc((size_t)bands * op->ringRows * width, 0);
+  op->saved = NULL;
+  op->savedRow = NULL;
+  int *savedRow = NULL;
+  uint8 *saved = NULL;
+
+  if (op->colSum != NULL && op->ring != NULL && bands > 1)
+  {
+    savedRow = (int *)poolAlloc((size_t)height * sizeof(int), 0);
+    if (savedRow != NULL)
+    {
+      // Marque as linhas [b-dy, b+dy] junto a cada fronteira b.
+      for (int j = 0; j < height; j++)
+      {
+        savedRow[j] = -1;
+      }
+      for (int b = band; b < height; b += band)
+      {
+        int j1 = (b + dy + 1 < height) ? b + dy + 1 : height;
+        for (int j = (b - dy < 0) ? 0 : b - dy; j < j1; j++)
+        {
+          savedRow[j] = 0;
+        }
+      }
+      int n = 0;
+      for (int j = 0; j < height; j++)
+      {
+        if (savedRow[j] == 0)
+        {
+          savedRow[j] = n++;
+        }
+      }
+      saved = (uint8 *)poolAlloc((size_t)n * width, 0);
+      if (saved != NULL)
+      {
+        for (int j = 0; j < height; j++)
+        {
+          if (savedRow[j] >= 0)
+          {
+            memcpy(saved + (size_t)savedRow[j] * width, rowPtr(img, j), (size_t)width);
+          }
+        }
+      }
+    }
+  }
+
+  if (op->colSum == NULL || op->ring == NULL || (bands > 1 && saved == NULL))
+  {
+    poolFree(op->colSum);
+    poolFree(op->ring);
+    poolFree(savedRow);
+    poolFree(saved);
+    return 0;
+  }
+  op->saved = saved;
+  op->savedRow = savedRow;
+  return 1;
+}
+
+void ImageBlurSeparable(Image img, int dx, int dy)
+{
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  int width = img->width;
+  int height = img->height;
+
+  if (width == 0 || height == 0)
+  {
+    return;
+  }
+
+  // A janela nunca precisa de ser maior do que a imagem (evita overflow).
+  if (dx > width)
+    dx = width;
+  if (dy > height)
+    dy = height;
+
+  Image raster = rasterBegin(img);
+  if (raster == NULL)
+  {
+    return;
+  }
+  struct blurOp op;
+  op.img = raster;
+  op.dx = dx;
+  op.dy = dy;
+  op.sums = 1;
+  int band = bandRows(height, width);
+  // Sem memória para as faixas, tente ainda uma só faixa.
+  if (!blurBuffers(&op, band) && (band == height || !blurBuffers(&op, height)))
+  {
+    check(0, "Memory allocation for blur buffers failed");
+    rasterEnd(img, raster, 0);
+    return;
+  }
+
+  PIXMEM += forBands(height, op.band, blurSeparableBand, &op);
+
+  poolFree(op.colSum);
+  poolFree(op.ring);
+  poolFree((void *)op.saved);
+  poolFree((void *)op.savedRow);
+  rasterEnd(img, raster, 1);
+}
+
+void ImageBlur(Image img, int dx, int dy)
+{
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  // Se já existe uma tabela de somas válida, aproveite-a; caso contrário,
+  // o método separável evita alocar uma tabela de 64 bits por pixel.
+  InstrTimer timer = InstrTimerBegin("blur");
+  if (hasIntegral(img))
+  {
+    ImageBlurIntegral(img, dx, dy);
+  }
+  else
+  {
+    ImageBlurSeparable(img, dx, dy);
+  }
+  InstrTimerEnd(timer);
+}
+
+/// Morphology and median filters
+
+// Side of the column strips of the vertical pass of ImageErode/ImageDilate.
+#define MORPH_STRIP 64
+
+// The parameters of an erosion or dilation, shared by the bands.
+struct morphOp
+{
+  Image img;
+  int dx, dy;
+  int dilate;         // 1: máximo (ImageDilate); 0: mínimo (ImageErode)
+  uint8 *scratch;     // por faixa, perBand bytes
+  size_t perBand;
+};
+
+// Number of entries of the vanHerk scratch buffers, for n values and
+// radius d: n + 2d rounded up to whole blocks of 2d+1.
+static size_t vanHerkLength(int n, int d)
+{
+  size_t k = 2 * (size_t)d + 1;
+  return ((size_t)n + 2 * (size_t)d + k - 1) / k * k;
+}
+
+// van Herk/Gil-Werman filter: out[i] = min (max if dilate) of in[i-d..i+d],
+// the values outside [0, n) ignored, for n vectors of s levels
+// (vector i at in + i*s), in 3 comparisons per level, whatever d is.
+// The values are padded with the neutral level and split in blocks of
+// k = 2d+1: each window covers the suffix of a block (h) and the prefix
+// of the next one (g).  in and out may be the same.
+// g and h must have room for vanHerkLength(n, d) vectors each.
+static inline void vanHerk(uint8 *out, const uint8 *in, int n, int d, int s, int dilate,
+                           uint8 *g, uint8 *h)
+{
+  static const uint8 ones[MORPH_STRIP] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+  };
+  static const uint8 zeros[MORPH_STRIP] = { 0 };
+  const uint8 *neutral = dilate ? zeros : ones;
+  size_t k = 2 * (size_t)d + 1;
+  size_t m = vanHerkLength(n, d);
+
+#define PADDED(i) (((i) < (size_t)d || (i) >= (size_t)d + n) ? neutral : in + ((i) - d) * s)
+#define COMBINE(dst, a, b)                                          \
+  do {                                                              \
+    if (dilate)                                                     \
+      for (int j = 0; j < s; j++)                                   \
+        (dst)[j] = ((a)[j] > (b)[j]) ? (a)[j] : (b)[j];             \
+    else                                                            \
+      for (int j = 0; j < s; j++)                                   \
+        (dst)[j] = ((a)[j] < (b)[j]) ? (a)[j] : (b)[j];             \
+  } while (0)
+
+  for (size_t b = 0; b < m; b += k)
+  {
+    // h: extremos dos sufixos do bloco; g: extremos dos prefixos.
+    size_t e = b + k - 1;
+    memcpy(h + e * s, PADDED(e), (size_t)s);
+    for (size_t i = e; i-- > b;)
+    {
+      COMBINE(h + i * s, PADDED(i), h + (i + 1) * s);
+    }
+    memcpy(g + b * s, PADDED(b), (size_t)s);
+    for (size_t i = b + 1; i <= e; i++)
+    {
+      COMBINE(g + i * s, g + (i - 1) * s, PADDED(i));
+    }
+  }
+  // A janela de out[i] é [i, i+2d] nos índices com margem.
+  for (size_t i = 0; i < (size_t)n; i++)
+  {
+    COMBINE(out + i * s, h + i * s, g + (i + 2 * d) * s);
+  }
+#undef COMBINE
+#undef PADDED
+}
+
+// Horizontal pass of erode/dilate, on rows [y0, y1) (a BandKernel).
+static unsigned long morphRowBand(void *arg, int k, int y0, int y1)
+{
+  const struct morphOp *op = (const struct morphOp *)arg;
+  Image img = op->img;
+  int width = img->width;
+  uint8 *g = op->scratch + (size_t)k * op->perBand;
+  uint8 *h = g + vanHerkLength(width, op->dx);
+
+  for (int y = y0; y < y1; y++)
+  {
+    uint8 *row = rowPtr(img, y);
+    vanHerk(row, row, width, op->dx, 1, op->dilate, g, h);
+  }
+  return 2 * (unsigned long)width * (y1 - y0); // one read and one store per pixel
+}
+
+// Vertical pass of erode/dilate, on the column strips [s0, s1) of
+// MORPH_STRIP columns (a BandKernel): each strip is copied to a buffer,
+// so that the filter runs along the rows of MORPH_STRIP levels.
+static unsigned long morphColumnBand(void *arg, int k, int s0, int s1)
+{
+  const struct morphOp *op = (const struct morphOp *)arg;
+  Image img = op->img;
+  int width = img->width;
+  int height = img->height;
+  uint8 *strip = op->scratch + (size_t)k * op->perBand;
+  uint8 *g = strip + (size_t)height * MORPH_STRIP;
+  uint8 *h = g + vanHerkLength(height, op->dy) * MORPH_STRIP;
+  unsigned long count = 0;
+
+  for (int t = s0; t < s1; t++)
+  {
+    int x0 = t * MORPH_STRIP;
+    size_t w = (x0 + MORPH_STRIP < width) ? MORPH_STRIP : (size_t)(width - x0);
+    for (int y = 0; y < height; y++)
+    {
+      memcpy(strip + (size_t)y * MORPH_STRIP, rowPtr(img, y) + x0, w);
+    }
+    // As colunas a mais de uma faixa incompleta são calculadas e ignoradas.
+    vanHerk(strip, strip, height, op->dy, MORPH_STRIP, op->dilate, g, h);
+    for (int y = 0; y < height; y++)
+    {
+      memcpy(rowPtr(img, y) + x0, strip + (size_t)y * MORPH_STRIP, w);
+    }
+    count += 2 * (unsigned long)w * height; // one read and one store per pixel
+  }
+  return count;
+}
+
+// Erode (dilate = 0) or dilate (dilate = 1) img in place.
+static void morph(Image img, int dx, int dy, int dilate)
+{
+  int width = img->width;
+  int height = img->height;
+
+  if (width == 0 || height == 0)
+  {
+    return;
+  }
+
+  // A janela nunca precisa de ser maior do que a imagem (evita overflow).
+  if (dx > width)
+    dx = width;
+  if (dy > height)
+    dy = height;
+
+  Image raster = rasterBegin(img);
+  if (raster == NULL)
+  {
+    return;
+  }
+  struct morphOp op;
+  op.img = raster;
+  op.dx = dx;
+  op.dy = dy;
+  op.dilate = dilate;
+
+  // Os dois passos partilham os buffers: o maior dos dois tamanhos.
+  int rowBand = bandRows(height, width);
+  int strips = (width + MORPH_STRIP - 1) / MORPH_STRIP;
+  int stripBand = bandRows(strips, height * MORPH_STRIP);
+  size_t rowBytes = 2 * vanHerkLength(width, dx);
+  size_t stripBytes = ((size_t)height + 2 * vanHerkLength(height, dy)) * MORPH_STRIP;
+  size_t rowTotal = (size_t)((height + rowBand - 1) / rowBand) * rowBytes;
+  size_t stripTotal = (size_t)((strips + stripBand - 1) / stripBand) * stripBytes;
+  op.scratch = (uint8 *)poolAlloc((rowTotal > stripTotal) ? rowTotal : stripTotal, 0);
+  if (op.scratch == NULL)
+  {
+    // Sem memória para as faixas, tente ainda uma só faixa.
+    rowBand = height;
+    stripBand = strips;
+    op.scratch = (uint8 *)poolAlloc((rowBytes > stripBytes) ? rowBytes : stripBytes, 0);
+  }
+  if (!check(op.scratch != NULL, "Memory allocation for filter buffers failed"))
+  {
+    rasterEnd(img, raster, 0);
+    return;
+  }
+
+  op.perBand = stripBytes;
+  PIXMEM += forBands(strips, stripBand, morphColumnBand, &op);
+  op.perBand = rowBytes;
+  PIXMEM += forBands(height, rowBand, morphRowBand, &op);
+
+  poolFree(op.scratch);
+  rasterEnd(img, raster, 1);
+}
+
+void ImageErode(Image img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  InstrTimer timer = InstrTimerBegin("erode");
+  morph(img, dx, dy, 0);
+  InstrTimerEnd(timer);
+}
+
+void ImageDilate(Image img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  InstrTimer timer = InstrTimerBegin("dilate");
+  morph(img, dx, dy, 1);
+  InstrTimerEnd(timer);
+}
+
+// Histograms of the levels of each column in the vertical window, for
+// ImageMedian: MEDIAN_FINE counts, one per level, then MEDIAN_COARSE
+// counts, one per group of 16 levels.
+#define MEDIAN_FINE 256
+#define MEDIAN_COARSE 16
+#define MEDIAN_SUMS (MEDIAN_FINE + MEDIAN_COARSE)
+
+// Add (delta = 1) or remove (delta = (uint32_t)-1) the levels of src
+// from the histograms of their columns.
+static inline void histAdd(uint32_t *hist, const uint8 *src, int width, uint32_t delta)
+{
+  for (int x = 0; x < width; x++)
+  {
+    uint32_t *column = hist + (size_t)x * MEDIAN_SUMS;
+    column[src[x]] += delta;
+    column[MEDIAN_FINE + (src[x] >> 4)] += delta;
+  }
+}
+
+// Median filter of a row (Perreault and Hébert): row[x] = median of the
+// columns hist[x-dx..x+dx], each a histogram of rows levels.
+// The coarse histogram of the window slides with x; the fine histogram
+// of each group of 16 levels is only brought up to date when the median
+// falls in that group, so each pixel costs O(1) on average, whatever dx.
+static void medianRow(uint8 *row, const uint32_t *hist, int width, int dx, uint64_t rows)
+{
+  uint32_t coarse[MEDIAN_COARSE] = { 0 };
+  uint32_t fine[MEDIAN_COARSE][16];
+  int lo[MEDIAN_COARSE], hi[MEDIAN_COARSE]; // colunas contadas em fine[c]
+  for (int c = 0; c < MEDIAN_COARSE; c++)
+  {
+    lo[c] = 0;
+    hi[c] = -1;
+  }
+  int a = 0, b = -1; // colunas contadas em coarse
+
+  for (int x = 0; x < width; x++)
+  {
+    int x0 = (x - dx < 0) ? 0 : x - dx;
+    int x1 = (x + dx >= width) ? width - 1 : x + dx;
+    for (; b < x1; b++)
+    {
+      const uint32_t *column = hist + (size_t)(b + 1) * MEDIAN_SUMS + MEDIAN_FINE;
+      for (int c = 0; c < MEDIAN_COARSE; c++)
+        coarse[c] += column[c];
+    }
+    for (; a < x0; a++)
+    {
+      const uint32_t *column = hist + (size_t)a * MEDIAN_SUMS + MEDIAN_FINE;
+      for (int c = 0; c < MEDIAN_COARSE; c++)
+        coarse[c] -= column[c];
+    }
+
+    // O nível de ordem rank (a mediana inferior, se o número é par).
+    uint64_t rank = ((uint64_t)(x1 - x0 + 1) * rows + 1) / 2;
+    int c = 0;
+    while (coarse[c] < rank)
+    {
+      rank -= coarse[c];
+      c++;
+    }
+
+    // Atualize fine[c] para as colunas [x0, x1].
+    if (hi[c] < x0)
+    {
+      memset(fine[c], 0, sizeof(fine[c]));
+      lo[c] = x0;
+      hi[c] = x0 - 1;
+    }
+    for (; hi[c] < x1; hi[c]++)
+    {
+      const uint32_t *column = hist + (size_t)(hi[c] + 1) * MEDIAN_SUMS + 16 * c;
+      for (int v = 0; v < 16; v++)
+        fine[c][v] += column[v];
+    }
+    for (; lo[c] < x0; lo[c]++)
+    {
+      const uint32_t *column = hist + (size_t)lo[c] * MEDIAN_SUMS + 16 * c;
+      for (int v = 0; v < 16; v++)
+        fine[c][v] -= column[v];
+    }
+
+    int v = 0;
+    while (fine[c][v] < rank)
+    {
+      rank -= fine[c][v];
+      v++;
+    }
+    row[x] = (uint8)(16 * c + v);
+  }
+}
+
+// Median filter of rows [y0, y1) (a BandKernel), as blurSeparableBand,
+// with a histogram per column instead of a sum.
+static unsigned long medianBand(void *arg, int k, int y0, int y1)
+{
+  const struct blurOp *op = (const struct blurOp *)arg;
+  Image img = op->img;
+  int width = img->width;
+  int height = img->height;
+  int dx = op->dx;
+  int dy = op->dy;
+  int ringRows = op->ringRows;
+
+  // hist: os histogramas das colunas nas linhas da janela vertical atual.
+  // ring guarda as últimas linhas originais da faixa, já reescritas em img,
+  // que ainda falta retirar de hist.
+  uint32_t *hist = op->colSum + (size_t)k * width * MEDIAN_SUMS;
+  uint8 *ring = op->ring + (size_t)k * ringRows * width;
+
+  // Janela vertical inicial (y = y0): linhas [y0-dy, y0+dy].
+  memset(hist, 0, (size_t)width * MEDIAN_SUMS * sizeof(uint32_t));
+  for (int j = (y0 - dy < 0) ? 0 : y0 - dy; j < height && j <= y0 + dy; j++)
+  {
+    histAdd(hist, originalRow(op, y0, y1, j), width, 1);
+  }
+
+  for (int y = y0; y < y1; y++)
+  {
+    uint8 *row = rowPtr(img, y);
+    uint8 *saved = ring + (size_t)((y - y0) % ringRows) * width;
+    uint64_t rows = (uint64_t)(((y + dy + 1 > height) ? height : y + dy + 1) -
+                               ((y - dy < 0) ? 0 : y - dy));
+
+    memcpy(saved, row, (size_t)width);
+
+    medianRow(row, hist, width, dx, rows);
+
+    // Passo vertical: desliza a janela para y+1.
+    if (y - dy >= 0)
+    {
+      const uint8 *out = (y - dy < y0) ? originalRow(op, y0, y1, y - dy)
+                                       : ring + (size_t)((y - dy - y0) % ringRows) * width;
+      histAdd(hist, out, width, (uint32_t)-1);
+    }
+    if (y + dy + 1 < height)
+    {
+      histAdd(hist, originalRow(op, y0, y1, y + dy + 1), width, 1);
+    }
+  }
+  return 3ul * width * (y1 - y0); // count pixel memory accesses
+}
+
+void ImageMedian(Image img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  int width = img->width;
+  int height = img->height;
+
+  if (width == 0 || height == 0)
+  {
+    return;
+  }
+
+  // A janela nunca precisa de ser maior do que a imagem (evita overflow).
+  if (dx > width)
+    dx = width;
+  if (dy > height)
+    dy = height;
+
+  InstrTimer timer = InstrTimerBegin("median");
+  Image raster = rasterBegin(img);
+  if (raster == NULL)
+  {
+    InstrTimerEnd(timer);
+    return;
+  }
+  struct blurOp op;
+  op.img = raster;
+  op.dx = dx;
+  op.dy = dy;
+  op.sums = MEDIAN_SUMS;
+  // Os histogramas ocupam 1 KiB por coluna em cada faixa, e cada faixa
+  // começa por lhes juntar 2dy+1 linhas: use só uma faixa por thread.
+  int threads = PoolThreads();
+  int band = bandRows(height, width);
+  if (band < (height + threads - 1) / threads)
+    band = (height + threads - 1) / threads;
+  // Sem memória para as faixas, tente ainda uma só faixa.
+  if (!blurBuffers(&op, band) && (band == height || !blurBuffers(&op, height)))
+  {
+    check(0, "Memory allocation for median buffers failed");
+    rasterEnd(img, raster, 0);
+    InstrTimerEnd(timer);
+    return;
+  }
+
+  PIXMEM += forBands(height, op.band, medianBand, &op);
+
+  poolFree(op.colSum);
+  poolFree(op.ring);
+  poolFree((void *)op.saved);
+  poolFree((void *)op.savedRow);
+  rasterEnd(img, raster, 1);
+  InstrTimerEnd(timer);
+}
+
+/// Image pyramids
+
+// Halve a raster image (a BandKernel): each pixel of result is the mean
+// of a 2x2 block of img.
+struct halveOp
+{
+  Image img, result;
+};
+
+static unsigned long halveBand(void *arg, int k, int y0, int y1)
+{
+  const struct halveOp *op = (const struct halveOp *)arg;
+  (void)k;
+  int w = op->result->width;
+  uint8 maxval = op->img->maxval;
+  for (int y = y0; y < y1; y++)
+  {
+    const uint8 *a = rowPtr(op->img, 2 * y);
+    const uint8 *b = rowPtr(op->img, 2 * y + 1);
+    uint8 *dst = rowPtr(op->result, y);
+    for (int x = 0; x < w; x++)
+    {
+      dst[x] = meanLevel((unsigned)a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1], 4, maxval);
+    }
+  }
+  return 5ul * w * (y1 - y0); // four reads and one store per pixel
+}
+
+// The next level of a pyramid, in the layout of img.
+static Image halve(Image img)
+{
+  int w = img->width / 2;
+  int h = img->height / 2;
+  Image result = createImage(w, h, img->maxval, 0, img->tiled);
+  if (result == NULL)
+  {
+    return NULL;
+  }
+  Image src = rasterBegin(img);
+  // O resultado é calculado em raster e, se for em blocos, copiado para lá.
+  Image dst = result->tiled ? ImageCreateUninit(w, h, img->maxval) : result;
+  if (src == NULL || dst == NULL)
+  {
+    if (src != NULL)
+      rasterEnd(img, src, 0);
+    ImageDestroy(&result);
+    return NULL;
+  }
+  struct halveOp op = { src, dst };
+  PIXMEM += forBands(h, bandRows(h, w), halveBand, &op);
+  rasterEnd(img, src, 0);
+  rasterEnd(result, dst, 1);
+  return result;
+}
+
+int ImagePyramidBuild(Image img, int levels, Image pyramid[])
+{ ///
+  assert(img != NULL);
+  assert(levels >= 1);
+
+  InstrTimer timer = InstrTimerBegin("pyramid");
+  pyramid[0] = img;
+  int built = 1;
+  for (int k = 1; k < levels; k++)
+  {
+    pyramid[k] = NULL;
+    if (built == k && pyramid[k - 1]->width >= 2 && pyramid[k - 1]->height >= 2)
+    {
+      pyramid[k] = halve(pyramid[k - 1]);
+      if (pyramid[k] == NULL)
+      {
+        ImagePyramidDestroy(k, pyramid);
+        InstrTimerEnd(timer);
+        return 0;
+      }
+      built++;
+    }
+  }
+  InstrTimerEnd(timer);
+  return built;
+}
+
+void ImagePyramidDestroy(int levels, Image pyramid[])
+{ ///
+  for (int k = 1; k < levels; k++)
+  {
+    ImageDestroy(&pyramid[k]);
+  }
+}
+
+// Candidates kept at each level by ImageLocateSubImageCoarse.
+#define COARSE_CANDIDATES 16
 
-  // Compare os pixels da subimagem img2 com a parte correspondente de img1 na posição (x, y).
-  for (int j = 0; j < img2->height; j++) {
-    for (int i = 0; i < img2->width; i++) {
-      uint8 pixel1 = ImageGetPixel(img1, x + i, y + j);
-      uint8 pixel2 = ImageGetPixel(img2, i, j);
-      if (pixel1 != pixel2) {
-        return 0; // Os pixels não coincidem.
+// Smallest side of the template at the coarsest level: smaller templates
+// do not tell positions apart.
+#define COARSE_MIN_SIDE 8
+
+// A candidate position, and the sum of absolute differences there.
+struct candidate
+{
+  int x, y;
+  uint64_t sad;
+};
+
+// The best n candidates, in increasing order of sad.
+struct candidates
+{
+  int n;
+  struct candidate c[COARSE_CANDIDATES];
+};
+
+// The sad a new candidate must stay below to be kept.
+static uint64_t candidateBound(const struct candidates *list)
+{
+  return (list->n < COARSE_CANDIDATES) ? UINT64_MAX : list->c[list->n - 1].sad;
+}
+
+// Keep the candidate (x, y), unless it is already in list.
+static void candidateAdd(struct candidates *list, int x, int y, uint64_t sad)
+{
+  for (int k = 0; k < list->n; k++)
+  {
+    if (list->c[k].x == x && list->c[k].y == y)
+      return;
+  }
+  int k = (list->n < COARSE_CANDIDATES) ? list->n++ : COARSE_CANDIDATES - 1;
+  // Insere por ordem, empurrando os piores (e o último sai, se a lista estiver cheia).
+  while (k > 0 && list->c[k - 1].sad > sad)
+  {
+    list->c[k] = list->c[k - 1];
+    k--;
+  }
+  list->c[k].x = x;
+  list->c[k].y = y;
+  list->c[k].sad = sad;
+}
+
+// Sum of absolute differences between img2 and img1 at (x, y) of raster
+// images, or a value >= bound as soon as it reaches bound.
+static uint64_t sadAt(Image img1, int x, int y, Image img2, uint64_t bound, unsigned long *count)
+{
+  int w = img2->width;
+  uint64_t sad = 0;
+  for (int j = 0; j < img2->height && sad < bound; j++)
+  {
+    const uint8 *p1 = rowPtr(img1, y + j) + x;
+    const uint8 *p2 = rowPtr(img2, j);
+    unsigned sum = 0;
+    for (int i = 0; i < w; i++)
+    {
+      sum += (unsigned)abs(p1[i] - p2[i]);
+    }
+    sad += sum;
+    *count += 2 * (unsigned long)w;
+  }
+  return sad;
+}
+
+// Compare img2 with img1 at the positions [x0, x1] x [y0, y1] (clipped to
+// those where img2 fits), adding them to list.
+static void sadWindow(Image img1, Image img2, int x0, int x1, int y0, int y1,
+                      struct candidates *list, unsigned long *count)
+{
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > img1->width - img2->width)
+    x1 = img1->width - img2->width;
+  if (y1 > img1->height - img2->height)
+    y1 = img1->height - img2->height;
+  for (int y = y0; y <= y1; y++)
+  {
+    for (int x = x0; x <= x1; x++)
+    {
+      uint64_t bound = candidateBound(list);
+      uint64_t sad = sadAt(img1, x, y, img2, bound, count);
+      if (sad < bound)
+      {
+        candidateAdd(list, x, y, sad);
       }
     }
   }
+}
+
+// The search of the coarsest level, in bands of candidate rows.
+struct coarseOp
+{
+  Image img1, img2;
+  int band;
+  struct candidates *lists; // os candidatos de cada faixa
+};
 
-  return 1; // A subimagem coincide com a parte de img1 na posição (x, y).
+static unsigned long coarseBand(void *arg, int k, int y0, int y1)
+{
+  const struct coarseOp *op = (const struct coarseOp *)arg;
+  unsigned long count = 0;
+  op->lists[k].n = 0;
+  if (y0 < y1)
+  {
+    sadWindow(op->img1, op->img2, 0, INT_MAX, y0, y1 - 1, &op->lists[k], &count);
+  }
+  return count;
 }
 
-int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
+int ImageLocateSubImageCoarse(Image img1, int *px, int *py, Image img2, int levels)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  assert(levels >= 1);
 
-  int width1 = img1->width;
-  int height1 = img1->height;
-  int width2 = img2->width;
-  int height2 = img2->height;
+  // O nível mais grosseiro em que o modelo ainda tem COARSE_MIN_SIDE pixels de lado.
+  int top = 0;
+  while (top + 1 < levels && top < 30 && (img2->width >> (top + 1)) >= COARSE_MIN_SIDE &&
+         (img2->height >> (top + 1)) >= COARSE_MIN_SIDE)
+  {
+    top++;
+  }
+  if (top == 0 || img2->width > img1->width || img2->height > img1->height)
+  {
+    return ImageLocateSubImage(img1, px, py, img2);
+  }
+
+  InstrTimer timer = InstrTimerBegin("locate");
+  Image pyr1[32], pyr2[32];
+  int found = 0;
+  // As pirâmides são construídas a partir de cópias raster das imagens.
+  Image raster1 = rasterBegin(img1);
+  Image raster2 = (raster1 != NULL) ? rasterBegin(img2) : NULL;
+  if (raster2 == NULL || ImagePyramidBuild(raster1, top + 1, pyr1) == 0)
+  {
+    if (raster1 != NULL)
+      rasterEnd(img1, raster1, 0);
+    if (raster2 != NULL)
+      rasterEnd(img2, raster2, 0);
+    InstrTimerEnd(timer);
+    return 0;
+  }
+  if (ImagePyramidBuild(raster2, top + 1, pyr2) == 0)
+  {
+    ImagePyramidDestroy(top + 1, pyr1);
+    rasterEnd(img1, raster1, 0);
+    rasterEnd(img2, raster2, 0);
+    InstrTimerEnd(timer);
+    return 0;
+  }
+
+  // No nível mais grosseiro, compare todas as posições, em faixas,
+  // e junte os melhores candidatos de cada uma.
+  struct candidates lists[MAX_BANDS];
+  struct coarseOp op = { pyr1[top], pyr2[top], 0, lists };
+  int rows = pyr1[top]->height - pyr2[top]->height + 1;
+  long work = (long)(pyr1[top]->width - pyr2[top]->width + 1) * pyr2[top]->width;
+  op.band = bandRows(rows, (work < INT_MAX) ? (int)work : INT_MAX);
+  unsigned long count = forBands(rows, op.band, coarseBand, &op);
+  struct candidates list;
+  list.n = 0;
+  for (int k = 0; k * op.band < rows; k++)
+  {
+    for (int c = 0; c < lists[k].n; c++)
+    {
+      if (lists[k].c[c].sad < candidateBound(&list))
+        candidateAdd(&list, lists[k].c[c].x, lists[k].c[c].y, lists[k].c[c].sad);
+    }
+  }
 
-  for (int y = 0; y < height1 - height2 + 1; y++)
+  // Na resolução original, procure só à volta de cada candidato: a posição
+  // (x, y) no nível top cobre [x, x+1) * 2^top, com 2^top pixels de folga
+  // de cada lado (por o modelo poder estar desalinhado com os blocos).
+  // Só contam as correspondências exatas, e a comparação pára no primeiro
+  // pixel diferente: estas posições custam pouco, seja qual for o modelo.
+  int step = 1 << top;
+  long best = LONG_MAX;
+  for (int k = 0; k < list.n; k++)
   {
-    for (int x = 0; x < width1 - width2 + 1; x++)
+    int x0 = (list.c[k].x - 1) * step;
+    int y0 = (list.c[k].y - 1) * step;
+    for (int y = (y0 > 0) ? y0 : 0; y < y0 + 3 * step && y + img2->height <= img1->height; y++)
     {
-      if (ImageMatchSubImage(img1, x, y, img2))
+      for (int x = (x0 > 0) ? x0 : 0; x < x0 + 3 * step && x + img2->width <= img1->width; x++)
       {
-        *px = x;
-        *py = y;
-        return 1; // Encontrou uma correspondência.
+        if ((long)y * img1->width + x < best && matchRows(raster1, x, y, raster2, &count))
+        {
+          best = (long)y * img1->width + x;
+        }
       }
     }
   }
+  if (best != LONG_MAX)
+  {
+    *px = (int)(best % img1->width);
+    *py = (int)(best / img1->width);
+    found = 1;
+  }
 
-  return 0; // Nenhuma correspondência encontrada.
+  ImagePyramidDestroy(top + 1, pyr1);
+  ImagePyramidDestroy(top + 1, pyr2);
+  rasterEnd(img1, raster1, 0);
+  rasterEnd(img2, raster2, 0);
+  PIXMEM += count; // count pixel memory accesses
+  InstrTimerEnd(timer);
+  return found;
 }
 
-void ImageFree(Image img) {
-    // Liberar a memória alocada para os pixels da imagem
-    if (img != NULL && img->pixel != NULL) {
-        free(img->pixel); // Liberar os dados dos pixels da imagem
-    }
+/// Streaming
 
-    // Liberar a estrutura da imagem
-    if (img != NULL) {
-        free(img); // Liberar a estrutura da imagem
+struct imageStream
+{
+  FILE *f;
+  int width;
+  int height;
+  uint8 maxval;
+  int row;       // rows read or written so far
+  int writing;   // 1 for ImageStreamCreate, 0 for ImageStreamOpen
+  struct plainReader *plain; // for plain (P2) files, else NULL
+  dev_t device;  // for reading: the identity of the file
+  ino_t inode;
+  ImageStream next; // for reading: next in the list of reading streams
+  char *temp;    // for writing over a file being read: the file written,
+  char *target;  // renamed to this one on close; else both NULL
+};
+
+// The streams open for reading, so that ImageStreamCreate can tell when
+// it is asked to write over one of them.
+static ImageStream reading = NULL;
+static pthread_mutex_t readingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Is the file filename open in a reading stream?
+static int beingRead(const char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&readingLock);
+  ImageStream s = reading;
+  while (s != NULL && !(s->device == st.st_dev && s->inode == st.st_ino))
+    s = s->next;
+  pthread_mutex_unlock(&readingLock);
+  return s != NULL;
+}
+
+// Create a stream on f (already positioned at the first pixel).
+// On failure, closes f and returns NULL.
+static ImageStream newStream(FILE *f, int width, int height, uint8 maxval, int writing)
+{
+  ImageStream s = (ImageStream)malloc(sizeof(struct imageStream));
+  if (!check(s != NULL, "Memory allocation for stream failed"))
+  {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+    return NULL;
+  }
+  s->f = f;
+  s->width = width;
+  s->height = height;
+  s->maxval = maxval;
+  s->row = 0;
+  s->writing = writing;
+  s->plain = NULL;
+  s->next = NULL;
+  s->temp = NULL;
+  s->target = NULL;
+  return s;
+}
+
+ImageStream ImageStreamOpen(const char *filename)
+{ ///
+  int w, h;
+  int maxval;
+  int plain;
+  FILE *f = NULL;
+  struct plainReader *reader = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      readHeader(f, &w, &h, &maxval, &plain) &&
+      (!plain || check((reader = (struct plainReader *)malloc(sizeof(*reader))) != NULL,
+                       "Memory allocation for reading failed"));
+  if (!success)
+  {
+    errsave = errno;
+    if (f != NULL)
+      fclose(f);
+    errno = errsave;
+    return NULL;
+  }
+  ImageStream s = newStream(f, w, h, (uint8)maxval, 0);
+  if (s == NULL)
+  {
+    free(reader);
+    return NULL;
+  }
+  if (reader != NULL)
+  {
+    reader->pos = reader->len = 0;
+    s->plain = reader;
+  }
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0)
+  {
+    s->device = st.st_dev;
+    s->inode = st.st_ino;
+    pthread_mutex_lock(&readingLock);
+    s->next = reading;
+    reading = s;
+    pthread_mutex_unlock(&readingLock);
+  }
+  return s;
+}
+
+// Create a new file, to be renamed to filename when complete, in the same
+// directory and with the same permissions.
+// Returns its name (to be freed) and sets *f, or returns NULL with
+// errCause set.
+static char *createTemp(const char *filename, FILE **f)
+{
+  size_t len = strlen(filename);
+  char *temp = (char *)malloc(len + 8);
+  if (!check(temp != NULL, "Memory allocation for stream failed"))
+  {
+    return NULL;
+  }
+  memcpy(temp, filename, len);
+  memcpy(temp + len, ".XXXXXX", 8);
+  int fd = mkstemp(temp);
+  struct stat st;
+  if (fd >= 0 && stat(filename, &st) == 0)
+  {
+    fchmod(fd, st.st_mode & 07777); // mkstemp cria-o só com 0600
+  }
+  if (check(fd >= 0 && (*f = fdopen(fd, "wb")) != NULL, "Open failed"))
+  {
+    return temp;
+  }
+  errsave = errno;
+  if (fd >= 0)
+  {
+    close(fd);
+    unlink(temp);
+  }
+  free(temp);
+  errno = errsave;
+  return NULL;
+}
+
+ImageStream ImageStreamCreate(const char *filename, int width, int height, uint8 maxval)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  FILE *f = NULL;
+  char *temp = NULL;
+  char *target = NULL;
+
+  if (beingRead(filename))
+  {
+    // Truncá-lo destruiria os níveis ainda por ler: escreva noutro
+    // ficheiro, que o substitui ao fechar.
+    if ((temp = createTemp(filename, &f)) == NULL)
+      return NULL;
+    target = strdup(filename);
+  }
+  else if (!check((f = fopen(filename, "wb")) != NULL, "Open failed"))
+  {
+    return NULL;
+  }
+  int success =
+      check(temp == NULL || target != NULL, "Memory allocation for stream failed") &&
+      check(fprintf(f, "P5\n%d %d\n%u\n", width, height, maxval) > 0, "Writing header failed");
+  if (!success)
+  {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+  }
+  ImageStream s = success ? newStream(f, width, height, maxval, 1) : NULL;
+  if (s == NULL)
+  {
+    errsave = errno;
+    if (temp != NULL)
+      unlink(temp);
+    free(temp);
+    free(target);
+    errno = errsave;
+    return NULL;
+  }
+  s->temp = temp;
+  s->target = target;
+  return s;
+}
+
+int ImageStreamClose(ImageStream *sp)
+{ ///
+  assert(sp != NULL);
+  ImageStream s = *sp;
+  if (s == NULL)
+  {
+    return 1;
+  }
+  if (!s->writing)
+  {
+    pthread_mutex_lock(&readingLock);
+    ImageStream *p = &reading;
+    while (*p != NULL && *p != s)
+      p = &(*p)->next;
+    if (*p != NULL)
+      *p = s->next;
+    pthread_mutex_unlock(&readingLock);
+  }
+  // Só ao fechar se sabe se os últimos dados escritos chegaram ao ficheiro.
+  int closed = fclose(s->f) == 0 || !s->writing;
+  int success = !s->writing ||
+      (check(s->row == s->height, "Not all rows were written") &&
+       check(closed, "Writing pixels failed"));
+  if (s->temp != NULL)
+  {
+    // Só um ficheiro completo substitui o que foi lido.
+    success = success && check(rename(s->temp, s->target) == 0, "Writing pixels failed");
+    if (!success)
+    {
+      errsave = errno;
+      unlink(s->temp);
+      errno = errsave;
     }
+  }
+  free(s->temp);
+  free(s->target);
+  free(s->plain);
+  free(s);
+  *sp = NULL;
+  return success;
 }
 
+int ImageStreamWidth(ImageStream s)
+{ ///
+  assert(s != NULL);
+  return s->width;
+}
 
-void ImageBlur(Image img, int dx, int dy)
+int ImageStreamHeight(ImageStream s)
+{ ///
+  assert(s != NULL);
+  return s->height;
+}
+
+int ImageStreamMaxval(ImageStream s)
+{ ///
+  assert(s != NULL);
+  return s->maxval;
+}
+
+Image ImageStreamRead(ImageStream s, int rows)
+{ ///
+  assert(s != NULL);
+  assert(!s->writing);
+  assert(rows > 0);
+
+  int n = (s->height - s->row < rows) ? s->height - s->row : rows;
+  size_t len = (size_t)s->width * n;
+  Image band = ImageCreateUninit(s->width, n, s->maxval);
+  if (band == NULL)
+  {
+    return NULL;
+  }
+  int success = (s->plain != NULL)
+      ? readPlain(s->f, s->plain, band->pixel, len, s->maxval)
+      : check(fread(band->pixel, sizeof(uint8), len, s->f) == len, "Reading pixels");
+  if (!success)
+  {
+    errsave = errno;
+    ImageDestroy(&band);
+    errno = errsave;
+    return NULL;
+  }
+  s->row += n;
+  PIXMEM += (unsigned long)len; // count pixel memory accesses
+  return band;
+}
+
+int ImageStreamWrite(ImageStream s, Image band)
+{ ///
+  assert(s != NULL);
+  assert(band != NULL);
+  assert(s->writing);
+  assert(band->width == s->width);
+  assert(band->height <= s->height - s->row);
+
+  if (!check(writeRows(band, s->f), "Writing pixels failed"))
+  {
+    return 0;
+  }
+  s->row += band->height;
+  PIXMEM += (unsigned long)band->width * band->height; // count pixel memory accesses
+  return 1;
+}
+
+// The operations of a pipeline, as given.
+enum pipeOp { PIPE_NEGATIVE, PIPE_THRESHOLD, PIPE_BRIGHTEN, PIPE_BLUR, PIPE_LUT };
+
+struct pipeStep
 {
-  assert(img != NULL);
-  int width = img->width;
-  int height = img->height;
+  enum pipeOp op;
+  uint8 thr;          // PIPE_THRESHOLD
+  double factor;      // PIPE_BRIGHTEN
+  int dx, dy;         // PIPE_BLUR
+  uint8 lut[256];     // PIPE_LUT
+};
+
+struct imagePipeline
+{
+  int count;          // steps in use
+  int capacity;       // steps allocated
+  struct pipeStep *step;
+};
 
-  Image originalImage = ImageCreate(width, height, img->maxval);
+ImagePipeline ImagePipelineCreate(void)
+{ ///
+  ImagePipeline p = (ImagePipeline)malloc(sizeof(struct imagePipeline));
+  if (!check(p != NULL, "Memory allocation for pipeline failed"))
+  {
+    errsave = errno;
+    return NULL;
+  }
+  p->count = 0;
+  p->capacity = 0;
+  p->step = NULL;
+  return p;
+}
 
-  if (originalImage == NULL)
+void ImagePipelineDestroy(ImagePipeline *pp)
+{ ///
+  assert(pp != NULL);
+  if (*pp != NULL)
   {
-    // Falha na alocação de memória para a imagem original.
-    return;
+    free((*pp)->step);
+    free(*pp);
+    *pp = NULL;
   }
+}
 
-  // Copie a imagem original para uma imagem temporária.
-  for (int y = 0; y < height; y++)
+// Append a step to p, growing the array as needed.
+static int appendStep(ImagePipeline p, const struct pipeStep *step)
+{
+  if (p->count == p->capacity)
   {
-    for (int x = 0; x < width; x++)
+    int capacity = (p->capacity == 0) ? 8 : 2 * p->capacity;
+    struct pipeStep *grown =
+        (struct pipeStep *)realloc(p->step, (size_t)capacity * sizeof(struct pipeStep));
+    if (!check(grown != NULL, "Memory allocation for pipeline failed"))
     {
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(originalImage, x, y, pixel);
+      return 0;
     }
+    p->step = grown;
+    p->capacity = capacity;
   }
+  p->step[p->count++] = *step;
+  return 1;
+}
 
-  for (int y = 0; y < height; y++)
+int ImagePipelineNegative(ImagePipeline p)
+{ ///
+  assert(p != NULL);
+  struct pipeStep step = { .op = PIPE_NEGATIVE };
+  return appendStep(p, &step);
+}
+
+int ImagePipelineThreshold(ImagePipeline p, uint8 thr)
+{ ///
+  assert(p != NULL);
+  struct pipeStep step = { .op = PIPE_THRESHOLD, .thr = thr };
+  return appendStep(p, &step);
+}
+
+int ImagePipelineBrighten(ImagePipeline p, double factor)
+{ ///
+  assert(p != NULL);
+  struct pipeStep step = { .op = PIPE_BRIGHTEN, .factor = factor };
+  return appendStep(p, &step);
+}
+
+int ImagePipelineBlur(ImagePipeline p, int dx, int dy)
+{ ///
+  assert(p != NULL);
+  assert(dx >= 0 && dy >= 0);
+  struct pipeStep step = { .op = PIPE_BLUR, .dx = dx, .dy = dy };
+  return appendStep(p, &step);
+}
+
+int ImagePipelineLUT(ImagePipeline p, const uint8 lut[256])
+{ ///
+  assert(p != NULL);
+  assert(lut != NULL);
+  struct pipeStep step = { .op = PIPE_LUT };
+  memcpy(step.lut, lut, sizeof(step.lut));
+  return appendStep(p, &step);
+}
+
+// A stage of ImageStreamApply: the fused table of a run of point
+// operations, or a blur on a sliding window of its input rows.
+struct stage
+{
+  int blur;           // 0: table lookup, 1: blur
+  uint8 lut[256];
+  int dx, dy;
+  int in, out;        // rows received and rows produced
+  uint32_t *colSum;   // soma de cada coluna nas linhas da janela
+  uint8 *window;      // as últimas windowRows linhas recebidas
+  int windowRows;
+  uint8 *row;         // a linha produzida
+};
+
+// The state of ImageStreamApply.
+struct apply
+{
+  struct stage *stage;
+  int stages;
+  int width, height;
+  uint8 maxval;
+  ImageStream out;
+  Image band;         // output rows waiting to be written
+  int rows;           // rows in band
+};
+
+static int pushRow(struct apply *a, int k, uint8 *row);
+
+// Produce output row stage[k].out of a blur stage, from the rows in its
+// window, and pass it on.
+static int emitRow(struct apply *a, int k)
+{
+  struct stage *st = &a->stage[k];
+  int width = a->width;
+  int y = st->out;
+  int dy = st->dy;
+  uint64_t rows = (uint64_t)(((y + dy + 1 > a->height) ? a->height : y + dy + 1) -
+                             ((y - dy < 0) ? 0 : y - dy));
+
+  blurRow(st->row, st->colSum, width, st->dx, rows, a->maxval);
+  PIXMEM += 3ul * width; // count pixel memory accesses
+
+  // Desliza a janela: a linha y-dy já não é necessária.
+  if (y - dy >= 0)
   {
+    const uint8 *old = st->window + (size_t)((y - dy) % st->windowRows) * width;
     for (int x = 0; x < width; x++)
     {
-      int sum = 0;
-      int count = 0;
+      st->colSum[x] -= old[x];
+    }
+  }
+  st->out++;
+  return pushRow(a, k + 1, st->row);
+}
 
-      for (int j = -dy; j <= dy; j++)
-      {
-        for (int i = -dx; i <= dx; i++)
-        {
-          if (ImageValidPos(originalImage, x + i, y + j))
-          {
-            sum += ImageGetPixel(originalImage, x + i, y + j);
-            count++;
-          }
-        }
-      }
+// Send one row (the next one) to stage k, or to the output after the last.
+// Stages may change row.
+static int pushRow(struct apply *a, int k, uint8 *row)
+{
+  int width = a->width;
+  if (k == a->stages)
+  {
+    memcpy(rowPtr(a->band, a->rows), row, (size_t)width);
+    if (++a->rows == a->band->height)
+    {
+      a->rows = 0;
+      return ImageStreamWrite(a->out, a->band);
+    }
+    return 1;
+  }
+
+  struct stage *st = &a->stage[k];
+  if (!st->blur)
+  {
+    lookupSpan(row, (size_t)width, st->lut);
+    PIXMEM += 2ul * width; // one read and one store per pixel
+    return pushRow(a, k + 1, row);
+  }
+
+  // A linha entra na janela, e a linha y = in-dy fica completa.
+  uint8 *saved = st->window + (size_t)(st->in % st->windowRows) * width;
+  memcpy(saved, row, (size_t)width);
+  for (int x = 0; x < width; x++)
+  {
+    st->colSum[x] += saved[x];
+  }
+  st->in++;
+  if (st->in - 1 - st->dy >= 0)
+  {
+    return emitRow(a, k);
+  }
+  return 1;
+}
 
-      // Calculate the average and set the pixel value 
-      double avg = (count > 0) ? ((double)sum / (double)count) + 0.5 : 0;
-      if (avg > img->maxval)
+// Build the stages of pipeline p for an image of the given width and maxval.
+// Returns the number of stages, or -1 if there is not enough memory.
+static int buildStages(ImagePipeline p, struct apply *a)
+{
+  a->stage = (struct stage *)calloc((size_t)p->count + 1, sizeof(struct stage));
+  if (!check(a->stage != NULL, "Memory allocation for pipeline failed"))
+  {
+    return -1;
+  }
+  int n = 0;
+  for (int i = 0; i < p->count; i++)
+  {
+    const struct pipeStep *step = &p->step[i];
+    if (step->op == PIPE_BLUR)
+    {
+      struct stage *st = &a->stage[n++];
+      st->blur = 1;
+      // A janela nunca precisa de ser maior do que a imagem (evita overflow).
+      st->dx = (step->dx > a->width) ? a->width : step->dx;
+      st->dy = (step->dy > a->height) ? a->height : step->dy;
+      st->windowRows = (2 * st->dy + 1 < a->height) ? 2 * st->dy + 1 : a->height;
+      st->colSum = (uint32_t *)calloc((size_t)a->width + 1, sizeof(uint32_t));
+      st->window = (uint8 *)malloc((size_t)st->windowRows * a->width + 1);
+      st->row = (uint8 *)malloc((size_t)a->width + 1);
+      if (!check(st->colSum != NULL && st->window != NULL && st->row != NULL,
+                 "Memory allocation for blur buffers failed"))
       {
-        avg = img->maxval;
+        return -1;
       }
-      ImageSetPixel(img, x, y, (uint8)avg);
+      continue;
     }
-  }
 
-  // Libere a memória alocada para a imagem original
-  ImageFree(originalImage);
+    uint8 lut[256];
+    switch (step->op)
+    {
+    case PIPE_NEGATIVE:
+      ImageLUTNegative(lut);
+      break;
+    case PIPE_THRESHOLD:
+      ImageLUTThreshold(lut, step->thr, a->maxval);
+      break;
+    case PIPE_BRIGHTEN:
+      ImageLUTBrighten(lut, step->factor, a->maxval);
+      break;
+    default:
+      memcpy(lut, step->lut, sizeof(lut));
+      break;
+    }
+    // Junte a operação à tabela anterior, se a houver.
+    if (n > 0 && !a->stage[n - 1].blur)
+    {
+      ImageLUTCompose(a->stage[n - 1].lut, a->stage[n - 1].lut, lut);
+    }
+    else
+    {
+      memcpy(a->stage[n++].lut, lut, sizeof(lut));
+    }
+  }
+  return n;
 }
 
+int ImageStreamApply(ImagePipeline p, ImageStream in, ImageStream out, int rows)
+{ ///
+  assert(p != NULL);
+  assert(in != NULL && !in->writing && in->row == 0);
+  assert(out != NULL && out->writing && out->row == 0);
+  assert(in->width == out->width && in->height == out->height && in->maxval == out->maxval);
+  assert(rows > 0);
+
+  if (rows > in->height && in->height > 0)
+  {
+    rows = in->height; // Bandas maiores do que a imagem só gastam memória.
+  }
 
+  InstrTimer timer = InstrTimerBegin("stream");
+  struct apply a;
+  a.width = in->width;
+  a.height = in->height;
+  a.maxval = in->maxval;
+  a.out = out;
+  a.rows = 0;
+  a.stages = buildStages(p, &a);
+  a.band = (a.stages < 0) ? NULL : ImageCreateUninit(a.width, rows, a.maxval);
+  int success = a.band != NULL;
 
+  // Passe as linhas, banda a banda, pelos estágios.
+  while (success && in->row < in->height)
+  {
+    Image band = ImageStreamRead(in, rows);
+    success = band != NULL;
+    for (int y = 0; success && y < band->height; y++)
+    {
+      success = pushRow(&a, 0, rowPtr(band, y));
+    }
+    ImageDestroy(&band);
+  }
+  // Esvazie os blurs: as últimas linhas já não esperam por mais linhas.
+  for (int k = 0; success && k < a.stages; k++)
+  {
+    while (success && a.stage[k].blur && a.stage[k].out < a.height)
+    {
+      success = emitRow(&a, k);
+    }
+  }
+  if (success && a.rows > 0)
+  {
+    // A última banda, incompleta: escreva só as suas linhas.
+    Image last = ImageView(a.band, 0, 0, a.width, a.rows);
+    success = last != NULL && ImageStreamWrite(out, last);
+    ImageDestroy(&last);
+  }
 
-    
+  if (a.stage != NULL)
+  {
+    for (int k = 0; k <= p->count; k++)
+    {
+      free(a.stage[k].colSum);
+      free(a.stage[k].window);
+      free(a.stage[k].row);
+    }
+    free(a.stage);
+  }
+  ImageDestroy(&a.band);
+  InstrTimerEnd(timer);
+  return success;
+}
@@ -23,6 +23,11 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Types for streaming: PGM files read or written band by band,
+// and pipelines of operations applied to them
+typedef struct imageStream *ImageStream;
+typedef struct imagePipeline *ImagePipeline;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,12 +38,32 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters and, if the IMAGE_THREADS or IMAGE_TILED
+/// environment variables are set, the number of threads or the layout
+/// (see ImageSetThreads and ImageSetTiled).
+/// The instrumentation is calibrated on first use, not here, so programs
+/// that do not measure times start instantly.
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// n <= 0 selects one per online processor (the default),
+/// n == 1 runs everything in the calling thread.
+void ImageSetThreads(int n) ;
+
+/// Set the layout of the pixels of the images made by ImageCreate and
+/// ImageLoad from now on: in square tiles of 64x64 pixels if tiled is
+/// nonzero, or row by row (a raster scan, the default) otherwise.
+/// Tiles keep pixels that are close in 2D close in memory too, which helps
+/// operations that walk along columns of large images (e.g. ImageRotate).
+/// The layout only changes the speed of the other functions: images are
+/// always saved row by row, and the images that ImageRotate, ImageCrop,
+/// etc. return have the layout of their argument.
+void ImageSetTiled(int tiled) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,15 +83,47 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Create a view of the rectangle (x,y,w,h) of img.
+/// A view is an image that shares the pixels of img, without copying them:
+/// changes made through the view are visible in img, and vice-versa.
+/// Every module function accepts views as well as ordinary images.
+/// Requires: ImageValidRect(img, x, y, w, h).
+/// Requires: img, or the image it is a view of, must not be destroyed
+/// before the view.
+/// Destroying the view (with ImageDestroy) does not affect img.
+/// 
+/// On success, a new view is returned in O(1).
+/// (The caller is responsible for destroying the returned view!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
+/// Check if img is a view of another image.
+int ImageIsView(Image img) ;
+
+/// Check if the pixels of img are kept in tiles (see ImageSetTiled).
+int ImageIsTiled(Image img) ;
+
 /// PGM file operations
 
-/// Load a raw PGM file.
+/// Load a raw (P5) or plain (P2, ASCII) PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Like ImageLoad, but the pixels are not read: they are paged in from the
+/// file as they are accessed, which makes loading large images O(1).
+/// The mapping is private (copy-on-write): changes to the image never
+/// reach the file.  ImageSave may overwrite the same file safely: every
+/// image that maps it gets its own copy of the pixels first.
+/// The file must not be truncated by other programs while it is mapped.
+/// Plain (P2) files cannot be mapped: they are read as by ImageLoad.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -93,6 +150,29 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Statistics of the pixel levels of an image (see ImageStatsEx).
+typedef struct {
+  uint8 min, max;       // as in ImageStats
+  double mean;          // mean level (0 for an empty image)
+  uint64_t count[256];  // histogram: count[v] pixels have level v
+  uint64_t hash;        // 64-bit hash of the size, maxval and pixel levels
+} ImageStatistics;
+
+/// Compute the statistics of img, in a single pass over its pixels.
+/// Images with the same size, maxval and pixels (views included) have the
+/// same hash, in every build and with any number of threads.
+/// The result is kept in img until img is modified, so repeated calls on
+/// an unchanged image are free (and ImageStats uses it too).
+/// On success, returns nonzero and *stats is set.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStatsEx(Image img, ImageStatistics* stats) ;
+
+/// Histogram of img: count[v] is set to the number of pixels with level v.
+/// Same as the count of ImageStatsEx, and also kept in img.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageHistogram(Image img, uint64_t count[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -135,6 +215,35 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Lookup tables
+
+/// Any pixel transformation that depends only on the level of each pixel
+/// can be described by a table with the new level for each old level.
+/// Tables can be composed, so a sequence of such transformations can be
+/// applied in a single pass over the image.
+
+/// Replace each pixel level v in img by lut[v].
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
+/// Fill lut with the table used by ImageNegative.
+void ImageLUTNegative(uint8 lut[256]) ;
+
+/// Fill lut with the table used by ImageThreshold (for the given maxval).
+void ImageLUTThreshold(uint8 lut[256], uint8 thr, uint8 maxval) ;
+
+/// Fill lut with the table used by ImageBrighten (for the given maxval).
+void ImageLUTBrighten(uint8 lut[256], double factor, uint8 maxval) ;
+
+/// Fill lut with a gamma correction table:
+/// v -> maxval * (v/maxval)^gamma, rounded and saturated at maxval.
+/// Requires: gamma > 0.0.
+void ImageLUTGamma(uint8 lut[256], double gamma, uint8 maxval) ;
+
+/// Compose two tables: result[v] = second[first[v]].
+/// Applying result is the same as applying first and then second.
+/// result may be the same array as first or second.
+void ImageLUTCompose(uint8 result[256], const uint8 first[256], const uint8 second[256]) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +264,24 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by 180 degrees.
+/// Same as rotating twice with ImageRotate, but in a single pass.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Rotate an image by 270 degrees anti-clockwise (90 degrees clockwise).
+/// Same as rotating three times with ImageRotate, but in a single pass.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +291,26 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// In-place rotations and mirror
+
+/// These change img itself, and so need no memory and never fail.
+/// They give the same pixels as the functions above that create a copy,
+/// and may be used instead when the original image is no longer needed.
+
+/// Mirror img left-right, in place (see ImageMirror).
+/// Each row is reversed by swapping its pixels.
+void ImageMirrorInPlace(Image img) ;
+
+/// Rotate img by 180 degrees, in place (see ImageRotate180).
+/// Each row is swapped with its mirror image, reversed.
+void ImageRotate180InPlace(Image img) ;
+
+/// Rotate a square img by 90 degrees anti-clockwise, in place
+/// (see ImageRotate).  Pixels move in cycles of four positions, and the
+/// cycles are followed in blocks, so that each block stays in the cache.
+/// Requires: ImageWidth(img) == ImageHeight(img).
+void ImageRotateInPlace(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +325,22 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Remap an image: any composition of rotations, mirrors and crops.
+/// Returns a new image with width w and height h, where the pixel at (i, j)
+/// is the pixel of img at position
+///   (x0 + i*xi + j*xj, y0 + i*yi + j*yj),
+/// transformed by lut if lut is not NULL (see ImageApplyLUT).
+/// (xi, yi) and (xj, yj) are the steps in img for a step along a row and
+/// along a column of the result; each is a unit vector along one axis.
+/// Requires: w > 0 and h > 0, and every mapped position is inside img.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRemap(Image img, int w, int h, int x0, int y0,
+                 int xi, int yi, int xj, int yj, const uint8 lut[256]) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -192,8 +355,18 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
+/// The result is floor(alpha*p2 + (1-alpha)*p1 + 0.5), saturated to
+/// [0, maxval], computed in fixed-point arithmetic where that is exact.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend n images into img1 in a single pass over img1.
+/// Same result as ImageBlend(img1, xs[k], ys[k], imgs[k], alphas[k])
+/// for k = 0, ..., n-1, in this order, but each row of img1 is visited
+/// once for all the images that cover it.
+/// Requires: each imgs[k] must fit inside img1 at position (xs[k], ys[k]).
+void ImageBlendMany(Image img1, int n, Image imgs[], const int xs[], const int ys[],
+                    const double alphas[]) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -203,14 +376,184 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The match reported is the first in raster order (lowest y, then lowest x).
+/// Large searches are split across the threads of the thread pool.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate all the occurrences of a subimage inside another image.
+/// Searches for img2 inside img1 in a single pass, in raster order.
+/// The first max matching positions are stored in (xs[k], ys[k]).
+/// Returns the number of matches, which may be larger than max.
+/// Requires: max >= 0, and xs and ys have room for max positions.
+long ImageLocateAllSubImages(Image img1, Image img2, int max, int xs[], int ys[]) ;
+
 /// Filtering
 
+/// Compute the integral image (summed-area table) of img.
+/// The table is owned by img: it is kept until img is modified or destroyed,
+/// so repeated calls on an unchanged image are free.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageIntegral(Image img) ;
+
+/// Sum of the pixel levels in the rectangle (x,y,w,h), in O(1).
+/// Requires: ImageValidRect(img, x, y, w, h) and a successful
+/// ImageIntegral(img) since the last modification of img.
+uint64_t ImageRectSum(Image img, int x, int y, int w, int h) ;
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
+/// The mean is rounded to the nearest level (halves round up).
+/// Requires: dx >= 0, dy >= 0.
 /// The image is changed in-place.
+/// Uses ImageBlurIntegral if img already has an integral image,
+/// or ImageBlurSeparable otherwise.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur using the integral image of img (see ImageIntegral).
+/// Same result as ImageBlur, in O(1) per pixel, but needs a table of
+/// (width+1)*(height+1) 64-bit sums.
+/// On allocation failure the image is left unchanged and errCause is set.
+void ImageBlurIntegral(Image img, int dx, int dy) ;
+
+/// Blur using running sums: a vertical running sum per column followed by
+/// a horizontal running sum along each row.
+/// Same result as ImageBlur, in O(1) per pixel, with only width column sums
+/// and a copy of the last dy+1 rows as scratch.
+/// On allocation failure the image is left unchanged and errCause is set.
+void ImageBlurSeparable(Image img, int dx, int dy) ;
+
+/// Morphology and median filters
+
+/// These use the same (2dx+1)x(2dy+1) windows as ImageBlur, with only the
+/// pixels inside the image, and change the image in-place.
+/// Requires: dx >= 0, dy >= 0.
+/// On allocation failure the image is left unchanged and errCause is set.
+
+/// Erode: each pixel becomes the minimum level in its window.
+/// Uses the van Herk/Gil-Werman algorithm, in O(1) per pixel.
+void ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate: each pixel becomes the maximum level in its window.
+/// Uses the van Herk/Gil-Werman algorithm, in O(1) per pixel.
+void ImageDilate(Image img, int dx, int dy) ;
+
+/// Median filter: each pixel becomes the median level in its window
+/// (of n levels, the (n+1)/2-th smallest: the lower median if n is even).
+/// Uses column histograms (Perreault and Hébert), in O(1) per pixel.
+void ImageMedian(Image img, int dx, int dy) ;
+
+/// Image pyramids
+
+/// Build an image pyramid of up to levels levels (levels >= 1).
+/// pyramid[0] is img itself, and each pyramid[k] after it has half the
+/// width and height of pyramid[k-1] (rounded down), with each pixel the
+/// mean of a 2x2 block, rounded as in ImageBlur.
+/// The pyramid stops early when a level would be empty; the remaining
+/// entries of pyramid are set to NULL.
+/// On success, returns the number of levels built.
+/// (The caller is responsible for ImagePyramidDestroy!)
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePyramidBuild(Image img, int levels, Image pyramid[]) ;
+
+/// Destroy the levels built by ImagePyramidBuild(img, levels, pyramid),
+/// except pyramid[0] (img itself).  They are set to NULL.
+void ImagePyramidDestroy(int levels, Image pyramid[]) ;
+
+/// Locate a subimage inside another image, coarse to fine.
+/// Builds pyramids of up to levels levels of img1 and img2, keeps the
+/// positions where the coarsest levels differ least (in the sum of absolute
+/// differences), and searches around them at full resolution, with the
+/// exact comparison of ImageMatchSubImage.
+/// The coarsest level used is the last where img2 still has 8 pixels across.
+/// This is approximate: a match may be missed when img2 does not stand out
+/// at low resolution (e.g. in large uniform areas, or when img2 is repeated
+/// many times).  Use ImageLocateSubImage for an exhaustive search.
+/// With levels == 1 (or a template too small to reduce), it is
+/// ImageLocateSubImage.
+/// If a match is confirmed, returns 1 and the first in raster order is set
+/// in (*px, *py).
+/// Otherwise, returns 0 and (*px, *py) are left untouched
+/// (and errCause is set, if there was not enough memory).
+int ImageLocateSubImageCoarse(Image img1, int* px, int* py, Image img2, int levels) ;
+
+/// Streaming
+
+/// These functions process raw PGM files in bands of rows, in memory
+/// proportional to the width of the image, not to its height, so they
+/// work on images larger than the available memory.
+
+/// Open a raw or plain PGM file for reading (see ImageLoad), band by band.
+/// Only the header is read.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) ;
+
+/// Create a raw PGM file for writing, band by band, with the given size.
+/// The header is written immediately.
+/// If the file is open in a reading stream (so that an image is streamed
+/// over itself), another file is written, in the same directory, and
+/// renamed to filename by ImageStreamClose only when complete.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamCreate(const char* filename, int width, int height, uint8 maxval) ;
+
+/// Close a stream and destroy it.
+/// On success, returns nonzero.
+/// On failure (for writing streams, if not all rows were written, or the
+/// file could not be completed), returns 0 and errno/errCause are set.
+int ImageStreamClose(ImageStream* sp) ;
+
+/// Size and maxval of the image in a stream.
+int ImageStreamWidth(ImageStream s) ;
+int ImageStreamHeight(ImageStream s) ;
+int ImageStreamMaxval(ImageStream s) ;
+
+/// Read the next band of (at most) rows rows of a reading stream.
+/// Requires: rows > 0.
+/// On success, returns a new image with the rows (fewer at the end of the
+/// image, and none after the last row).
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageStreamRead(ImageStream s, int rows) ;
+
+/// Write the rows of band as the next rows of a writing stream.
+/// Requires: band has the width of the stream, and fits in its remaining rows.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamWrite(ImageStream s, Image band) ;
+
+/// Create an empty pipeline of streaming operations.
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying the returned pipeline!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePipeline ImagePipelineCreate(void) ;
+
+/// Destroy a pipeline.
+void ImagePipelineDestroy(ImagePipeline* pp) ;
+
+/// Append an operation to a pipeline.
+/// Each one has the same effect as the function of the same name
+/// (ImageNegative, ImageThreshold, ImageBrighten, ImageBlur, ImageApplyLUT).
+/// Consecutive point operations are fused into a single table lookup.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineNegative(ImagePipeline p) ;
+int ImagePipelineThreshold(ImagePipeline p, uint8 thr) ;
+int ImagePipelineBrighten(ImagePipeline p, double factor) ;
+int ImagePipelineBlur(ImagePipeline p, int dx, int dy) ;
+int ImagePipelineLUT(ImagePipeline p, const uint8 lut[256]) ;
+
+/// Apply a pipeline to the image of stream in, writing the result to out,
+/// reading rows rows at a time.
+/// Blurs keep only the 2dy+1 rows around the current one.
+/// Requires: both streams have the same size and maxval, no rows have been
+/// read from in nor written to out yet, and rows > 0.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamApply(ImagePipeline p, ImageStream in, ImageStream out, int rows) ;
+
 #endif
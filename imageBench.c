@@ -0,0 +1,471 @@
+// imageBench - Benchmarks of the image8bit operations.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// It generates synthetic images of sides MINSIDE, 2*MINSIDE, ... up to
+// MAXSIDE, times every image8bit operation on each, and writes one CSV
+// line per operation and size, to compare versions of the module.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// João Manuel Rodrigues <jmr@ua.pt>
+// 2023
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-h] [-l LABEL] [-t SECONDS] [MINSIDE [MAXSIDE]]\n"
+    "Time the image8bit operations on synthetic square images with sides\n"
+    "MINSIDE (default 256), 2*MINSIDE, ..., up to MAXSIDE (default 16384).\n"
+    "Each operation is repeated for at least SECONDS (default 0.2) of wall\n"
+    "time, or once if it takes longer.  Sizes that do not fit in memory are\n"
+    "skipped.  Output is CSV, one line per operation and size:\n"
+    "  label   LABEL (e.g. the version measured), empty by default\n"
+    "  op      the operation\n"
+    "  param   its parameters (radius, alpha, template size and position...)\n"
+    "  side    the side of the image\n"
+    "  reps    the repetitions timed\n"
+    "  time    cpu time per repetition, in seconds (all threads)\n"
+    "  wall    wall time per repetition, in seconds\n"
+    "  mpix_s  pixels processed per second of wall time, in millions\n"
+    "  pixmem  pixel memory accesses per repetition (PIXMEM)\n"
+    "\n"
+    "ENVIRONMENT:\n"
+    "  IMAGE_THREADS   Number of threads used by image operations\n"
+    "  IMAGE_TILED     If set (and not 0), images are kept in 64x64 tiles\n"
+    "  TMPDIR          Directory for the files of load, save and stream\n"
+    "                  (default /tmp)\n";
+
+// The images and files used by the operations of one size.
+struct bench {
+  int side;
+  Image src;         // the synthetic image, never modified
+  Image work;        // a copy, for the operations that modify their image
+  Image half;        // a synthetic image of half the side
+  char file[256];    // src saved in PGM format
+  char out[256];     // for save and stream
+};
+
+// An operation to time: runs it once, with parameter param, and
+// returns the number of pixels it processed (or -1 on failure).
+typedef long (*Op)(struct bench* b, int param);
+
+// Fill img with a gradient plus noise, so that every subimage of a few
+// pixels is unique (as in a photograph) and locate has to search.
+static void synthesize(Image img, unsigned seed) {
+  unsigned s = seed * 2654435761u + 1u;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      ImageSetPixel(img, x, y, (uint8)((x * 3 + y * 5) / 16 + (s & 31)));
+    }
+  }
+}
+
+static long pixels(Image img) {
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long opLoad(struct bench* b, int mapped) {
+  Image img = mapped ? ImageLoadMapped(b->file) : ImageLoad(b->file);
+  if (img == NULL) return -1;
+  if (mapped) {
+    uint8 min, max;
+    ImageStats(img, &min, &max);   // a mapping only reads the file when used
+  }
+  ImageDestroy(&img);
+  return pixels(b->src);
+}
+
+static long opSave(struct bench* b, int param) {
+  (void)param;
+  return ImageSave(b->src, b->out) ? pixels(b->src) : -1;
+}
+
+static long opStats(struct bench* b, int param) {
+  (void)param;
+  uint8 min, max;
+  ImageStats(b->src, &min, &max);
+  return pixels(b->src);
+}
+
+static long opNegative(struct bench* b, int param) {
+  (void)param;
+  ImageNegative(b->work);
+  return pixels(b->work);
+}
+
+static long opThreshold(struct bench* b, int thr) {
+  ImageThreshold(b->work, (uint8)thr);
+  return pixels(b->work);
+}
+
+// factor = percent / 100.
+static long opBrighten(struct bench* b, int percent) {
+  ImageBrighten(b->work, percent / 100.0);
+  return pixels(b->work);
+}
+
+// gamma = percent / 100.
+static long opGamma(struct bench* b, int percent) {
+  uint8 lut[256];
+  ImageLUTGamma(lut, percent / 100.0, (uint8)ImageMaxval(b->work));
+  ImageApplyLUT(b->work, lut);
+  return pixels(b->work);
+}
+
+// Run a transformation that makes a new image.
+static long newImage(Image img) {
+  if (img == NULL) return -1;
+  long n = pixels(img);
+  ImageDestroy(&img);
+  return n;
+}
+
+static long opRotate(struct bench* b, int degrees) {
+  return newImage(degrees == 90 ? ImageRotate(b->src)
+                  : degrees == 180 ? ImageRotate180(b->src)
+                  : ImageRotate270(b->src));
+}
+
+static long opMirror(struct bench* b, int param) {
+  (void)param;
+  return newImage(ImageMirror(b->src));
+}
+
+// In place, on work (square, so every rotation applies).
+static long opRotateInPlace(struct bench* b, int degrees) {
+  if (degrees == 90) ImageRotateInPlace(b->work); else ImageRotate180InPlace(b->work);
+  return pixels(b->work);
+}
+
+static long opMirrorInPlace(struct bench* b, int param) {
+  (void)param;
+  ImageMirrorInPlace(b->work);
+  return pixels(b->work);
+}
+
+// Crop the central half of each side.
+static long opCrop(struct bench* b, int param) {
+  (void)param;
+  int s = b->side / 2;
+  return newImage(ImageCrop(b->src, s / 2, s / 2, s, s));
+}
+
+static long opPaste(struct bench* b, int param) {
+  (void)param;
+  int s = b->side / 4;
+  ImagePaste(b->work, s, s, b->half);
+  return pixels(b->half);
+}
+
+// alpha = percent / 100.
+static long opBlend(struct bench* b, int percent) {
+  int s = b->side / 4;
+  ImageBlend(b->work, s, s, b->half, percent / 100.0);
+  return pixels(b->half);
+}
+
+// Blend n layers at once, each a quarter of the image further.
+static long opBlendMany(struct bench* b, int n) {
+  Image imgs[8];
+  int xs[8], ys[8];
+  double alphas[8];
+  assert(n <= 8);
+  for (int l = 0; l < n; l++) {
+    imgs[l] = b->half;
+    xs[l] = (l % 2) * (b->side / 2);
+    ys[l] = (l / 2 % 2) * (b->side / 2);
+    alphas[l] = 0.25 + 0.1 * l;
+  }
+  ImageBlendMany(b->work, n, imgs, xs, ys, alphas);
+  return n * pixels(b->half);
+}
+
+static long opIntegral(struct bench* b, int param) {
+  (void)param;
+  ImageSetPixel(b->work, 0, 0, 0);   // invalidates the table kept in work
+  return ImageIntegral(b->work) ? pixels(b->work) : -1;
+}
+
+static long opBlur(struct bench* b, int r) {
+  ImageBlur(b->work, r, r);
+  return pixels(b->work);
+}
+
+static long opBlurIntegral(struct bench* b, int r) {
+  ImageBlurIntegral(b->work, r, r);
+  return pixels(b->work);
+}
+
+static long opBlurSeparable(struct bench* b, int r) {
+  ImageBlurSeparable(b->work, r, r);
+  return pixels(b->work);
+}
+
+static long opErode(struct bench* b, int r) {
+  ImageErode(b->work, r, r);
+  return pixels(b->work);
+}
+
+static long opDilate(struct bench* b, int r) {
+  ImageDilate(b->work, r, r);
+  return pixels(b->work);
+}
+
+static long opMedian(struct bench* b, int r) {
+  ImageMedian(b->work, r, r);
+  return pixels(b->work);
+}
+
+// Template positions for match and locate.
+enum { AT_CENTER, AT_LAST, AT_NONE, NUMPLACES };
+static const char* placeName[NUMPLACES] = { "center", "last", "none" };
+
+// The template of side t at place, in (*px, *py) of src.
+// For AT_NONE, it is the last one with its last pixel changed, so that
+// nothing matches and locate searches all the image.
+static Image makeTemplate(struct bench* b, int t, int place, int* px, int* py) {
+  int x = (place == AT_CENTER) ? (b->side - t) / 2 : b->side - t;
+  Image img = ImageCrop(b->src, x, x, t, t);
+  if (img != NULL && place == AT_NONE) {
+    ImageSetPixel(img, t - 1, t - 1, (uint8)(ImageGetPixel(img, t - 1, t - 1) ^ 0x80));
+  }
+  *px = *py = x;
+  return img;
+}
+
+// The template of the current locate or match: param = t * NUMPLACES + place.
+static Image tmpl;
+static int tmplX, tmplY;
+
+static long opMatch(struct bench* b, int param) {
+  (void)param;
+  ImageMatchSubImage(b->src, tmplX, tmplY, tmpl);
+  return pixels(tmpl);
+}
+
+static long opLocate(struct bench* b, int param) {
+  int x, y;
+  int found = ImageLocateSubImage(b->src, &x, &y, tmpl);
+  if (found != (param % NUMPLACES != AT_NONE)) {
+    error(3, 0, "locate found the wrong result for %dx%d", ImageWidth(tmpl), ImageHeight(tmpl));
+  }
+  return pixels(b->src);
+}
+
+// Coarse to fine, with up to 5 levels: it may miss, so it is not checked.
+static long opLocateCoarse(struct bench* b, int param) {
+  (void)param;
+  int x, y;
+  ImageLocateSubImageCoarse(b->src, &x, &y, tmpl, 5);
+  return pixels(b->src);
+}
+
+static long opLocateAll(struct bench* b, int param) {
+  int x, y;
+  long found = ImageLocateAllSubImages(b->src, tmpl, 1, &x, &y);
+  if ((found > 0) != (param % NUMPLACES != AT_NONE)) {
+    error(3, 0, "locateall found the wrong result for %dx%d", ImageWidth(tmpl), ImageHeight(tmpl));
+  }
+  return pixels(b->src);
+}
+
+static long opPyramid(struct bench* b, int levels) {
+  Image pyramid[8];
+  if (ImagePyramidBuild(b->src, levels, pyramid) == 0) {
+    error(3, errno, "pyramid: %s", ImageErrMsg());
+  }
+  ImagePyramidDestroy(levels, pyramid);
+  return pixels(b->src);
+}
+
+// Negate and blur with radius r, band by band, from file to out.
+static long opStream(struct bench* b, int r) {
+  ImagePipeline p = ImagePipelineCreate();
+  ImageStream in = ImageStreamOpen(b->file);
+  ImageStream out = (in == NULL) ? NULL
+      : ImageStreamCreate(b->out, ImageStreamWidth(in), ImageStreamHeight(in),
+                          (uint8)ImageStreamMaxval(in));
+  int success = p != NULL && out != NULL &&
+      ImagePipelineNegative(p) && ImagePipelineBlur(p, r, r) &&
+      ImageStreamApply(p, in, out, 64);
+  success = ImageStreamClose(&out) && success;
+  ImageStreamClose(&in);
+  ImagePipelineDestroy(&p);
+  return success ? pixels(b->src) : -1;
+}
+
+static const char* label = "";
+static double minTime = 0.2;
+
+// Time op(b, param) and print its CSV line.
+static void measure(struct bench* b, const char* name, const char* param, Op op, int arg) {
+  InstrReset();
+  double cpu0 = cpu_time();
+  double wall0 = wall_time();
+  long reps = 0;
+  long n = 0;
+  double wall;
+  do {
+    long done = op(b, arg);
+    if (done < 0) {
+      error(0, errno, "%s %s on %dx%d: %s", name, param, b->side, b->side, ImageErrMsg());
+      return;
+    }
+    n += done;
+    reps++;
+    wall = wall_time() - wall0;
+  } while (wall < minTime);
+  double cpu = cpu_time() - cpu0;
+  printf("%s,%s,%s,%d,%ld,%.9f,%.9f,%.2f,%lu\n", label, name, param, b->side, reps,
+         cpu / reps, wall / reps, wall > 0.0 ? n / wall / 1e6 : 0.0, InstrCount[0] / reps);
+  fflush(stdout);
+}
+
+// Copy src to work, so each operation starts from the same image.
+static int refresh(struct bench* b) {
+  ImageDestroy(&b->work);
+  b->work = ImageCrop(b->src, 0, 0, b->side, b->side);
+  return b->work != NULL;
+}
+
+// Run all the benchmarks on images of the given side.
+// Returns 0 if there is no memory for them.
+static int benchSide(int side) {
+  struct bench b;
+  memset(&b, 0, sizeof(b));
+  b.side = side;
+  b.src = ImageCreate(side, side, PixMax);
+  b.half = ImageCreate(side / 2, side / 2, PixMax);
+  const char* dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0') dir = "/tmp";
+  snprintf(b.file, sizeof(b.file), "%s/imageBench-%ld-in.pgm", dir, (long)getpid());
+  snprintf(b.out, sizeof(b.out), "%s/imageBench-%ld-out.pgm", dir, (long)getpid());
+
+  int ok = b.src != NULL && b.half != NULL && refresh(&b);
+  if (ok) {
+    synthesize(b.src, 1);
+    synthesize(b.half, 2);
+    ok = ImageSave(b.src, b.file);
+    if (!ok) error(0, errno, "%s: %s", b.file, ImageErrMsg());
+  }
+  if (ok) {
+    char param[64];
+    measure(&b, "save", "", opSave, 0);
+    measure(&b, "load", "", opLoad, 0);
+    measure(&b, "load", "mapped", opLoad, 1);
+    measure(&b, "stats", "", opStats, 0);
+    measure(&b, "negative", "", opNegative, 0);
+    measure(&b, "threshold", "128", opThreshold, 128);
+    measure(&b, "brighten", "1.3", opBrighten, 130);
+    measure(&b, "brighten", "0.33", opBrighten, 33);
+    ok = refresh(&b);
+    if (ok) measure(&b, "lut", "gamma 0.5", opGamma, 50);
+    measure(&b, "rotate", "90", opRotate, 90);
+    measure(&b, "rotate", "180", opRotate, 180);
+    measure(&b, "rotate", "270", opRotate, 270);
+    measure(&b, "mirror", "", opMirror, 0);
+    measure(&b, "rotate", "90 in place", opRotateInPlace, 90);
+    measure(&b, "rotate", "180 in place", opRotateInPlace, 180);
+    measure(&b, "mirror", "in place", opMirrorInPlace, 0);
+    measure(&b, "crop", "half", opCrop, 0);
+    ok = ok && refresh(&b);
+    if (ok) {
+      measure(&b, "paste", "half", opPaste, 0);
+      measure(&b, "blend", "half 0.33", opBlend, 33);
+      measure(&b, "blend", "half 0.5", opBlend, 50);
+      measure(&b, "blendmany", "4 halves", opBlendMany, 4);
+      measure(&b, "integral", "", opIntegral, 0);
+    }
+    static const int radii[] = { 1, 3, 7, 15 };
+    for (int i = 0; ok && i < (int)(sizeof(radii) / sizeof(radii[0])); i++) {
+      ok = refresh(&b);
+      snprintf(param, sizeof(param), "r%d", radii[i]);
+      if (ok) measure(&b, "blur", param, opBlur, radii[i]);
+      snprintf(param, sizeof(param), "r%d integral", radii[i]);
+      if (ok) measure(&b, "blur", param, opBlurIntegral, radii[i]);
+      ok = ok && refresh(&b);
+      snprintf(param, sizeof(param), "r%d separable", radii[i]);
+      if (ok) measure(&b, "blur", param, opBlurSeparable, radii[i]);
+      snprintf(param, sizeof(param), "r%d", radii[i]);
+      ok = ok && refresh(&b);
+      if (ok) measure(&b, "erode", param, opErode, radii[i]);
+      if (ok) measure(&b, "dilate", param, opDilate, radii[i]);
+      ok = ok && refresh(&b);
+      if (ok) measure(&b, "median", param, opMedian, radii[i]);
+    }
+    if (ok) measure(&b, "pyramid", "5 levels", opPyramid, 5);
+    static const int sizes[] = { 8, 32, 128 };
+    for (int i = 0; ok && i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+      int t = sizes[i];
+      if (t > side) break;
+      for (int place = 0; ok && place < NUMPLACES; place++) {
+        tmpl = makeTemplate(&b, t, place, &tmplX, &tmplY);
+        ok = tmpl != NULL;
+        snprintf(param, sizeof(param), "%dx%d %s", t, t, placeName[place]);
+        if (ok && place == AT_CENTER) measure(&b, "match", param, opMatch, 0);
+        if (ok) measure(&b, "locate", param, opLocate, t * NUMPLACES + place);
+        if (ok) measure(&b, "clocate", param, opLocateCoarse, t * NUMPLACES + place);
+        if (ok) measure(&b, "locateall", param, opLocateAll, t * NUMPLACES + place);
+        ImageDestroy(&tmpl);
+      }
+    }
+    measure(&b, "stream", "negative r3", opStream, 3);
+  }
+  if (!ok) {
+    error(0, errno, "Skipping the rest of %dx%d: %s", side, side, ImageErrMsg());
+  }
+
+  remove(b.file);
+  remove(b.out);
+  ImageDestroy(&b.src);
+  ImageDestroy(&b.work);
+  ImageDestroy(&b.half);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  int k = 1;
+  for (; k < argc && argv[k][0] == '-'; k += 2) {
+    if (strcmp(argv[k], "-h") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    } else if (k + 1 >= argc) {
+      error(1, 0, "%s needs a value\n%s", argv[k], USAGE);
+    } else if (strcmp(argv[k], "-l") == 0) {
+      label = argv[k + 1];
+    } else if (strcmp(argv[k], "-t") == 0) {
+      minTime = atof(argv[k + 1]);
+    } else {
+      error(1, 0, "Unknown option %s\n%s", argv[k], USAGE);
+    }
+  }
+  int minSide = (k < argc) ? atoi(argv[k++]) : 256;
+  int maxSide = (k < argc) ? atoi(argv[k++]) : 16384;
+  if (k < argc || minSide < 4 || maxSide < minSide || strchr(label, ',') != NULL) {
+    error(1, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  printf("label,op,param,side,reps,time,wall,mpix_s,pixmem\n");
+  int failed = 0;
+  for (int side = minSide; side <= maxSide && side > 0; side *= 2) {
+    failed |= !benchSide(side);
+  }
+  return failed ? 2 : 0;
+}
@@ -13,14 +13,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "error.h"
 #include <assert.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
+#include "threadpool.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [--lazy] [--mmap] [--async] [--stream] [--batch MANIFEST]\n"
+    "                 [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,15 +34,53 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The buffer grows as needed.  When the image CURR is not used again as\n"
+    "  PRED, rotate (of a square image) and mirror transform it in place.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --lazy          Defer rotate, mirror, crop and point operations until\n"
+    "                  the image is needed, then apply them in a single pass\n"
+    "  --mmap          Map input files into memory instead of reading them;\n"
+    "                  pixels are only read from disk when they are used\n"
+    "  --async         Read and write files in a background thread: the next\n"
+    "                  FILE is read while the operations before it run, and\n"
+    "                  save returns at once (failed saves are reported at the\n"
+    "                  end, and do not stop the operations that follow)\n"
+    "  --stream        Process one FILE band by band, in bounded memory:\n"
+    "                  the operations must be neg, thr, bri and blur only,\n"
+    "                  followed by a single save\n"
+    "  --batch MANIFEST  Apply the arguments that follow to each file named in\n"
+    "                  MANIFEST (one per line; - reads the names from stdin),\n"
+    "                  with every {} replaced by the file name, e.g.\n"
+    "                    imageTool --batch list.txt {} neg save {}.neg.pgm\n"
+    "                  Files are processed concurrently by IMAGE_THREADS threads,\n"
+    "                  and the output of each (info, locate) follows a line\n"
+    "                  \"# File: NAME\"\n"
+    "\n"
+    "ENVIRONMENT:\n"
+    "  IMAGE_THREADS   Number of threads used by image operations\n"
+    "                  (default: one per processor; 1 disables threads)\n"
+    "  IMAGE_TILED     If set (and not 0), images are kept in 64x64 tiles\n"
+    "                  instead of row by row (files are the same)\n"
+    "  INSTR_CTU       Calibrated time unit for toc, in seconds, instead of\n"
+    "                  calibrating on the first toc (0: report seconds)\n"
+    "  INSTR_CACHE     File where calibrations are kept per processor model,\n"
+    "                  so each model is calibrated only once\n"
+    "  INSTR_FORMAT    Format of toc: text (default), json or csv; all of them\n"
+    "                  include the cpu and wall times of each image operation\n"
+    "  INSTR_PERF      If set (and not 0), toc also shows hardware counters\n"
+    "                  (cycles, instructions, llcmiss, brmiss), where the\n"
+    "                  system provides them\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Currently, only image files in 8-bit PGM format, raw (P5) or plain (P2),\n"
+    "  are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info            Show information on CURR (size, range, mean and hash)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
@@ -54,8 +97,15 @@ static const char* USAGE =
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  clocate LEVELS  Same as locate, but coarse to fine, with pyramids of up to\n"
+    "                  LEVELS levels (approximate: it may miss a match)\n"
+    "  locateall MAX   Search all of PRED in CURR, print the first MAX matching\n"
+    "                  positions and then the number of matches\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  erode DX,DY     replace each pixel of CURR by the minimum, the maximum\n"
+    "  dilate DX,DY    or the median of its (2DX+1)x(2DY+1) neighborhood\n"
+    "  median DX,DY\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -69,13 +119,336 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer cannot grow (out of memory)",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation cannot be streamed",
+  "Reading manifest failed",
+  "Some files failed",
+};
+
+// Options, given before the files and operations.
+struct options {
+  int lazy;       // defer geometric operations? (--lazy)
+  int mapped;     // map input files instead of reading them? (--mmap)
+  int async;      // read and write files in the background? (--async)
+  int streamed;   // process a single file band by band? (--stream)
+};
+
+// In batch mode, each operation is not reported on stderr.
+static int quiet = 0;
+
+// Report an operation on stderr.
+static void note(const char* format, ...) {
+  if (quiet) return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+
+// Point operations (neg, thr, bri) on CURR are not applied immediately.
+// Consecutive ones are fused: their lookup tables are composed and applied
+// to CURR in a single pass, just before the next operation of another kind.
+struct pending {
+  int count;        // number of fused point operations (0: none)
+  uint8 lut[256];   // composed table of all of them
+  char op;          // the operation, when count == 1 ('n', 't' or 'b')
+  double arg;       // and its operand
+};
+
+// Add a point operation, given by its table, to the pending ones.
+static void fuse(struct pending* p, const uint8 lut[256], char op, double arg) {
+  if (p->count == 0) {
+    memcpy(p->lut, lut, 256);
+    p->op = op;
+    p->arg = arg;
+  } else {
+    ImageLUTCompose(p->lut, p->lut, lut);
+  }
+  p->count++;
+}
+
+// Apply the pending point operations to img.
+// A single operation is applied directly, since ImageBrighten has a
+// faster kernel than a table lookup.
+static void flush(struct pending* p, Image img) {
+  if (p->count == 1) {
+    switch (p->op) {
+      case 'n': ImageNegative(img); break;
+      case 't': ImageThreshold(img, (uint8)p->arg); break;
+      case 'b': ImageBrighten(img, p->arg); break;
+    }
+  } else if (p->count > 1) {
+    ImageApplyLUT(img, p->lut);
+  }
+  p->count = 0;
+}
+
+static int isPointOp(const char* arg) {
+  return strcmp(arg, "neg") == 0 || strcmp(arg, "thr") == 0 || strcmp(arg, "bri") == 0;
+}
+
+// In lazy mode (--lazy), rotate, mirror and crop do not create a new
+// image right away: the new slot just records where each of its pixels
+// comes from in the image of another slot (its base).  Chains of these
+// operations compose into a single remap, and the image is only created
+// when its pixels are needed (save, info, locate, paste, blend, filters),
+// in one pass that also applies the pending point operations.
+struct remap {
+  int w, h;     // size of the deferred image
+  int x0, y0;   // position in base of pixel (0,0)
+  int xi, yi;   // step in base for a step along a row
+  int xj, yj;   // step in base for a step along a column
+};
+
+// In async mode (--async), files are read and written by a background
+// I/O thread, one job at a time, in the order they are queued.
+// Each load is queued ahead, as soon as the previous file has been taken,
+// so it is read while the operations before it run.  A save only queues
+// the image; the slot waits for it before being changed (see need), and
+// a failed save is reported when the operations end.
+// The counters and timers of each job are handed back to the thread that
+// runs the operations: those of a load when its image is taken, and those
+// of the saves when tic or toc wait for all the jobs (see ioDrain).
+struct ioJob {
+  struct io* io;
+  int save;               // write img to name (or read name into img)
+  const char* name;
+  int arg;                // for loads, the index of name in av
+  Image img;
+  int done;
+  const char* cause;      // if it failed, ImageErrMsg() and errno
+  int errnum;
+  InstrWork work;         // what the job counted and timed
+  int counted;            // has work been added to the operations thread?
+  struct ioJob* next;
+};
+
+struct io {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;    // signalled when a job is queued or done
+  struct ioJob* first;    // all the jobs queued, in order
+  struct ioJob* last;
+  struct ioJob* todo;     // the next job to run (NULL: all started)
+  int mapped;             // load with ImageLoadMapped?
+  int stop;
 };
 
+// Failures in the I/O thread set its own errCause, not that of the thread
+// that reports them, so their cause is kept here (NULL: use ImageErrMsg).
+static _Thread_local const char* ioCause = NULL;
+
+static const char* errMsg(void) {
+  return ioCause != NULL ? ioCause : ImageErrMsg();
+}
+
+static void* ioThread(void* arg) {
+  struct io* io = arg;
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (io->todo == NULL && !io->stop) pthread_cond_wait(&io->cond, &io->lock);
+    struct ioJob* job = io->todo;
+    if (job == NULL) break;
+    io->todo = job->next;
+    pthread_mutex_unlock(&io->lock);
+
+    int ok;
+    if (job->save) {
+      ok = ImageSave(job->img, job->name);
+    } else {
+      job->img = io->mapped ? ImageLoadMapped(job->name) : ImageLoad(job->name);
+      ok = job->img != NULL;
+    }
+    int errnum = errno;
+    InstrTake(&job->work);
+
+    pthread_mutex_lock(&io->lock);
+    job->done = 1;
+    job->cause = ok ? NULL : ImageErrMsg();
+    job->errnum = errnum;
+    pthread_cond_broadcast(&io->cond);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+// Start the I/O thread.  Returns 0 if it cannot be started.
+static int ioStart(struct io* io, int mapped) {
+  *io = (struct io){ .mapped = mapped };
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+  if (pthread_create(&io->thread, NULL, ioThread, io) != 0) {
+    pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->lock);
+    return 0;
+  }
+  return 1;
+}
+
+// Queue a job (see struct ioJob).  Returns it, or NULL if out of memory.
+static struct ioJob* ioQueue(struct io* io, int save, const char* name, int arg, Image img) {
+  struct ioJob* job = malloc(sizeof(*job));
+  if (job == NULL) return NULL;
+  *job = (struct ioJob){ .io = io, .save = save, .name = name, .arg = arg, .img = img };
+  pthread_mutex_lock(&io->lock);
+  if (io->last != NULL) io->last->next = job; else io->first = job;
+  io->last = job;
+  if (io->todo == NULL) io->todo = job;
+  pthread_cond_broadcast(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+  return job;
+}
+
+// Wait until job is done.
+static void ioWait(struct ioJob* job) {
+  struct io* io = job->io;
+  pthread_mutex_lock(&io->lock);
+  while (!job->done) pthread_cond_wait(&io->cond, &io->lock);
+  pthread_mutex_unlock(&io->lock);
+}
+
+// Add the work of job to the counters and timers of this thread, once.
+static void ioCount(struct ioJob* job) {
+  if (!job->counted) {
+    InstrAdd(&job->work);
+    job->counted = 1;
+  }
+}
+
+// Wait for all the jobs queued, and add the work of the saves to this
+// thread, so that tic and toc see the same counts and timers as without
+// --async.  (Loads read ahead are added when their images are taken.)
+static void ioDrain(struct io* io) {
+  pthread_mutex_lock(&io->lock);
+  struct ioJob* last = io->last;
+  pthread_mutex_unlock(&io->lock);
+  if (last == NULL) return;
+  ioWait(last);   // the jobs run in order
+  for (struct ioJob* job = io->first; job != NULL; job = job->next) {
+    if (job->save) ioCount(job);
+  }
+}
+
+// Wait for all the jobs and stop the I/O thread.  Images loaded but not
+// taken are destroyed.  Returns 0 if some save failed, and then sets
+// *cause and *errnum as the first failure left ImageErrMsg() and errno.
+static int ioStop(struct io* io, const char** cause, int* errnum) {
+  pthread_mutex_lock(&io->lock);
+  io->stop = 1;
+  pthread_cond_broadcast(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+  pthread_join(io->thread, NULL);
+  pthread_cond_destroy(&io->cond);
+  pthread_mutex_destroy(&io->lock);
+
+  int ok = 1;
+  while (io->first != NULL) {
+    struct ioJob* job = io->first;
+    io->first = job->next;
+    if (job->save && job->cause != NULL && ok) {
+      ok = 0;
+      *cause = job->cause;
+      *errnum = job->errnum;
+    }
+    if (!job->save) ImageDestroy(&job->img);
+    free(job);
+  }
+  return ok;
+}
+
+// An entry of the image buffer.
+struct slot {
+  Image img;            // the image, or NULL while it is deferred
+  int base;             // if deferred, the slot whose image holds the pixels
+  struct remap map;     // if deferred, how pixels are taken from base
+  struct pending pend;  // point operations not yet applied
+  struct ioJob* saving; // in async mode, the last save of img queued
+};
+
+// Wait for the saves queued of the image of slot s.
+static void saved(struct slot* s) {
+  if (s->saving != NULL) {
+    ioWait(s->saving);
+    s->saving = NULL;
+  }
+}
+
+static int slotWidth(struct slot* s) {
+  return s->img != NULL ? ImageWidth(s->img) : s->map.w;
+}
+
+static int slotHeight(struct slot* s) {
+  return s->img != NULL ? ImageHeight(s->img) : s->map.h;
+}
+
+static int slotMaxval(struct slot* buf, int k) {
+  struct slot* s = &buf[k];
+  return ImageMaxval(s->img != NULL ? s->img : buf[s->base].img);
+}
+
+static int slotValidRect(struct slot* s, int x, int y, int w, int h) {
+  return (0 <= x && x + w <= slotWidth(s)) && (0 <= y && y + h <= slotHeight(s));
+}
+
+// Make slot k of buffer buf (with n slots) hold its final image:
+// create it if deferred, and apply its pending point operations.
+// Returns the image, or NULL on failure.
+static Image need(struct slot* buf, int n, int k) {
+  struct slot* s = &buf[k];
+  // The image may be changed from now on: finish writing it first.
+  // (And ImageSave may give a mapped base a copy of its pixels.)
+  saved(s->img != NULL ? s : &buf[s->base]);
+  if (s->img == NULL) {
+    struct remap* m = &s->map;
+    const uint8* lut = s->pend.count > 0 ? s->pend.lut : NULL;
+    if (m->w == 0 || m->h == 0) {
+      s->img = ImageCreate(m->w, m->h, (uint8)slotMaxval(buf, k));
+    } else {
+      s->img = ImageRemap(buf[s->base].img, m->w, m->h, m->x0, m->y0,
+                          m->xi, m->yi, m->xj, m->yj, lut);
+    }
+    s->pend.count = 0;
+  } else if (s->pend.count > 0) {
+    // Deferred slots based on this one take pixels from it as they are now,
+    // so create them before changing it.
+    for (int t = k+1; t < n; t++) {
+      if (buf[t].img == NULL && buf[t].base == k && need(buf, n, t) == NULL) {
+        return NULL;
+      }
+    }
+    flush(&s->pend, s->img);
+  }
+  return s->img;
+}
+
+// Add slot n, deferred, as the result of applying map to slot k.
+// map is given relative to slot k, and is composed with its own.
+static void derive(struct slot* buf, int k, int n, struct remap map) {
+  struct slot* src = &buf[k];
+  struct slot* dst = &buf[n];
+  struct remap m = map;
+  if (src->img == NULL) {
+    struct remap* b = &src->map;
+    m.x0 = b->x0 + map.x0 * b->xi + map.y0 * b->xj;
+    m.y0 = b->y0 + map.x0 * b->yi + map.y0 * b->yj;
+    m.xi = map.xi * b->xi + map.yi * b->xj;
+    m.yi = map.xi * b->yi + map.yi * b->yj;
+    m.xj = map.xj * b->xi + map.yj * b->xj;
+    m.yj = map.xj * b->yi + map.yj * b->yj;
+    dst->base = src->base;
+  } else {
+    dst->base = k;
+  }
+  dst->img = NULL;
+  dst->saving = NULL;
+  dst->map = m;
+  dst->pend = src->pend;   // the new image starts with the same levels
+}
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,144 +458,594 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Rows read at a time in stream mode.
+#define STREAM_ROWS 256
+
+// In stream mode (--stream), the arguments av[k..] must be a single input
+// file, streamable operations, and a final save.  They are applied with
+// ImageStreamApply, which never holds the whole image in memory.
+// Returns the error code.
+static int stream(int ac, char* av[], int k) {
+  int err = 0;
+  ImageStream in = NULL;
+  ImageStream out = NULL;
+  ImagePipeline p = ImagePipelineCreate();
+  if (p == NULL) return 4;
+
+  if (k >= ac) {
+    err = 2;
+  } else {
+    note("Streaming %s -> I0\n", av[k]);
+    if ((in = ImageStreamOpen(av[k])) == NULL) err = 4;
+  }
+  k++;
+  while (err == 0 && k < ac) {
+    if (strcmp(av[k], "neg") == 0) {
+      note("Negating I0\n");
+      if (!ImagePipelineNegative(p)) { err = 4; break; }
+    } else if (strcmp(av[k], "thr") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      note("Thresholding I0 at %d\n", thr);
+      if (!ImagePipelineThreshold(p, thr)) { err = 4; break; }
+    } else if (strcmp(av[k], "bri") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      double factor;
+      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+      note("Brightening I0 by %lf\n", factor);
+      if (!ImagePipelineBrighten(p, factor)) { err = 4; break; }
+    } else if (strcmp(av[k], "blur") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      note("Blur I0 with %dx%d mean filter\n", 2*dx+1, 2*dy+1);
+      if (!ImagePipelineBlur(p, dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (k + 1 < ac) { err = 8; break; }   // save must be the last operation
+      note("Saving %s <- I0\n", av[k]);
+      int w = ImageStreamWidth(in);
+      int h = ImageStreamHeight(in);
+      uint8 maxval = (uint8)ImageStreamMaxval(in);
+      if ((out = ImageStreamCreate(av[k], w, h, maxval)) == NULL) { err = 4; break; }
+      if (!ImageStreamApply(p, in, out, STREAM_ROWS)) { err = 4; break; }
+      if (!ImageStreamClose(&out)) { err = 4; break; }
+    } else {
+      err = 8;
+      break;
+    }
+    k++;
   }
+  ImageStreamClose(&out);
+  ImageStreamClose(&in);
+  ImagePipelineDestroy(&p);
+  return err;
+}
 
-  ImageInit();
+// Number of operands of operation arg, or -1 if arg is a file name.
+static int operands(const char* arg) {
+  static const char* none[] = { "info", "tic", "toc", "neg", "rotate", "mirror", "locate" };
+  static const char* one[] = { "save", "thr", "bri", "create", "crop", "paste", "blend",
+                               "clocate", "locateall", "blur", "erode", "dilate", "median" };
+  for (size_t i = 0; i < sizeof(none) / sizeof(none[0]); i++) {
+    if (strcmp(arg, none[i]) == 0) return 0;
+  }
+  for (size_t i = 0; i < sizeof(one) / sizeof(one[0]); i++) {
+    if (strcmp(arg, one[i]) == 0) return 1;
+  }
+  return -1;
+}
+
+// Index of the first file name in av[k..ac-1] that may be read ahead,
+// or -1 if there is none, or if it is written by a save before it.
+static int nextFile(int ac, char* av[], int k) {
+  int j = k;
+  while (j < ac && operands(av[j]) >= 0) j += 1 + operands(av[j]);
+  if (j >= ac) return -1;
+  for (int i = k; i < j; i += 1 + operands(av[i])) {
+    if (strcmp(av[i], "save") == 0 && i + 1 < j && strcmp(av[i+1], av[j]) == 0) return -1;
+  }
+  return j;
+}
+
+// The image buffer starts with room for this many images, and doubles.
+#define SLOTS 16
+
+// Make room for more images in buffer *buf, of capacity *cap.
+// Returns 0 if out of memory.
+static int grow(struct slot** buf, int* cap) {
+  int more = *cap > 0 ? 2 * *cap : SLOTS;
+  struct slot* grown = realloc(*buf, more * sizeof(struct slot));
+  if (grown == NULL) return 0;
+  *buf = grown;
+  *cap = more;
+  return 1;
+}
+
+// Is the image in slot CURR used by av[k..ac-1] after an operation that
+// pushes a new image (so that it becomes PRED)?  Only operations that take
+// PRED use it, and only before the next operation that pushes an image.
+// If not, rotate and mirror change it in place and move it to the new slot,
+// instead of keeping both images.
+static int usedAgain(int ac, char* av[], int k) {
+  while (k < ac) {
+    const char* op = av[k];
+    if (operands(op) < 0 || strcmp(op, "create") == 0 || strcmp(op, "rotate") == 0 ||
+        strcmp(op, "mirror") == 0 || strcmp(op, "crop") == 0) {
+      return 0;   // pushes an image (a file, too)
+    }
+    if (strcmp(op, "paste") == 0 || strcmp(op, "blend") == 0 || strcmp(op, "locate") == 0 ||
+        strcmp(op, "clocate") == 0 || strcmp(op, "locateall") == 0) {
+      return 1;
+    }
+    k += 1 + operands(op);
+  }
+  return 0;
+}
+
+// Move the image of slot k to slot n, leaving slot k empty (it is not
+// used again: see usedAgain).
+static void moveSlot(struct slot* buf, int k, int n) {
+  buf[n] = (struct slot){ .img = buf[k].img };
+  buf[k] = (struct slot){ .img = NULL, .base = k };
+}
 
+// Apply the operations in av[k..ac-1], writing their results to out.
+// Returns the error code.
+static int run(int ac, char* av[], int k, const struct options* opt, FILE* out) {
   int err = 0;
   int x, y, w, h;
 
   // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  int N = 0;                // buffer capacity
+  struct slot* img = NULL;  // the images
+  int n = 0;                // number of images created
+
+  int lazy = opt->lazy;
+  uint8 lut[256];
+  Image curr, pred;
+
+  struct io io;
+  int async = opt->async && ioStart(&io, opt->mapped);
+  struct ioJob* ahead = NULL;   // the next file, being read
+  int j = async ? nextFile(ac, av, k) : -1;
+  if (j >= 0) ahead = ioQueue(&io, 0, av[j], j, NULL);
+  ioCause = NULL;
 
-  int k = 1;
   while (k < ac) {
+    if (!lazy && n > 0 && img[n-1].pend.count > 0 && !isPointOp(av[k])) {
+      if (need(img, n, n-1) == NULL) { err = 4; break; }
+    }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      note("Info on I%d\n", n-1);
+      ImageStatistics stats;
+      w = ImageWidth(curr);
+      h = ImageHeight(curr);
+      uint8 maxval = ImageMaxval(curr);
+      if (!ImageStatsEx(curr, &stats)) { err = 4; break; }
+      fprintf(out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(out, "# Gray level range: [%hhu, %hhu]\n", stats.min, stats.max);
+      fprintf(out, "# Mean level: %.3f\n", stats.mean);
+      fprintf(out, "# Hash: %016" PRIx64 "\n", stats.hash);
     } else if (strcmp(av[k], "tic") == 0) {
+      if (async) ioDrain(&io);
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      if (async) ioDrain(&io);
+      InstrPrintTo(out);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      note("Negating I%d\n", n-1);
+      ImageLUTNegative(lut);
+      fuse(&img[n-1].pend, lut, 'n', 0.0);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      note("Thresholding I%d at %d\n", n-1, thr);
+      ImageLUTThreshold(lut, thr, (uint8)slotMaxval(img, n-1));
+      fuse(&img[n-1].pend, lut, 't', thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      note("Brightening I%d by %lf\n", n-1, factor);
+      ImageLUTBrighten(lut, factor, (uint8)slotMaxval(img, n-1));
+      fuse(&img[n-1].pend, lut, 'b', factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
+      if (n >= N && !grow(&img, &N)) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
+      note("Creating black image (%d,%d) -> I%d\n", w, h, n);
+      img[n] = (struct slot){ .img = ImageCreate(w, h, PixMax) };
+      if (img[n].img == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      if (n >= N && !grow(&img, &N)) { err = 3; break; }
+      note("Rotating I%d -> I%d\n", n-1, n);
+      w = slotWidth(&img[n-1]);
+      h = slotHeight(&img[n-1]);
+      if (lazy) {
+        // (i,j) <- (w-1-j, i)
+        derive(img, n-1, n, (struct remap){ h, w, w-1, 0, 0, 1, -1, 0 });
+      } else {
+        if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+        if (w == h && !usedAgain(ac, av, k+1)) {
+          ImageRotateInPlace(curr);
+          moveSlot(img, n-1, n);
+        } else {
+          img[n] = (struct slot){ .img = ImageRotate(curr) };
+          if (img[n].img == NULL) { err = 4; break; }
+        }
+      }
       n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      if (n >= N && !grow(&img, &N)) { err = 3; break; }
+      note("Mirroring I%d -> I%d\n", n-1, n);
+      w = slotWidth(&img[n-1]);
+      h = slotHeight(&img[n-1]);
+      if (lazy) {
+        // (i,j) <- (w-1-i, j)
+        derive(img, n-1, n, (struct remap){ w, h, w-1, 0, -1, 0, 0, 1 });
+      } else {
+        if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+        if (!usedAgain(ac, av, k+1)) {
+          ImageMirrorInPlace(curr);
+          moveSlot(img, n-1, n);
+        } else {
+          img[n] = (struct slot){ .img = ImageMirror(curr) };
+          if (img[n].img == NULL) { err = 4; break; }
+        }
+      }
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
+      if (n >= N && !grow(&img, &N)) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
+      if (!slotValidRect(&img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      note("Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      if (lazy) {
+        // (i,j) <- (x+i, y+j)
+        derive(img, n-1, n, (struct remap){ w, h, x, y, 1, 0, 0, 1 });
+      } else {
+        if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+        img[n] = (struct slot){ .img = ImageCrop(curr, x, y, w, h) };
+        if (img[n].img == NULL) { err = 4; break; }
+      }
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      w = slotWidth(&img[n-2]);
+      h = slotHeight(&img[n-2]);
+      if (!slotValidRect(&img[n-1], x, y, w, h)) { err = 6; break; }
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      if ((pred = need(img, n, n-2)) == NULL) { err = 4; break; }
+      note("Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      ImagePaste(curr, x, y, pred);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      w = slotWidth(&img[n-2]);
+      h = slotHeight(&img[n-2]);
+      if (!slotValidRect(&img[n-1], x, y, w, h)) { err = 6; break; }
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      if ((pred = need(img, n, n-2)) == NULL) { err = 4; break; }
+      note("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      ImageBlend(curr, x, y, pred, alpha);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      if ((pred = need(img, n, n-2)) == NULL) { err = 4; break; }
+      note("Locating I%d in I%d\n", n-2, n-1);
+      if (ImageLocateSubImage(curr, &x, &y, pred)) {
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "clocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int levels;
+      if (sscanf(av[k], "%d", &levels) != 1 || levels < 1) { err = 5; break; }
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      if ((pred = need(img, n, n-2)) == NULL) { err = 4; break; }
+      note("Locating I%d in I%d, coarse to fine\n", n-2, n-1);
+      if (ImageLocateSubImageCoarse(curr, &x, &y, pred, levels)) {
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(out, "# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int max;
+      if (sscanf(av[k], "%d", &max) != 1 || max < 0) { err = 5; break; }
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      if ((pred = need(img, n, n-2)) == NULL) { err = 4; break; }
+      int* xs = malloc((max > 0 ? max : 1) * sizeof(int));
+      int* ys = malloc((max > 0 ? max : 1) * sizeof(int));
+      if (xs == NULL || ys == NULL) {
+        free(xs);
+        free(ys);
+        err = 4;
+        break;
+      }
+      note("Locating all I%d in I%d\n", n-2, n-1);
+      long found = ImageLocateAllSubImages(curr, pred, max, xs, ys);
+      for (long i = 0; i < found && i < max; i++) {
+        fprintf(out, "# FOUND (%d,%d)\n", xs[i], ys[i]);
+      }
+      fprintf(out, "# MATCHES %ld\n", found);
+      free(xs);
+      free(ys);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      note("Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      ImageBlur(curr, dx, dy);
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "median") == 0) {
+      const char* filter = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      note("Filter I%d with %dx%d %s filter\n", n-1, 2*dx+1, 2*dy+1, filter);
+      if (filter[0] == 'e') {
+        ImageErode(curr, dx, dy);
+      } else if (filter[0] == 'd') {
+        ImageDilate(curr, dx, dy);
+      } else {
+        ImageMedian(curr, dx, dy);
+      }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if ((curr = need(img, n, n-1)) == NULL) { err = 4; break; }
+      note("Saving %s <- I%d\n", av[k], n-1);
+      struct ioJob* job = async ? ioQueue(&io, 1, av[k], k, curr) : NULL;
+      if (job != NULL) {
+        img[n-1].saving = job;
+      } else if (ImageSave(curr, av[k]) == 0) {
+        err = 4;
+        break;
+      }
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
+      if (n >= N && !grow(&img, &N)) { err = 3; break; }
+      note("Loading %s -> I%d\n", av[k], n);
+      // Queued after the saves before it, in case it is one of them.
+      struct ioJob* job = NULL;
+      if (async) job = (ahead != NULL && ahead->arg == k) ? ahead : ioQueue(&io, 0, av[k], k, NULL);
+      if (job != NULL) {
+        ioWait(job);
+        ioCount(job);
+        img[n] = (struct slot){ .img = job->img };
+        job->img = NULL;   // taken
+        if (img[n].img == NULL) {
+          ioCause = job->cause;
+          errno = job->errnum;
+          err = 4;
+          break;
+        }
+        ahead = NULL;
+        if ((j = nextFile(ac, av, k+1)) >= 0) ahead = ioQueue(&io, 0, av[j], j, NULL);
+      } else {
+        img[n] = (struct slot){ .img = opt->mapped ? ImageLoadMapped(av[k]) : ImageLoad(av[k]) };
+        if (img[n].img == NULL) { err = 4; break; }
+      }
       n++;
     }
     k++;
   }
+  if (err == 0 && !lazy && n > 0 && img[n-1].pend.count > 0) {
+    if (need(img, n, n-1) == NULL) { err = 4; }
+  }
+  if (async) {
+    // Finish writing the images before destroying them.
+    const char* cause = NULL;
+    int errnum = 0;
+    if (!ioStop(&io, &cause, &errnum) && err == 0) {
+      ioCause = cause;
+      errno = errnum;
+      err = 4;
+    }
+  }
   
   // Destroy remaining images
   while (n > 0) {
-    ImageDestroy(&img[--n]);
+    ImageDestroy(&img[--n].img);
   }
+  free(img);
+  return err;
+}
 
-  error(err, errno, errors[err], ImageErrMsg());
-  return 0;
+// In batch mode (--batch), the files named in the manifest are handed out
+// to the threads of the pool, and each runs the operations on its own file.
+// Image operations called inside a pool task run in the calling thread,
+// so there is no contention between files.
+struct batch {
+  int ac;
+  char** av;              // the operations, with {} for the file name
+  int k;                  // index of the first operation
+  const struct options* opt;
+  char** names;           // the files
+  int count;
+  pthread_mutex_t lock;   // serializes output
+  atomic_int failed;      // files that failed
+};
+
+// Copy of arg with every {} replaced by name, or NULL if out of memory.
+static char* substitute(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  size_t size = 1;
+  for (const char* p = arg; *p != '\0'; p++) {
+    if (p[0] == '{' && p[1] == '}') { size += len; p++; } else { size++; }
+  }
+  char* result = malloc(size);
+  if (result == NULL) return NULL;
+  char* q = result;
+  for (const char* p = arg; *p != '\0'; p++) {
+    if (p[0] == '{' && p[1] == '}') { memcpy(q, name, len); q += len; p++; } else { *q++ = *p; }
+  }
+  *q = '\0';
+  return result;
+}
+
+// Run the operations on file i of the batch (a PoolTask).
+static void batchFile(void* arg, int i) {
+  struct batch* b = arg;
+  const char* name = b->names[i];
+  int err = 0;
+  int errnum = 0;
+  char* output = NULL;
+  size_t length = 0;
+
+  char** av = calloc(b->ac, sizeof(char*));
+  FILE* out = open_memstream(&output, &length);
+  int ready = (av != NULL && out != NULL);
+  for (int k = b->k; ready && k < b->ac; k++) {
+    ready = (av[k] = substitute(b->av[k], name)) != NULL;
+  }
+  if (!ready) {
+    errnum = ENOMEM;
+    err = 4;
+  } else {
+    err = b->opt->streamed ? stream(b->ac, av, b->k) : run(b->ac, av, b->k, b->opt, out);
+    errnum = errno;
+  }
+  if (out != NULL) fclose(out);
+
+  pthread_mutex_lock(&b->lock);
+  if (length > 0) {
+    printf("# File: %s\n%s", name, output);
+  }
+  if (err != 0) {
+    atomic_fetch_add(&b->failed, 1);
+    char message[256];
+    snprintf(message, sizeof(message), errors[err], errMsg());
+    error(0, errnum, "%s: %s", name, message);
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  free(output);
+  if (av != NULL) {
+    for (int k = b->k; k < b->ac; k++) free(av[k]);
+  }
+  free(av);
 }
 
+// Read the file names in manifest, one per line, skipping empty lines.
+// Returns the number of names, or -1 on failure.
+static int readManifest(const char* manifest, char*** names) {
+  FILE* f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+  if (f == NULL) return -1;
+  int count = 0;
+  int capacity = 0;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int ok = 1;
+  *names = NULL;
+  while (ok && (len = getline(&line, &size, f)) != -1) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+    if (len == 0) continue;
+    if (count == capacity) {
+      capacity = capacity > 0 ? 2*capacity : 64;
+      char** grown = realloc(*names, capacity * sizeof(char*));
+      if (grown == NULL) { ok = 0; break; }
+      *names = grown;
+    }
+    if (((*names)[count] = strdup(line)) == NULL) { ok = 0; break; }
+    count++;
+  }
+  ok = ok && !ferror(f);
+  free(line);
+  if (f != stdin) fclose(f);
+  if (!ok) {
+    while (count > 0) free((*names)[--count]);
+    free(*names);
+    *names = NULL;
+    return -1;
+  }
+  return count;
+}
+
+// Apply the operations in av[k..] to every file in manifest.
+// Returns the error code.
+static int batch(int ac, char* av[], int k, const struct options* opt, const char* manifest) {
+  struct batch b = { .ac = ac, .av = av, .k = k, .opt = opt };
+  b.count = readManifest(manifest, &b.names);
+  if (b.count < 0) return 9;
+  pthread_mutex_init(&b.lock, NULL);
+  atomic_init(&b.failed, 0);
+  quiet = 1;
+
+  PoolRun(b.count, batchFile, &b);
+
+  pthread_mutex_destroy(&b.lock);
+  for (int i = 0; i < b.count; i++) free(b.names[i]);
+  free(b.names);
+  errno = 0;
+  return atomic_load(&b.failed) > 0 ? 10 : 0;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  int err = 0;
+  struct options opt = { 0, 0, 0, 0 };
+  const char* manifest = NULL;
+
+  int k = 1;
+  for (; k < ac; k++) {
+    if (strcmp(av[k], "--lazy") == 0) {
+      opt.lazy = 1;
+    } else if (strcmp(av[k], "--mmap") == 0) {
+      opt.mapped = 1;
+    } else if (strcmp(av[k], "--async") == 0) {
+      opt.async = 1;
+    } else if (strcmp(av[k], "--stream") == 0) {
+      opt.streamed = 1;
+    } else if (strcmp(av[k], "--batch") == 0) {
+      if (++k >= ac) { error(1, 0, errors[1]); }
+      manifest = av[k];
+    } else {
+      break;
+    }
+  }
+  if (manifest != NULL) {
+    err = batch(ac, av, k, &opt, manifest);
+  } else if (opt.streamed) {
+    err = stream(ac, av, k);
+  } else {
+    err = run(ac, av, k, &opt, stdout);
+  }
+
+  error(err, errno, errors[err], errMsg());
+  return 0;
+}
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: done on first InstrPrint
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -20,8 +20,20 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +54,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,22 +86,33 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// The performance counter already measures elapsed time.
+double wall_time(void) {
+  return cpu_time();
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one array per thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds), per thread
+_Thread_local double InstrTime;  ///extern
+
+/// Wall_time read on previous reset (~seconds), per thread
+_Thread_local double InstrWall;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+// Has InstrCTU been measured?
+static atomic_int calibrated;
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -99,31 +130,402 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  atomic_store(&calibrated, 1);
+}
+
+// A name for the processor model, to key the cache of calibrations.
+// Returns 0 if it cannot be found.
+static int cpuModel(char* model, size_t size) {
+  int found = 0;
+#if defined(__linux__)
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return 0;
+  char line[512];
+  const char* keys[] = { "model name", "Hardware", "Processor", "cpu model" };
+  int best = sizeof(keys) / sizeof(keys[0]);   // index of the key found
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (colon == NULL) continue;
+    for (int k = 0; k < best; k++) {
+      if (strncmp(line, keys[k], strlen(keys[k])) == 0) {
+        char* value = colon + 1;
+        value += strspn(value, " \t");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        found = (*value != '\0');
+        best = k;
+        break;
+      }
+    }
+  }
+  fclose(f);
+#elif defined(__APPLE__)
+  found = sysctlbyname("machdep.cpu.brand_string", model, &size, NULL, 0) == 0;
+#else
+  (void)model; (void)size;
+#endif
+  return found;
+}
+
+// Look up the CTU of model in the cache file: lines "MODEL\tCTU", where
+// the last line for a model wins.  Returns 1 if found.
+static int readCache(const char* cache, const char* model, double* ctu) {
+  FILE* f = fopen(cache, "r");
+  if (f == NULL) return 0;
+  int found = 0;
+  size_t len = strlen(model);
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    double value;
+    if (strncmp(line, model, len) == 0 && line[len] == '\t' &&
+        sscanf(line + len + 1, "%lf", &value) == 1 && value > 0.0) {
+      *ctu = value;
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// Add the CTU of model to the cache file.
+// A single append, so concurrent processes do not garble the file.
+static void writeCache(const char* cache, const char* model, double ctu) {
+  FILE* f = fopen(cache, "a");
+  if (f == NULL) return;
+  fprintf(f, "%s\t%.9g\n", model, ctu);
+  fclose(f);
+}
+
+// Find the CTU, unless the environment says otherwise:
+//   INSTR_CTU=SECONDS  use that CTU; 0 (or not a number) keeps 1s,
+//                      so caltime is just the time.
+//   INSTR_CACHE=FILE   keep calibrations in FILE, by processor model,
+//                      and calibrate only for models not in it yet.
+static void calibrateIfNeeded(void) {
+  if (atomic_load(&calibrated)) return;
+  const char* given = getenv("INSTR_CTU");
+  if (given != NULL && *given != '\0') {
+    double ctu = atof(given);
+    if (ctu > 0.0) InstrCTU = ctu;
+    atomic_store(&calibrated, 1);
+    return;
+  }
+  const char* cache = getenv("INSTR_CACHE");
+  char model[256];
+  if (cache != NULL && *cache != '\0' && cpuModel(model, sizeof(model))) {
+    double ctu;
+    if (readCache(cache, model, &ctu)) {
+      InstrCTU = ctu;
+      atomic_store(&calibrated, 1);
+      return;
+    }
+    InstrCalibrate();
+    writeCache(cache, model, InstrCTU);
+    return;
+  }
+  InstrCalibrate();
+}
+
+// Calibrate, if not done yet.  Calibration is lazy, since it takes a
+// while, and many runs never report times (only InstrPrint needs it).
+static void needCalibration(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  if (!atomic_load(&calibrated)) pthread_once(&once, calibrateIfNeeded);
+}
+
+// Hardware counters, read through perf_event_open on Linux.
+static const char* perfName[NUMPERF] = { "cycles", "instructions", "llcmiss", "brmiss" };
+
+// Are they wanted? 0: not decided yet, 1: yes, -1: no.
+static atomic_int perfWanted;
+
+// The counters of each thread: a file descriptor (-1 if not available)
+// and the value read on the last reset.
+static _Thread_local int perfOpened;   // tried to open, in this thread?
+static _Thread_local int perfFd[NUMPERF];
+static _Thread_local unsigned long perfBase[NUMPERF];
+
+// Have hardware counters been requested (by InstrPerfEnable or INSTR_PERF)?
+static int perfRequested(void) {
+  int wanted = atomic_load(&perfWanted);
+  if (wanted == 0) {
+    const char* env = getenv("INSTR_PERF");
+    wanted = (env != NULL && *env != '\0' && strcmp(env, "0") != 0) ? 1 : -1;
+    atomic_store(&perfWanted, wanted);
+  }
+  return wanted > 0;
+}
+
+void InstrPerfEnable(void) { ///
+  atomic_store(&perfWanted, 1);
+}
+
+#if defined(__linux__)
+
+// Open the counters of this thread, once.
+// They also count the threads it creates afterwards, but not those that
+// exist already: see InstrPerfOpen.
+static void perfOpen(void) {
+  static const unsigned long long config[NUMPERF] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  perfOpened = 1;
+  for (int i = 0; i < NUMPERF; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;   // allowed with the default perf_event_paranoid
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    perfFd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+// Current value of counter i, scaled if the kernel had to multiplex it.
+// Returns 0 if it cannot be read.
+static int perfRead(int i, unsigned long* value) {
+  unsigned long long data[3];   // value, time enabled, time running
+  if (perfFd[i] < 0 || read(perfFd[i], data, sizeof(data)) != (ssize_t)sizeof(data))
+    return 0;
+  if (data[2] == 0) return 0;   // never scheduled on the hardware
+  if (data[2] < data[1])
+    data[0] = (unsigned long long)((double)data[0] * data[1] / data[2]);
+  *value = (unsigned long)data[0];
+  return 1;
+}
+
+#else
+
+static void perfOpen(void) {
+  perfOpened = 1;
+  for (int i = 0; i < NUMPERF; i++) perfFd[i] = -1;
 }
 
-/// Reset counters to zero and store cpu_time.
+static int perfRead(int i, unsigned long* value) {
+  (void)i; (void)value;
+  return 0;
+}
+
+#endif
+
+void InstrPerfOpen(void) { ///
+  if (perfRequested() && !perfOpened) perfOpen();
+}
+
+// Store the current counts, to be subtracted on print.
+static void perfReset(void) {
+  if (!perfRequested()) return;
+  InstrPerfOpen();
+  for (int i = 0; i < NUMPERF; i++) {
+    if (!perfRead(i, &perfBase[i])) perfBase[i] = 0;
+  }
+}
+
+int InstrPerfCount(unsigned long count[NUMPERF]) { ///
+  int available = 0;
+  for (int i = 0; i < NUMPERF; i++) {
+    unsigned long value;
+    if (perfOpened && perfRead(i, &value)) {
+      count[i] = value - perfBase[i];
+      available |= 1 << i;
+    }
+  }
+  return available;
+}
+
+// Names of the timers, registered on first use: timerNames[0..timerCount).
+// A name is stored before timerCount grows, so readers never lock.
+static const char* timerNames[NUMTIMERS];
+static atomic_int timerCount;
+static pthread_mutex_t timerLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The timers of each thread.
+static _Thread_local struct {
+  unsigned long calls;
+  double cpu;
+  double wall;
+} timers[NUMTIMERS];
+
+// Index of the timer called name, registering it if new.
+// Returns -1 if all timers are taken.
+static int timerId(const char* name) {
+  int n = atomic_load(&timerCount);
+  for (int i = 0; i < n; i++) {
+    if (timerNames[i] == name) return i;
+  }
+  for (int i = 0; i < n; i++) {
+    if (strcmp(timerNames[i], name) == 0) return i;
+  }
+  pthread_mutex_lock(&timerLock);
+  int id = -1;
+  n = atomic_load(&timerCount);
+  for (int i = 0; i < n && id < 0; i++) {
+    if (strcmp(timerNames[i], name) == 0) id = i;
+  }
+  if (id < 0 && n < NUMTIMERS) {
+    timerNames[n] = name;
+    atomic_store(&timerCount, n + 1);
+    id = n;
+  }
+  pthread_mutex_unlock(&timerLock);
+  return id;
+}
+
+InstrTimer InstrTimerBegin(const char* name) { ///
+  InstrTimer t;
+  t.id = timerId(name);
+  t.cpu = cpu_time();
+  t.wall = wall_time();
+  return t;
+}
+
+void InstrTimerEnd(InstrTimer t) { ///
+  if (t.id < 0) return;
+  timers[t.id].calls++;
+  timers[t.id].cpu += cpu_time() - t.cpu;
+  timers[t.id].wall += wall_time() - t.wall;
+}
+
+void InstrTake(InstrWork* w) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    w->count[i] = InstrCount[i];
+    InstrCount[i] = 0ul;
+  }
+  for (int i = 0; i < NUMTIMERS; i++) {
+    w->timer[i].calls = timers[i].calls;
+    w->timer[i].cpu = timers[i].cpu;
+    w->timer[i].wall = timers[i].wall;
+    timers[i].calls = 0ul;
+    timers[i].cpu = timers[i].wall = 0.0;
+  }
+}
+
+void InstrAdd(const InstrWork* w) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    InstrCount[i] += w->count[i];
+  for (int i = 0; i < NUMTIMERS; i++) {
+    timers[i].calls += w->timer[i].calls;
+    timers[i].cpu += w->timer[i].cpu;
+    timers[i].wall += w->timer[i].wall;
+  }
+}
+
+/// Reset counters and timers to zero and store cpu_time and wall_time.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  for (int i = 0; i < NUMTIMERS; i++) {
+    timers[i].calls = 0ul;
+    timers[i].cpu = timers[i].wall = 0.0;
+  }
+  perfReset();
   InstrTime = cpu_time();
+  InstrWall = wall_time();
+}
+
+// Print s as a JSON string.
+static void printJSONString(FILE* f, const char* s) {
+  putc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') putc('\\', f);
+    if ((unsigned char)*s < ' ') fprintf(f, "\\u%04x", *s); else putc(*s, f);
+  }
+  putc('"', f);
 }
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
+  InstrPrintTo(stdout);
+}
+
+void InstrPrintTo(FILE* f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double wall = wall_time() - InstrWall;
+  unsigned long perf[NUMPERF];
+  int available = InstrPerfCount(perf);
+  if (!atomic_load(&calibrated)) {
+    // Leave the calibration out of the times of the next print, too.
+    double cpu0 = cpu_time();
+    double wall0 = wall_time();
+    needCalibration();
+    InstrTime += cpu_time() - cpu0;
+    InstrWall += wall_time() - wall0;
+  }
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  int ntimers = atomic_load(&timerCount);
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+  const char* format = getenv("INSTR_FORMAT");
+  if (format != NULL && strcmp(format, "json") == 0) {
+    fprintf(f, "{\"time\": %.6f, \"wall\": %.6f, \"caltime\": %.6f, \"counters\": {", time, wall, caltime);
+    const char* sep = "";
+    for (int i = 0; i < NUMCOUNTERS; i++) {
+      if (InstrName[i] != NULL) {
+        fputs(sep, f);
+        printJSONString(f, InstrName[i]);
+        fprintf(f, ": %lu", InstrCount[i]);
+        sep = ", ";
+      }
+    }
+    for (int i = 0; i < NUMPERF; i++) {
+      if (available & (1 << i)) {
+        fprintf(f, "%s\"%s\": %lu", sep, perfName[i], perf[i]);
+        sep = ", ";
+      }
+    }
+    fputs("}, \"timers\": {", f);
+    sep = "";
+    for (int i = 0; i < ntimers; i++) {
+      if (timers[i].calls > 0) {
+        fputs(sep, f);
+        printJSONString(f, timerNames[i]);
+        fprintf(f, ": {\"calls\": %lu, \"time\": %.6f, \"wall\": %.6f}",
+                timers[i].calls, timers[i].cpu, timers[i].wall);
+        sep = ", ";
+      }
+    }
+    fputs("}}\n", f);
+  } else if (format != NULL && strcmp(format, "csv") == 0) {
+    // Names are not quoted: counter and timer names have no commas.
+    // The times of the timers are in seconds, not calibrated.
+    fprintf(f, "kind,name,calls,time,wall,count\n");
+    fprintf(f, "total,,,%.6f,%.6f,\n", time, wall);
+    fprintf(f, "caltime,,,%.6f,,\n", caltime);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, "counter,%s,,,,%lu\n", InstrName[i], InstrCount[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (available & (1 << i))
+        fprintf(f, "perf,%s,,,,%lu\n", perfName[i], perf[i]);
+    for (int i = 0; i < ntimers; i++)
+      if (timers[i].calls > 0)
+        fprintf(f, "timer,%s,%lu,%.6f,%.6f,\n", timerNames[i], timers[i].calls,
+                timers[i].cpu, timers[i].wall);
+  } else {
+    fprintf(f, "#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "wall");
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, "\t%15.15s", InstrName[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (available & (1 << i))
+        fprintf(f, "\t%15.15s", perfName[i]);
+    fputs("\n", f);
+    fprintf(f, "%15.6f\t%15.6f\t%15.6f", time, caltime, wall);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, "\t%15lu", InstrCount[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (available & (1 << i))
+        fprintf(f, "\t%15lu", perf[i]);
+    fputs("\n", f);
+    for (int i = 0; i < ntimers; i++)
+      if (timers[i].calls > 0)
+        fprintf(f, "#%14.15s\t%15.6f\t%15.6f\t%15.6f\t%15lu calls\n", timerNames[i],
+                timers[i].cpu, timers[i].cpu / InstrCTU, timers[i].wall, timers[i].calls);
+  }
 }
-
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: done on first InstrPrint
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,24 +18,39 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Named timers measure parts of the work, e.g. each image operation:
+///
+/// InstrTimer t = InstrTimerBegin("blur");
+/// ...
+/// InstrTimerEnd(t);  // adds one call and its times to the "blur" timer
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
-/// Cpu time in seconds
+#include <stdio.h>
+
+/// Cpu time in seconds (of the whole process, all threads together)
 double cpu_time(void) ; ///
 
+/// Wall-clock time in seconds, from an arbitrary origin
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one array per thread, so threads
+/// counting at the same time do not disturb each other):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds), per thread
+extern _Thread_local double InstrTime;  ///extern
+
+/// Wall_time read on previous reset (~seconds), per thread
+extern _Thread_local double InstrWall;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
@@ -43,12 +58,105 @@ extern double InstrCTU;  ///extern
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// This takes a while, so it is done only when first needed (by InstrPrint),
+/// unless called explicitly.
+/// When done on first need, the environment may avoid it:
+///   INSTR_CTU=SECONDS  use that CTU instead (0: keep 1s, so that
+///                      caltime is the time in seconds);
+///   INSTR_CACHE=FILE   reuse the CTU saved in FILE for this processor
+///                      model, or calibrate and save it there.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters and timers to zero and store cpu_time and wall_time.
+/// Starts the hardware counters too, if requested (see InstrPerfEnable).
 void InstrReset(void) ;
 
+/// Print the times, counters and timers of this thread since the last reset.
+/// Calibrates first, if not done yet (see InstrCalibrate), and leaves that
+/// time out of this and later prints.
+/// The format is chosen by the INSTR_FORMAT environment variable:
+///   text (the default)  tab-separated columns with a header, then a line
+///                       per timer used, with its name, times and calls;
+///   json                a single JSON object per call, on one line;
+///   csv                 a header and one row per value:
+///                       kind,name,calls,time,wall,count
 void InstrPrint(void) ;
 
+/// Same as InstrPrint, but to f.
+void InstrPrintTo(FILE* f) ;
+
+/// Hardware counters
+
+/// Where the system allows it (Linux perf_event_open), InstrReset also
+/// starts hardware counters, and InstrPrint shows them after InstrCount,
+/// as if they were more counters:
+///   cycles, instructions   cpu cycles and instructions retired;
+///   llcmiss                last level cache misses;
+///   brmiss                 mispredicted branches.
+/// They count user mode only, in the thread that opens them (on its first
+/// InstrReset, or InstrPerfOpen) and in the threads it creates afterwards;
+/// threads that already exist then are not counted.
+/// They are off unless InstrPerfEnable is called or the INSTR_PERF
+/// environment variable is set (and not 0). Counters the processor or
+/// the system does not provide are just left out.
+#define NUMPERF 4
+
+/// Request hardware counters, from the next InstrReset on.
+void InstrPerfEnable(void) ;
+
+/// Open the hardware counters of this thread now, if requested, instead of
+/// on its first InstrReset.  Call it before starting threads whose work
+/// should be counted (ImageInit does, before the pool threads start).
+void InstrPerfOpen(void) ;
+
+/// Get the hardware counters since the last InstrReset, in this thread.
+/// Returns a bit mask with bit i set if count[i] is available
+/// (0 if none is, e.g. when not requested).
+int InstrPerfCount(unsigned long count[NUMPERF]) ;
+
+/// Named timers
+
+/// Up to NUMTIMERS different names may be used.
+#define NUMTIMERS 32
+
+/// A running timer, from InstrTimerBegin.
+typedef struct {
+  int id;       // which timer (-1 if there is no room for its name)
+  double cpu;   // cpu_time and wall_time when started
+  double wall;
+} InstrTimer;
+
+/// Start timing a part of the work, under the given name.
+/// name must remain valid (a string literal, usually).
+/// Timers may nest: each just measures its own interval.
+InstrTimer InstrTimerBegin(const char* name) ;
+
+/// Stop timer t, adding one call and its times to its name, in this thread.
+void InstrTimerEnd(InstrTimer t) ;
+
+/// Work done in other threads
+
+/// Counters and timers are kept per thread.  Work that a helper thread does
+/// for another (e.g. reading files in the background) is moved to it with:
+///
+/// InstrWork w;
+/// InstrTake(&w);  // in the helper, after the work
+/// ...
+/// InstrAdd(&w);   // in the thread that reports it
+typedef struct {
+  unsigned long count[NUMCOUNTERS];
+  struct {
+    unsigned long calls;
+    double cpu;
+    double wall;
+  } timer[NUMTIMERS];
+} InstrWork;
+
+/// Move the counters and timers of this thread to *w, leaving them at zero.
+void InstrTake(InstrWork* w) ;
+
+/// Add the counters and timers in *w to those of this thread.
+void InstrAdd(const InstrWork* w) ;
+
 #endif
 
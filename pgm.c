@@ -0,0 +1,51 @@
+/// PGM header parsing, shared by the image modules.
+///
+/// AED, 2023
+///
+/// See pgm.h for usage.
+
+#include "pgm.h"
+#include <ctype.h>
+#include <limits.h>
+
+// Skip whitespace and comments (from # to the end of the line).
+// Returns the next character, which is left unread (or EOF).
+static int skipSpace(FILE *f) {
+  int c;
+  while ((c = getc_unlocked(f)) != EOF) {
+    if (c == '#') {
+      while ((c = getc_unlocked(f)) != EOF && c != '\n') {
+      }
+    } else if (!isspace(c)) {
+      ungetc(c, f);
+      break;
+    }
+  }
+  return c;
+}
+
+int PGMReadNumber(FILE* f, int* v) { ///
+  int c = skipSpace(f);
+  if (c == EOF || !isdigit(c)) return 0;
+  long n = 0;
+  while ((c = getc_unlocked(f)) != EOF && isdigit(c)) {
+    n = 10 * n + (c - '0');
+    if (n > INT_MAX) return 0;
+  }
+  if (c != EOF) ungetc(c, f);
+  *v = (int)n;
+  return 1;
+}
+
+const char* PGMReadHeader(FILE* f, int* width, int* height, int* maxval, int* plain) { ///
+  int p = getc_unlocked(f);
+  int c = getc_unlocked(f);
+  *plain = (c == '2');
+  if (p != 'P' || (c != '5' && c != '2')) return "Invalid file format";
+  if (!PGMReadNumber(f, width)) return "Invalid width";
+  if (!PGMReadNumber(f, height)) return "Invalid height";
+  if (!PGMReadNumber(f, maxval) || *maxval <= 0 || *maxval > PGM_MAXVAL) return "Invalid maxval";
+  c = getc_unlocked(f);
+  if (c == EOF || !isspace(c)) return "Whitespace expected";
+  return NULL;
+}
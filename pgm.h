@@ -0,0 +1,30 @@
+/// PGM header parsing, shared by the image modules.
+///
+/// AED, 2023
+///
+/// See also:
+/// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+
+#ifndef PGM_H
+#define PGM_H
+
+#include <stdio.h>
+
+/// Largest maxval allowed by the PGM format.
+#define PGM_MAXVAL 65535
+
+/// Parse the header of a PGM file, leaving f at the first pixel.
+/// Accepts raw (P5) and plain (P2, ASCII) files: *plain tells which.
+/// Comments are accepted wherever whitespace is, and any maxval in
+/// [1, PGM_MAXVAL]: the caller must check the maxval it supports.
+/// The header is parsed character by character from the stdio buffer
+/// of f, without scanf, so f may also be a pipe.
+/// Returns NULL on success, or a message describing the failure.
+const char* PGMReadHeader(FILE* f, int* width, int* height, int* maxval, int* plain) ;
+
+/// Read a decimal number into *v, after whitespace and comments
+/// (as the levels of a plain PGM file).
+/// Returns 1 on success, 0 if there is no number or it does not fit an int.
+int PGMReadNumber(FILE* f, int* v) ;
+
+#endif
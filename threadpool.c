@@ -0,0 +1,145 @@
+/// A minimal thread pool module.
+///
+/// AED, 2023
+///
+/// See threadpool.h for usage.
+
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Upper limit on the number of threads.
+#define POOL_MAX 64
+
+// The job being run.  Only one at a time.
+static struct {
+  PoolTask task;
+  void *arg;
+  int n;
+  int workers;          // pool threads taking part (the first ones)
+  atomic_int next;      // next part to hand out
+} job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // a job was posted
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;  // a worker finished
+static unsigned long generation;  // number of jobs posted so far
+static int running;               // workers still on the current job
+
+// Held while a job uses the pool.
+static pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the configuration below.
+static pthread_mutex_t config = PTHREAD_MUTEX_INITIALIZER;
+static int limit;                 // threads wanted (<= 0: one per processor)
+static int nworkers;              // pool threads started
+static int failed;                // could not start more pool threads
+
+// Set while this thread is running parts of a job.
+static _Thread_local int inPool;
+
+// Claim and run parts of the current job until there are none left.
+static void work(void) {
+  inPool = 1;
+  int k;
+  while ((k = atomic_fetch_add(&job.next, 1)) < job.n) {
+    job.task(job.arg, k);
+  }
+  inPool = 0;
+}
+
+static void *worker(void *arg) {
+  int index = (int)(intptr_t)arg;
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    while (generation == seen) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    seen = generation;
+    int part = index < job.workers;
+    pthread_mutex_unlock(&lock);
+
+    if (!part) continue;  // not needed for this job
+    work();
+
+    pthread_mutex_lock(&lock);
+    if (--running == 0) {
+      pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+int PoolThreads(void) { ///
+  pthread_mutex_lock(&config);
+  int want = limit;
+  if (want <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    want = cpus < 1 ? 1 : cpus > POOL_MAX ? POOL_MAX : (int)cpus;
+  }
+
+  // Start the missing pool threads, besides the calling thread.
+  // If threads cannot be created, fewer (maybe none) are used.
+  if (nworkers + 1 < want && !failed) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (nworkers + 1 < want) {
+      pthread_t t;
+      if (pthread_create(&t, &attr, worker, (void *)(intptr_t)nworkers) != 0) {
+        failed = 1;
+        break;
+      }
+      nworkers++;
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  int n = (want < nworkers + 1) ? want : nworkers + 1;
+  pthread_mutex_unlock(&config);
+  return n;
+}
+
+void PoolSetThreads(int n) { ///
+  pthread_mutex_lock(&config);
+  limit = (n > POOL_MAX) ? POOL_MAX : n;
+  pthread_mutex_unlock(&config);
+}
+
+void PoolRun(int n, PoolTask task, void *arg) { ///
+  if (n <= 0) return;
+  // Run inline if there is nothing to share, if this is a nested call
+  // from a task, or if another thread is using the pool.
+  int threads = (n == 1 || inPool) ? 1 : PoolThreads();
+  if (threads == 1 || pthread_mutex_trylock(&busy) != 0) {
+    for (int k = 0; k < n; k++) {
+      task(arg, k);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  job.task = task;
+  job.arg = arg;
+  job.n = n;
+  job.workers = threads - 1;
+  atomic_store(&job.next, 0);
+  running = job.workers;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  work();
+
+  pthread_mutex_lock(&lock);
+  while (running > 0) {
+    pthread_cond_wait(&done, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&busy);
+}
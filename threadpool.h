@@ -0,0 +1,37 @@
+/// A minimal thread pool module.
+///
+/// AED, 2023
+///
+/// Use as follows:
+///
+/// static void task(void *arg, int k) {
+///   // process part k of the work described by arg
+/// }
+/// ...
+/// PoolRun(n, task, &work);  // run task(&work, k) for k = 0, ..., n-1
+///
+/// The parts are handed out in increasing order of k to the pool threads
+/// and to the calling thread, and PoolRun returns when all are done.
+/// Nested or concurrent calls do not wait for the pool: they just run
+/// all their parts in the calling thread.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/// A task is called once for each part k of the work.
+typedef void (*PoolTask)(void *arg, int k);
+
+/// Number of threads that run the tasks (including the caller).
+/// The pool threads are started on first use.
+int PoolThreads(void) ;
+
+/// Set the number of threads that run the tasks (including the caller).
+/// n <= 0 selects one per online processor (the default), and n == 1
+/// runs everything in the calling thread.
+void PoolSetThreads(int n) ;
+
+/// Run task(arg, k) for k in [0, n), on all pool threads,
+/// and wait until all parts are done.
+void PoolRun(int n, PoolTask task, void *arg) ;
+
+#endif